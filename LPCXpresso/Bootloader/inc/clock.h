@@ -0,0 +1,36 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The clock profile of the bootloader.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#ifndef CLOCK_H__
+#define CLOCK_H__
+
+/** The frequency of the crystal of the main oscillator */
+#define CLOCK_CRYSTAL    12000000
+
+/** The frequency of the internal RC oscillator, the clock after a reset */
+#define CLOCK_IRC        4000000
+
+/** The core clock of the parts that run up to 120MHz */
+#define CLOCK_FAST       120000000
+
+/** The core clock of the other parts */
+#define CLOCK_NORMAL     100000000
+
+void initClock( void );
+void deinitClock( void );
+
+#endif
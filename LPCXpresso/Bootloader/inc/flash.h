@@ -18,24 +18,50 @@
 #ifndef FLASH_H__
 #define FLASH_H__
 
+/** The number of application slots, see geometry.c for the layout */
+#define SLOT_COUNT 2
+
+/** The slot number used when there is no slot */
+#define NO_SLOT    0xFF
+
 /**
  * The status of a flash action.
  */
 typedef enum {
-	FLASH_SUCCESS     =  0,  /** No errors. */
+	FLASH_UNCHANGED   =  2, /** The flash already contained the block, nothing was written. */
+	FLASH_STAGED      =  1, /** The block is kept in RAM until the rest of its sector arrives, it is not written yet. */
+	FLASH_SUCCESS     =  0, /** No errors. */
 	COMPARE_FAILURE   = -1, /** Flashing went wrong, after flashing the compare failed so the flash is probably broken. */
-	BOOTLOADER_SECTOR = -2, /** Tried to flash the bootloader sector. */
+	BOOTLOADER_SECTOR = -2, /** Tried to flash the bootloader, the active slot or the journal. */
 	INVALID_POINTER   = -3  /** One of the pointer is invalid or the region to be copied is invalid. */
 } flashStatus;
 
+/** The smallest block of a session, as a power of two */
+#define BLOCK_SHIFT_MIN    8
+
+/** The largest block of a session, as a power of two */
+#define BLOCK_SHIFT_MAX    15
+
+/** The size of a virtual sector, as a power of two */
+#define BLOCK_SHIFT_SECTOR 12
+
+/**
+ * A block of a session. Blocks smaller than a virtual sector are parts
+ * of it and are only flashed when the sector is complete, larger blocks
+ * span several virtual sectors.
+ */
 typedef struct {
-	uint8_t sector;
-	uint8_t data[4096] __attribute__((aligned(4))); // TODO: IAP will not work if data is not word-aligned. Use linker script.
+	uint8_t sector;  /** The virtual sector of the first byte of the block */
+	uint8_t part;    /** The part of the sector, for blocks smaller than a sector */
+	uint8_t shift;   /** The size of the block as a power of two */
+	uint8_t *data;   /** The word aligned data in RAM, IAP only writes from word aligned RAM */
 } DataBlock;
 
 void initFlash( void );
 void deinitFlash( void );
 flashStatus flashNode( DataBlock *block );
-void getSectorDetails(uint8_t sector, uint32_t *address);
+flashStatus flashFlush( void );
+uint8_t flashLost( uint8_t *sector );
+uint8_t *flashStage( void );
 
 #endif
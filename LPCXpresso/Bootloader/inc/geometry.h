@@ -0,0 +1,61 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The geometry of the flash of the LPC17xx parts and the layout of the
+ * bootloader, the application slots and the journal on it.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#ifndef GEOMETRY_H__
+#define GEOMETRY_H__
+
+/** The number of virtual sectors of the bootloader, the small sectors every part has */
+#define BOOTLOADER_SECTORS 16
+
+/** The size of the largest physical sector of all parts */
+#define FLASH_SECTOR_MAX   32768
+
+/** The number of write sizes IAP supports */
+#define FLASH_WRITE_SIZES  4
+
+/**
+ * A physical sector of the flash.
+ */
+typedef struct {
+	uint32_t address; /** The address of the first byte */
+	uint32_t size;    /** The size in bytes */
+} FlashSector;
+
+/**
+ * A part of the LPC17xx family.
+ */
+typedef struct {
+	uint32_t partId;  /** The part identification number IAP reports */
+	uint8_t  sectors; /** The number of physical sectors */
+} FlashPart;
+
+/** The sizes IAP can write at once, from small to large */
+extern const uint16_t flashWriteSizes[FLASH_WRITE_SIZES];
+
+void initGeometry( void );
+uint8_t getSectorCount( void );
+uint32_t getSectorAddress( uint8_t sector );
+uint32_t getSectorSize( uint8_t sector );
+uint8_t getPhysicalSector( uint8_t virtualSector );
+uint8_t getJournalSector( void );
+uint8_t getSlotSectors( void );
+uint8_t getSlotFirstSector( uint8_t slot );
+uint32_t getSlotAddress( uint8_t slot );
+uint8_t getSlotOfSector( uint8_t virtualSector );
+
+#endif
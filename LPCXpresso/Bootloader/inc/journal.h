@@ -0,0 +1,47 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The journal that keeps the state of the bootloader in flash.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include "flash.h"
+#include "storage.h"
+#include "resume.h"
+
+#ifndef JOURNAL_H__
+#define JOURNAL_H__
+
+/**
+ * The state of the bootloader, the journal keeps it in RAM and
+ * every change to it is one entry in the journal in flash.
+ */
+typedef struct {
+	uint32_t   bootCount;                /** The number of times the application was started */
+	uint32_t   active;                   /** The slot to boot or NO_SLOT */
+	SlotHeader slots[SLOT_COUNT];        /** The headers of the slots */
+	uint32_t   image;                    /** The image of the session */
+	uint8_t    first;                    /** The virtual sector of the first block of the session */
+	uint8_t    blocks;                   /** The number of blocks in the image of the session */
+	uint8_t    done[RESUME_BITMAP_SIZE]; /** The blocks of the session that are flashed */
+} JournalState;
+
+void initJournal( void );
+void deinitJournal( void );
+const JournalState *getJournal( void );
+uint8_t journalSlot( uint8_t active, uint8_t slot, const SlotHeader *header );
+uint8_t journalSession( uint32_t image, uint8_t first, uint8_t blocks );
+uint8_t journalBlock( uint8_t block );
+void journalBoot( void );
+
+#endif
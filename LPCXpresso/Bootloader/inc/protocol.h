@@ -15,24 +15,80 @@
 
 #include <stdint.h>
 
+#include "can.h"
 #include "flash.h"
 
 #ifndef PROTOCOL_H__
 #define PROTOCOL_H__
 
+/** The short address of a node that has not been assigned one yet */
+#define NO_ADDRESS         0xFFFF
+
+/** The bit of a message of the programmer in the IDs a node buffers, see canAccept */
+#define PROGRAMMER_ID(id)  ( 1UL << ( (id) - 0x100 ) )
+
+/** The number of short addresses covered by one select message */
+#define SELECT_BITMAP_SIZE 48
+
+/** The time between the digest replies of two consecutive short addresses */
+#define DIGEST_SLOT_MS     2
+
+/** The time between the profile replies of two consecutive short addresses */
+#define PROFILE_SLOT_MS    25
+
+/** The time between the session replies of two consecutive short addresses */
+#define SESSION_SLOT_MS    3
+
+/** The number of buffered messages at which a node asks the programmer to slow down */
+#define PACE_HIGH_WATER    ( CAN_RX_BUFFER_SIZE / 2 )
+
+/** The number of buffered messages below which a node may ask again */
+#define PACE_LOW_WATER     ( CAN_RX_BUFFER_SIZE / 8 )
+
 /**
  * The statuses that the protocol can communicate to the main function.
  */
 typedef enum {
 	NO_ACTION,  /** No action needed */
 	BOOTLOADER, /** Go into bootloader mode, meaning do not jump to user program */
-	DATA_READY, /** 4kB of data have been downloaded and are ready to be flashed */
-	RESET_NODE  /** Reset the node  */
+	DATA_READY, /** A block has been downloaded and is ready to be flashed */
+	RESET_NODE, /** Reset the node  */
+	SESSION,    /** The programmer started a session, check what can be resumed */
+	COMMIT,     /** Boot the slot of the session from now on */
+	ROLLBACK,   /** Boot the other slot again */
+	SLOT_QUERY, /** The programmer asks which slot the node boots */
+	DIGEST,     /** The programmer asks for the digest of a region of flash */
+	PROFILE_QUERY /** The programmer asks where the time of the node went */
 } ProtocolState;
 
-void initProtocol( DataBlock *block );
+/**
+ * The image the programmer is going to send in this session.
+ */
+typedef struct {
+	uint32_t image;   /** The identifier of the image, the CRC-32C of its blocks */
+	uint8_t  blocks;  /** The number of blocks in the image */
+	uint8_t  base;    /** The virtual sector the image is linked for */
+	uint8_t  shift;   /** The size of the blocks as a power of two, agreed at the start */
+	uint16_t version; /** The version the image gets when it is committed */
+} Session;
+
+/**
+ * The region of flash the programmer wants the digest of.
+ */
+typedef struct {
+	uint32_t address; /** The address of the first byte */
+	uint32_t length;  /** The number of bytes */
+} DigestRequest;
+
+void initProtocol( DataBlock *block, Session *session, DigestRequest *digest );
 void deinitProtocol( void );
 ProtocolState check( void );
-void dataStatus( flashStatus state );
+void dataStatus( flashStatus state, uint8_t lostSector, uint8_t lostBlocks );
+void sessionStatus( uint8_t *bitmap );
+void sessionRefused( uint8_t shift );
+void slotResult( uint8_t success );
+void slotStatus( uint8_t active, uint8_t *states, uint16_t version, uint8_t failed );
+void digestStatus( uint32_t hash, uint8_t valid );
+void profileStatus( void );
 
 #endif
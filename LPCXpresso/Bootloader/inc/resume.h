@@ -0,0 +1,32 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The record of the blocks that have been flashed in the current session,
+ * so an interrupted programming session can be resumed.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#ifndef RESUME_H__
+#define RESUME_H__
+
+/** The number of bytes in the bitmap of flashed blocks */
+#define RESUME_BITMAP_SIZE 15
+
+void initResume( void );
+void deinitResume( void );
+void resumeBegin( uint32_t imageId, uint8_t firstSector, uint8_t blockCount );
+void resumeBlockDone( uint8_t sector );
+uint8_t resumeComplete( void );
+void resumeGetBitmap( uint8_t *bitmap );
+
+#endif
@@ -8,7 +8,8 @@
  *
  * ===============================================================================================================
  *
- * The functions to deal with the storage of the start and stack pointers.
+ * The record of the application slots, which slot the node boots and
+ * what image every slot holds.
  *
  * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
  */
@@ -18,10 +19,29 @@
 #ifndef STORAGE_H__
 #define STORAGE_H__
 
+/**
+ * The state of an application slot.
+ */
+typedef enum {
+	SLOT_EMPTY = 0, /** The slot holds no image or an image that is being written */
+	SLOT_VALID = 1  /** The image in the slot was committed and can be started */
+} SlotState;
+
+/**
+ * The header of an application slot.
+ */
+typedef struct {
+	uint32_t version; /** The version the programmer gave the image */
+	uint32_t length;  /** The length of the image in bytes */
+	uint32_t crc;     /** The CRC-32C of the image */
+	uint32_t state;   /** The SlotState of the slot */
+} SlotHeader;
+
 void initStorage( void );
 void deinitStorage( void );
-void savePointersStorage( uint32_t startpointer, uint32_t stackpointer );
-uint32_t getStartPointerStorage( void );
-uint32_t getStackPointerStorage( void );
+uint8_t getActiveSlotStorage( void );
+const SlotHeader *getSlotHeaderStorage( uint8_t slot );
+uint8_t saveSlotStorage( uint8_t active, uint8_t slot, const SlotHeader *header );
+uint8_t slotVectorsValidStorage( uint8_t slot );
 
 #endif
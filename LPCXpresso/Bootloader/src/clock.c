@@ -0,0 +1,181 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The clock profile of the bootloader.
+ *
+ * After a reset the core runs from the 4MHz internal RC oscillator,
+ * the bootloader brings it to the highest clock of the part with PLL0
+ * so hashing, copying and verifying the images take as little time as
+ * possible. PLL0 runs at four times the core clock from a 4MHz input,
+ * the crystal divided by 3 or the RC oscillator if the crystal does
+ * not start. The flash accelerator gets its wait states before the
+ * clock goes up and IAP gets the new clock from SystemCoreClock.
+ *
+ * Before the application starts the reset state is restored, so its
+ * own clock setup starts from the state it expects.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "LPC17xx.h"
+
+#include "clock.h"
+#include "iap.h"
+
+/** The part identification numbers of the parts that run up to 120MHz */
+#define PART_LPC1769 0x26113F37
+#define PART_LPC1759 0x25113737
+
+/** The input of PLL0 after its pre-divider */
+#define PLL_INPUT    4000000
+
+/** The divider of PLL0 to the core clock */
+#define PLL_DIVIDER  4
+
+/** The number of polls before the oscillator or PLL0 is given up on */
+#define CLOCK_POLLS  100000
+
+/** The value of FLASHCFG after a reset, 4 clocks per flash access */
+#define FLASHCFG_RESET 0x303A
+
+/** The bits in SCS, PLL0CON and PLL0STAT */
+#define SCS_OSCEN     (1<<5)
+#define SCS_OSCSTAT   (1<<6)
+#define PLL_ENABLE    (1<<0)
+#define PLL_CONNECT   (1<<1)
+#define PLL_ENABLED   (1<<24)
+#define PLL_CONNECTED (1<<25)
+#define PLL_LOCKED    (1<<26)
+
+/**
+ * Let a change of PLL0CON or PLL0CFG take effect.
+ */
+static void feedPll( void ) {
+	LPC_SC->PLL0FEED = 0xAA;
+	LPC_SC->PLL0FEED = 0x55;
+}
+
+/**
+ * Let the flash accelerator use the least wait states that are safe
+ * at a clock.
+ * @param[in] clock The core clock in Hz.
+ */
+static void setFlashClocks( uint32_t clock ) {
+	// Every 20MHz needs another clock, 5 clocks are enough up to 120MHz
+	uint32_t clocks = ( clock + 19999999 ) / 20000000;
+	if ( clocks < 1 ) {
+		clocks = 1;
+	}
+	if ( clocks > 5 ) {
+		clocks = 5;
+	}
+	LPC_SC->FLASHCFG = ( LPC_SC->FLASHCFG & ~0xF000 ) | ( ( clocks - 1 ) << 12 );
+}
+
+/**
+ * Run the core from the clock source directly, PLL0 is
+ * disconnected and turned off.
+ */
+static void stopPll( void ) {
+	if ( LPC_SC->PLL0STAT & PLL_CONNECTED ) {
+		LPC_SC->PLL0CON = PLL_ENABLE;
+		feedPll();
+	}
+	LPC_SC->PLL0CON = 0;
+	feedPll();
+}
+
+/**
+ * Start the main oscillator.
+ * @return 1 if the crystal runs, 0 if it did not start in time.
+ */
+static uint8_t startOscillator( void ) {
+	LPC_SC->SCS |= SCS_OSCEN;
+
+	uint32_t polls;
+	for ( polls = 0; polls < CLOCK_POLLS; polls++ ) {
+		if ( LPC_SC->SCS & SCS_OSCSTAT ) {
+			return 1;
+		}
+	}
+	LPC_SC->SCS &= ~SCS_OSCEN;
+	return 0;
+}
+
+/**
+ * Bring the core to the highest clock of the part.
+ *
+ * A setup the startup code already made is undone first. If PLL0
+ * does not lock the core keeps running from the clock source.
+ */
+void initClock( void ) {
+	uint32_t clock = CLOCK_NORMAL;
+	uint32_t partId = getPartId();
+	if ( partId == PART_LPC1769 || partId == PART_LPC1759 ) {
+		clock = CLOCK_FAST;
+	}
+
+	// The wait states go up before the clock does
+	setFlashClocks( clock );
+
+	stopPll();
+	LPC_SC->CCLKCFG = 0;
+
+	uint32_t source = CLOCK_IRC;
+	LPC_SC->CLKSRCSEL = 0;
+	if ( startOscillator() ) {
+		source = CLOCK_CRYSTAL;
+		LPC_SC->CLKSRCSEL = 1;
+	}
+
+	// Fcco = 2 * M * input / N, between 275 and 550MHz
+	uint32_t n = source / PLL_INPUT;
+	uint32_t m = clock * PLL_DIVIDER / ( 2 * PLL_INPUT );
+	LPC_SC->PLL0CFG = ( ( n - 1 ) << 16 ) | ( m - 1 );
+	feedPll();
+	LPC_SC->PLL0CON = PLL_ENABLE;
+	feedPll();
+
+	LPC_SC->CCLKCFG = PLL_DIVIDER - 1;
+
+	uint32_t polls;
+	for ( polls = 0; polls < CLOCK_POLLS && !( LPC_SC->PLL0STAT & PLL_LOCKED ); polls++ );
+
+	if ( LPC_SC->PLL0STAT & PLL_LOCKED ) {
+		LPC_SC->PLL0CON = PLL_ENABLE | PLL_CONNECT;
+		feedPll();
+		while ( ( LPC_SC->PLL0STAT & ( PLL_ENABLED | PLL_CONNECTED ) ) != ( PLL_ENABLED | PLL_CONNECTED ) );
+	} else {
+		stopPll();
+		LPC_SC->CCLKCFG = 0;
+	}
+
+	// IAP and the peripherals take the clock from SystemCoreClock
+	SystemCoreClockUpdate();
+	setFlashClocks( SystemCoreClock );
+}
+
+/**
+ * Restore the clock setup after a reset, the core runs
+ * from the internal RC oscillator again.
+ */
+void deinitClock( void ) {
+	stopPll();
+	LPC_SC->CCLKCFG   = 0;
+	LPC_SC->CLKSRCSEL = 0;
+	LPC_SC->PLL0CFG   = 0;
+	feedPll();
+	LPC_SC->SCS      &= ~SCS_OSCEN;
+
+	// The wait states go down after the clock did
+	LPC_SC->FLASHCFG  = FLASHCFG_RESET;
+
+	SystemCoreClockUpdate();
+}
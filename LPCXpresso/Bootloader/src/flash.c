@@ -14,16 +14,37 @@
  */
 
 #include "flash.h"
+#include "geometry.h"
 #include "iap.h"
+#include "resume.h"
 
-static uint8_t getPhysicalSectorNumber(uint8_t virtualSector);
-static uint8_t getPhysicalSectorOffset(uint8_t virtualSector);
+#include <cr_section_macros.h>
+
+/** The physical sector that is staged, or NO_SECTOR */
+#define NO_SECTOR 0xFF
+
+/**
+ * A complete large sector is collected in the AHB RAM bank
+ * before it is erased and written, so a sector costs one erase.
+ */
+__BSS(RAM2) static uint8_t stage[FLASH_SECTOR_MAX] __attribute__((aligned(4)));
+
+/** The physical sector that is collected in the stage */
+__BSS(SERVICE) static uint8_t stagedSector;
+
+/** The bitmap of blocks of the staged sector that were received */
+__BSS(SERVICE) static uint8_t stagedBlocks;
+
+/** The first virtual sector and the bitmap of the staged blocks that were dropped, see flashLost */
+__BSS(SERVICE) static uint8_t lostSector;
+__BSS(SERVICE) static uint8_t lostBlocks;
 
 /**
  * Initialize the flash memory
  */
 void initFlash( void ) {
-
+	stagedSector = NO_SECTOR;
+	lostBlocks   = 0;
 }
 
 /**
@@ -34,120 +55,351 @@ void deinitFlash( void ) {
 }
 
 /**
- * Returns the physical sector number from the 'virtual' sector number.
- * @param[in] virtualSector The virtual sector number, range [0..128].
- * @return                  The physical sector number, range [0..29].
+ * Translate the result of an IAP wrapper to a flash status.
+ * @param[in] result The result of the IAP wrapper.
+ * @return The status of the flash action.
  */
-static uint8_t getPhysicalSectorNumber(uint8_t virtualSector) {
+static flashStatus getStatus( uint8_t result ) {
 
-	if ( virtualSector >= 16 ) {
-		return ((virtualSector - 16) / 8) + 16;
+	switch ( result ) {
+	case CMD_SUCCESS:
+		return FLASH_SUCCESS;
+	case INVALID_SECTOR:
+		return INVALID_POINTER;
+	default:
+		return COMPARE_FAILURE;
 	}
-	return virtualSector;
 
 }
 
 /**
- * Returns the offset of the mapping of a virtual to a physical sector.
- * @param[in] virtualSector The virtual sector.
- * @return        			The offset, range [0..7].
+ * Check if a region of flash is still erased.
+ *
+ * @param[in] address The word aligned start of the region.
+ * @param[in] length The size of the region.
+ * @return 1 if all bytes are 0xFF, 0 otherwise.
  */
-static uint8_t getPhysicalSectorOffset(uint8_t virtualSector) {
+static uint8_t isBlank( const uint32_t *address, uint16_t length ) {
 
-	if ( virtualSector < 16 ) {
-		return 0;
+	uint16_t i;
+	for ( i = 0; i < length/4; i++ ) {
+		if ( address[i] != 0xFFFFFFFF ) {
+			return 0;
+		}
 	}
-	else {
-		return virtualSector % 8;
+	return 1;
+
+}
+
+/**
+ * Find the smallest size IAP can write that covers a chunk of 4kB,
+ * the rest of the chunk is blank and stays so in the erased flash.
+ *
+ * @param[in] data The word aligned chunk in RAM.
+ * @return The number of bytes to write.
+ */
+static uint16_t getWriteSize( uint8_t *data ) {
+
+	uint8_t i;
+	for ( i = 0; i < FLASH_WRITE_SIZES - 1; i++ ) {
+		uint16_t size = flashWriteSizes[i];
+		if ( isBlank( (const uint32_t *)( data + size ), 4096 - size ) ) {
+			return size;
+		}
 	}
+	return 4096;
 
 }
 
 /**
- * Copy 4kB from RAM to flash.
+ * Program a physical sector in chunks of 4kB, the largest size IAP
+ * can write in one call.
  *
- * @param[in] ramPointer The start of the ram to copy from.
- * @param[in] startSector The sector to start the write from.
- * @return Status of flashing procedure.
+ * Chunks that are already in flash are not written and the sector is
+ * only erased when a chunk that differs is not blank, so flashing the
+ * same image twice does not wear the flash. A chunk that ends blank is
+ * written with the smallest size that covers the rest of it.
+ *
+ * @param[in] phySector The physical sector to program.
+ * @param[in] data The word aligned data in RAM.
+ * @param[in] length The size of the sector.
+ * @return Status of flashing procedure, FLASH_UNCHANGED if the
+ *         sector already contained the data.
  */
-flashStatus flashNode( DataBlock *block ) {
+static flashStatus programSector( uint8_t phySector, uint8_t *data, uint16_t length ) {
 
-	uint8_t phySector = getPhysicalSectorNumber( block->sector );
-	uint8_t offset = getPhysicalSectorOffset( block->sector );
+	flashStatus status;
+	const uint8_t *address = (const uint8_t *)getSectorAddress( phySector );
+	uint8_t changed = 0; // The bitmap of chunks that differ from flash
+	uint8_t erase = 0;
 
 	/*
-	 * Prepare flash.
+	 * Find the chunks that need to be written.
 	 */
-	uint8_t prepare = prepareFlash( phySector );
-	if ( prepare == INVALID_SECTOR) {
-		return INVALID_POINTER;
+	uint16_t offset;
+	uint8_t chunk;
+	for ( offset = 0, chunk = 0; offset < length; offset += 4096, chunk++ ) {
+		if ( compareFlash( data + offset, phySector, offset, 4096 ) != CMD_SUCCESS ) {
+			changed |= (1<<chunk);
+			if ( !isBlank( (const uint32_t *)( address + offset ), 4096 ) ) {
+				erase = 1;
+			}
+		}
 	}
-	else if ( prepare == COMPARE_ERROR ) {
-		return COMPARE_FAILURE;
+	if ( !changed ) {
+		return FLASH_UNCHANGED;
 	}
 
-	/**
-	 * Blank sector only if it is the first 4kB chunck to be flashed on that sector.
+	/*
+	 * Prepare and blank flash, after that every chunk that
+	 * is not blank has to be written again.
 	 */
-	if ( offset == 0 ) {
-
-		/*
-		 * Blank flash.
-		 */
-		uint8_t blank = blankFlash( phySector );
-		if ( blank == INVALID_SECTOR ) {
-			return INVALID_POINTER;
+	if ( erase ) {
+		status = getStatus( prepareFlash( phySector ) );
+		if ( status != FLASH_SUCCESS ) {
+			return status;
 		}
-		else if ( prepare == COMPARE_ERROR ) {
-			return COMPARE_FAILURE;
+		status = getStatus( blankFlash( phySector ) );
+		if ( status != FLASH_SUCCESS ) {
+			return status;
 		}
 
-		/*
-		 * Check if flash sector is blanked.
-		 */
-		uint8_t checkIfBlank = checkBlank( phySector );
-		if ( checkIfBlank == COMPARE_ERROR ) {
-			return COMPARE_FAILURE;
+		changed = 0;
+		for ( offset = 0, chunk = 0; offset < length; offset += 4096, chunk++ ) {
+			if ( !isBlank( (const uint32_t *)( data + offset ), 4096 ) ) {
+				changed |= (1<<chunk);
+			}
 		}
-		else if ( checkIfBlank == INVALID_SECTOR ) {
-			return INVALID_POINTER;
-		}
-
 	}
 
 	/*
-	 * Prepare flash.
+	 * Write the sector 4kB at a time, every write needs its own prepare.
 	 */
-	prepare = prepareFlash( phySector );
-	if ( prepare == INVALID_SECTOR) {
-		return INVALID_POINTER;
-	}
-	else if ( prepare == COMPARE_ERROR ) {
-		return COMPARE_FAILURE;
+	for ( offset = 0, chunk = 0; offset < length; offset += 4096, chunk++ ) {
+		if ( !( changed & (1<<chunk) ) ) {
+			continue;
+		}
+		status = getStatus( prepareFlash( phySector ) );
+		if ( status != FLASH_SUCCESS ) {
+			return status;
+		}
+		status = getStatus( writeFlash( data + offset, phySector, offset, getWriteSize( data + offset ) ) );
+		if ( status != FLASH_SUCCESS ) {
+			return status;
+		}
 	}
 
 	/*
-	 * Write 4kB to flash.
+	 * Compare the complete sector at once.
 	 */
-	uint8_t write = writeFlash( block->data, phySector, offset * 4096 );
-	if ( write == INVALID_SECTOR ) {
-		return INVALID_POINTER;
+	return getStatus( compareFlash( data, phySector, 0, length ) );
+
+}
+
+/**
+ * Copy a virtual sector of 4kB from RAM to flash.
+ *
+ * Sectors of 4kB are written right away. The virtual sectors of the
+ * larger sectors are staged until the sector is complete or a block for
+ * another sector arrives, the virtual sectors that are not received keep
+ * their current contents.
+ *
+ * @param[in] sector The virtual sector.
+ * @param[in] data The word aligned data in RAM.
+ * @return Status of flashing procedure, FLASH_STAGED if the sector
+ *         will be written with the rest of its physical sector and
+ *         FLASH_UNCHANGED if it was already in flash.
+ */
+static flashStatus flashSector( uint8_t sector, uint8_t *data ) {
+
+	uint8_t phySector = getPhysicalSector( sector );
+	uint8_t offset = ( sector * 4096 - getSectorAddress( phySector ) ) / 4096;
+	uint32_t size = getSectorSize( phySector );
+
+	if ( size == 4096 ) {
+		flashStatus status = programSector( phySector, data, 4096 );
+		if ( status == FLASH_SUCCESS || status == FLASH_UNCHANGED ) {
+			resumeBlockDone( sector );
+		}
+		return status;
 	}
-	else if ( write == COMPARE_ERROR ) {
-		return COMPARE_FAILURE;
+
+	/*
+	 * A block that is already in flash does not need to be
+	 * staged, unless an earlier version of it is staged.
+	 */
+	if ( !( phySector == stagedSector && ( stagedBlocks & (1<<offset) ) ) &&
+			compareFlash( data, phySector, offset * 4096, 4096 ) == CMD_SUCCESS ) {
+		resumeBlockDone( sector );
+		return FLASH_UNCHANGED;
 	}
 
 	/*
-	 * Compare flashed 4kB.
+	 * Start staging a new sector with its current contents. If
+	 * the staged sector can not be written its blocks are dropped,
+	 * they are reported with flashLost and not with this block.
 	 */
-	uint8_t compareData = compareFlash( block->data, phySector, offset * 4096 );
-	if ( compareData == COMPARE_ERROR ) {
-		return COMPARE_FAILURE;
+	if ( phySector != stagedSector ) {
+		if ( flashFlush() != FLASH_SUCCESS ) {
+			lostSector   = getSectorAddress( stagedSector ) / 4096;
+			lostBlocks   = stagedBlocks;
+			stagedSector = NO_SECTOR;
+		}
+
+		uint32_t *source = (uint32_t *)getSectorAddress( phySector );
+		uint32_t *destination = (uint32_t *)stage;
+		uint16_t i;
+		for ( i = 0; i < size/4; i++ ) {
+			destination[i] = source[i];
+		}
+		stagedSector = phySector;
+		stagedBlocks = 0;
 	}
-	else if ( compareData == INVALID_SECTOR ){
-		return INVALID_POINTER;
+
+	uint32_t *source = (uint32_t *)data;
+	uint32_t *destination = (uint32_t *)( stage + offset * 4096 );
+	uint16_t i;
+	for ( i = 0; i < 4096/4; i++ ) {
+		destination[i] = source[i];
+	}
+	stagedBlocks |= (1<<offset);
+
+	if ( stagedBlocks == (1<<(size/4096))-1 ) {
+		return flashFlush();
+	}
+	return FLASH_STAGED;
+
+}
+
+/**
+ * Copy a block from RAM to flash.
+ *
+ * The physical sectors the block covers completely are written right
+ * away, the other virtual sectors of the block are written or staged
+ * one by one.
+ *
+ * @param[in] block The block to flash, blocks smaller than a virtual
+ *                  sector are flashed once the sector is complete.
+ * @return Status of flashing procedure, FLASH_STAGED if a part of the
+ *         block will be written with the rest of its sector and
+ *         FLASH_UNCHANGED if the block was already in flash.
+ */
+flashStatus flashNode( DataBlock *block ) {
+
+	uint8_t count = 1;
+	if ( block->shift > BLOCK_SHIFT_SECTOR ) {
+		count = 1 << ( block->shift - BLOCK_SHIFT_SECTOR );
+	}
+
+	// Only the application slots are written with blocks
+	if ( block->sector < getSlotFirstSector( 0 ) ||
+	     block->sector + count > getSlotFirstSector( SLOT_COUNT ) ) {
+		return BOOTLOADER_SECTOR;
+	}
+
+	flashStatus result = FLASH_UNCHANGED;
+	uint8_t done = 0;
+	while ( done < count ) {
+		uint8_t sector = block->sector + done;
+		uint8_t *data = block->data + done * 4096;
+		uint8_t phySector = getPhysicalSector( sector );
+		uint8_t sectors = getSectorSize( phySector ) / 4096;
+		flashStatus status;
+
+		if ( sectors > 1 && getSectorAddress( phySector ) == sector * 4096u && count - done >= sectors ) {
+			// A staged copy of the sector is outdated by the block
+			if ( phySector == stagedSector ) {
+				stagedSector = NO_SECTOR;
+			}
+
+			status = programSector( phySector, data, sectors * 4096 );
+			if ( status == FLASH_SUCCESS || status == FLASH_UNCHANGED ) {
+				uint8_t i;
+				for ( i = 0; i < sectors; i++ ) {
+					resumeBlockDone( sector + i );
+				}
+			}
+			done += sectors;
+		} else {
+			// A block received in the stage can not be staged
+			if ( data >= stage && data < stage + FLASH_SECTOR_MAX ) {
+				return INVALID_POINTER;
+			}
+
+			status = flashSector( sector, data );
+			done++;
+		}
+
+		if ( status < FLASH_SUCCESS ) {
+			return status;
+		}
+		if ( status == FLASH_STAGED || ( status == FLASH_SUCCESS && result == FLASH_UNCHANGED ) ) {
+			result = status;
+		}
+	}
+	return result;
+
+}
+
+/**
+ * Write the staged sector to flash, if there is one.
+ *
+ * The sector stays staged if it can not be written, so
+ * the blocks that wait in it are not acknowledged.
+ * @return Status of flashing procedure.
+ */
+flashStatus flashFlush( void ) {
+
+	if ( stagedSector == NO_SECTOR ) {
+		return FLASH_SUCCESS;
 	}
 
-	return FLASH_SUCCESS;
+	uint32_t size = getSectorSize( stagedSector );
+	flashStatus status = programSector( stagedSector, stage, size );
+	if ( status == FLASH_UNCHANGED ) {
+		status = FLASH_SUCCESS;
+	}
+	if ( status != FLASH_SUCCESS ) {
+		return status;
+	}
+
+	uint8_t offset;
+	for ( offset = 0; offset < size/4096; offset++ ) {
+		if ( stagedBlocks & (1<<offset) ) {
+			resumeBlockDone( getSectorAddress( stagedSector ) / 4096 + offset );
+		}
+	}
+
+	stagedSector = NO_SECTOR;
+	return status;
+
+}
+
+/**
+ * Take the staged blocks that were dropped because their sector
+ * could not be written, they were reported as FLASH_STAGED before.
+ *
+ * @param[out] sector The virtual sector of the first block of the sector.
+ * @return The bitmap of the dropped virtual sectors, 0 if none were dropped.
+ */
+uint8_t flashLost( uint8_t *sector ) {
+
+	uint8_t blocks = lostBlocks;
+	*sector    = lostSector;
+	lostBlocks = 0;
+	return blocks;
+
+}
+
+/**
+ * Lend the stage as receive buffer for blocks that cover complete
+ * large sectors, such blocks are written without staging. The staged
+ * sector has to be flushed before the stage is lent.
+ *
+ * @return The stage, FLASH_SECTOR_MAX bytes in the AHB RAM bank.
+ */
+uint8_t *flashStage( void ) {
+
+	return stage;
 
 }
@@ -0,0 +1,211 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The geometry of the flash of the LPC17xx parts and the layout of the
+ * bootloader, the application slots and the journal on it.
+ *
+ * The parts only differ in the number of sectors, the sector table below
+ * is the one of the 512kB parts and the smaller parts use the front of it.
+ * The part is found at startup with the part identification number, so
+ * one bootloader build serves all parts. The layout follows from the size
+ * of the flash:
+ *
+ *   The bootloader        The 16 small sectors
+ *   Slot A and slot B     The rest of the flash in two equal halves
+ *   The journal           The last two sectors
+ *
+ * The flash is addressed in virtual sectors of 4kB, the size of a block.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "geometry.h"
+#include "flash.h"
+#include "iap.h"
+
+#include <cr_section_macros.h>
+
+/** A small sector, numbers 0 to 15 */
+#define SMALL_SECTOR(n) { (n) * 0x1000, 0x1000 }
+
+/** A large sector, numbers 16 to 29 */
+#define LARGE_SECTOR(n) { 0x10000 + ( (n) - 16 ) * 0x8000, 0x8000 }
+
+/** The sectors of the largest part */
+static const FlashSector sectors[] = {
+	SMALL_SECTOR(0),  SMALL_SECTOR(1),  SMALL_SECTOR(2),  SMALL_SECTOR(3),
+	SMALL_SECTOR(4),  SMALL_SECTOR(5),  SMALL_SECTOR(6),  SMALL_SECTOR(7),
+	SMALL_SECTOR(8),  SMALL_SECTOR(9),  SMALL_SECTOR(10), SMALL_SECTOR(11),
+	SMALL_SECTOR(12), SMALL_SECTOR(13), SMALL_SECTOR(14), SMALL_SECTOR(15),
+	LARGE_SECTOR(16), LARGE_SECTOR(17), LARGE_SECTOR(18), LARGE_SECTOR(19),
+	LARGE_SECTOR(20), LARGE_SECTOR(21), LARGE_SECTOR(22), LARGE_SECTOR(23),
+	LARGE_SECTOR(24), LARGE_SECTOR(25), LARGE_SECTOR(26), LARGE_SECTOR(27),
+	LARGE_SECTOR(28), LARGE_SECTOR(29)
+};
+
+/** The parts of the family */
+static const FlashPart parts[] = {
+	{ 0x26113F37, 30 }, // LPC1769, 512kB
+	{ 0x26013F37, 30 }, // LPC1768, 512kB
+	{ 0x26012837, 30 }, // LPC1767, 512kB
+	{ 0x26013F33, 22 }, // LPC1766, 256kB
+	{ 0x26013733, 22 }, // LPC1765, 256kB
+	{ 0x26011922, 18 }, // LPC1764, 128kB
+	{ 0x26012033, 22 }  // LPC1763, 256kB
+};
+
+/** The number of parts of the family */
+#define PART_COUNT ( sizeof(parts) / sizeof(parts[0]) )
+
+const uint16_t flashWriteSizes[FLASH_WRITE_SIZES] = { 256, 512, 1024, 4096 };
+
+/** The number of physical sectors of this part */
+__BSS(SERVICE) static uint8_t sectorCount;
+
+/** The number of virtual sectors in an application slot */
+__BSS(SERVICE) static uint8_t slotSectors;
+
+/**
+ * Find the part and compute the layout of its flash.
+ *
+ * An unknown part gets the layout of the smallest part,
+ * so the bootloader never writes flash that is not there.
+ */
+void initGeometry( void ) {
+
+	uint32_t partId = getPartId();
+	uint8_t i;
+	sectorCount = parts[0].sectors;
+	for ( i = 0; i < PART_COUNT; i++ ) {
+		if ( parts[i].sectors < sectorCount ) {
+			sectorCount = parts[i].sectors;
+		}
+	}
+	for ( i = 0; i < PART_COUNT; i++ ) {
+		if ( parts[i].partId == partId ) {
+			sectorCount = parts[i].sectors;
+		}
+	}
+
+	// The slots split the flash between the bootloader and the
+	// journal in halves that end on a physical sector boundary
+	uint8_t end  = getSectorAddress( getJournalSector() ) / 4096;
+	uint8_t half = ( end - BOOTLOADER_SECTORS ) / 2;
+	slotSectors  = half - half % ( getSectorSize( getPhysicalSector( BOOTLOADER_SECTORS + half ) ) / 4096 );
+
+}
+
+/**
+ * Retrieve the number of physical sectors of this part.
+ * @return The number of sectors.
+ */
+uint8_t getSectorCount( void ) {
+
+	return sectorCount;
+
+}
+
+/**
+ * Retrieve the start address of a physical sector.
+ * @param[in] sector The physical sector.
+ * @return           The address of the first byte of the sector.
+ */
+uint32_t getSectorAddress( uint8_t sector ) {
+
+	return sectors[sector].address;
+
+}
+
+/**
+ * Retrieve the size of a physical sector.
+ * @param[in] sector The physical sector.
+ * @return           The size of the sector in bytes.
+ */
+uint32_t getSectorSize( uint8_t sector ) {
+
+	return sectors[sector].size;
+
+}
+
+/**
+ * Returns the physical sector a virtual sector is part of.
+ * @param[in] virtualSector The virtual sector.
+ * @return                  The physical sector.
+ */
+uint8_t getPhysicalSector( uint8_t virtualSector ) {
+
+	uint32_t address = virtualSector * 4096;
+	uint8_t sector = 0;
+	while ( sector + 1 < sectorCount && sectors[sector + 1].address <= address ) {
+		++sector;
+	}
+	return sector;
+
+}
+
+/**
+ * Retrieve the first of the two physical sectors of the journal.
+ * @return The physical sector.
+ */
+uint8_t getJournalSector( void ) {
+
+	return sectorCount - 2;
+
+}
+
+/**
+ * Retrieve the size of the application slots.
+ * @return The number of virtual sectors in a slot.
+ */
+uint8_t getSlotSectors( void ) {
+
+	return slotSectors;
+
+}
+
+/**
+ * Retrieve the first virtual sector of a slot, SLOT_COUNT gives
+ * the sector right after the last slot.
+ * @param[in] slot The slot, up to SLOT_COUNT.
+ * @return         The virtual sector.
+ */
+uint8_t getSlotFirstSector( uint8_t slot ) {
+
+	return BOOTLOADER_SECTORS + slot * slotSectors;
+
+}
+
+/**
+ * Retrieve the address of the first byte of a slot.
+ * @param[in] slot The slot, below SLOT_COUNT.
+ * @return         The address.
+ */
+uint32_t getSlotAddress( uint8_t slot ) {
+
+	return getSlotFirstSector( slot ) * 4096;
+
+}
+
+/**
+ * Find the slot that starts at a virtual sector.
+ * @param[in] virtualSector The virtual sector.
+ * @return                  The slot, or NO_SLOT if no slot starts there.
+ */
+uint8_t getSlotOfSector( uint8_t virtualSector ) {
+
+	uint8_t slot;
+	for ( slot = 0; slot < SLOT_COUNT; slot++ ) {
+		if ( slotSectors > 0 && getSlotFirstSector( slot ) == virtualSector ) {
+			return slot;
+		}
+	}
+	return NO_SLOT;
+
+}
@@ -0,0 +1,441 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The journal that keeps the state of the bootloader in flash.
+ *
+ * The journal uses the last two physical sectors of 32kB. It is an append only
+ * list of 256 byte pages, the smallest size IAP can write, so changing
+ * the state costs one small write instead of a sector erase. The first
+ * page of a sector is a snapshot of the complete state, every following
+ * page is one change to it. Every page has a sequence number and a check
+ * word that IAP writes last, a page that was interrupted is ignored.
+ *
+ * When a sector is full the other sector is erased and gets a snapshot
+ * of the current state as its first page. The sector with the newest
+ * snapshot is the current one, so a compaction that is interrupted
+ * leaves the old sector in use. At boot the state in RAM is rebuilt by
+ * replaying the current sector.
+ *
+ * A start of the application does not write the flash. The starts are
+ * counted in an RTC general purpose register and the count is saved in
+ * the last word of the next entry that is written anyway.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "LPC17xx.h"
+
+#include "journal.h"
+#include "geometry.h"
+#include "iap.h"
+
+#include <cr_section_macros.h>
+
+/** The first of the two physical sectors, the last two of the flash */
+#define JOURNAL_SECTOR     getJournalSector()
+
+/** The size of a page in the journal, the smallest size IAP can write */
+#define JOURNAL_PAGE_SIZE  256
+
+/** The number of pages in a sector of the journal */
+#define JOURNAL_PAGE_COUNT (32768/JOURNAL_PAGE_SIZE)
+
+/** The marker of a page of the journal */
+#define JOURNAL_MAGIC      0x4A524E4C
+
+/** The number of words of a page that hold the entry */
+#define JOURNAL_DATA_WORDS ( JOURNAL_PAGE_SIZE/4 - 4 )
+
+/** The word of the entry that holds the boot count, the entries are far smaller */
+#define JOURNAL_BOOT_WORD  ( JOURNAL_DATA_WORDS - 1 )
+
+/** The RTC general purpose register that counts the starts the journal has not saved */
+#define JOURNAL_BOOT_GPREG GPREG3
+
+/** The upper half of the register when it holds a count, it is random after a power loss */
+#define JOURNAL_BOOT_MARK  0xB0070000
+
+/**
+ * The types of entries in the journal.
+ */
+typedef enum {
+	JOURNAL_SNAPSHOT = 1, /** The complete state, the first page of a sector */
+	JOURNAL_SLOT     = 2, /** The header of a slot and the slot to boot */
+	JOURNAL_SESSION  = 3, /** A new session, no blocks are flashed yet */
+	JOURNAL_BLOCK    = 4, /** A block of the session is flashed */
+	JOURNAL_BOOT     = 5  /** The count of starts of the application */
+} JournalType;
+
+/**
+ * A page of the journal.
+ */
+typedef struct {
+	uint32_t magic;                    /** JOURNAL_MAGIC */
+	uint32_t sequence;                 /** One more than the page before it */
+	uint32_t type;                     /** The JournalType of the entry */
+	uint32_t data[JOURNAL_DATA_WORDS]; /** The entry */
+	uint32_t check;                    /** The inverted sum of the words above */
+} JournalPage;
+
+/**
+ * The entry that changes the header of a slot.
+ */
+typedef struct {
+	uint32_t   active; /** The slot to boot */
+	uint32_t   slot;   /** The slot of the header */
+	SlotHeader header; /** The new header of the slot */
+} SlotEntry;
+
+/**
+ * The entry that starts a session.
+ */
+typedef struct {
+	uint32_t image;  /** The image of the session */
+	uint32_t first;  /** The virtual sector of the first block */
+	uint32_t blocks; /** The number of blocks in the image */
+} SessionEntry;
+
+/** The current state */
+__BSS(SERVICE) static JournalState state;
+
+/** The current sector, 0 or 1 */
+__BSS(SERVICE) static uint8_t sector;
+
+/** The next free page in the current sector */
+__BSS(SERVICE) static uint8_t nextPage;
+
+/** The sequence number of the last page */
+__BSS(SERVICE) static uint32_t sequence;
+
+/** The page to write, IAP only writes from word aligned RAM */
+__BSS(SERVICE) static JournalPage page;
+
+/**
+ * Compute the check of a page.
+ * @param[in] current The page.
+ * @return            The inverted sum of all words in front of the check.
+ */
+static uint32_t pageCheck( const JournalPage *current ) {
+	const uint32_t *word = (const uint32_t *)current;
+	uint32_t sum = 0;
+	uint8_t i;
+	for( i=0; i<JOURNAL_PAGE_SIZE/4-1; i++ ) {
+		sum += word[i];
+	}
+	return ~sum;
+}
+
+/**
+ * Returns a pointer to a page of the journal in flash.
+ * @param[in] number The sector of the journal, 0 or 1.
+ * @param[in] index  The number of the page in the sector.
+ * @return           A pointer to the page.
+ */
+static const JournalPage *getPage( uint8_t number, uint8_t index ) {
+	return (const JournalPage *)( getSectorAddress( JOURNAL_SECTOR + number ) + index * JOURNAL_PAGE_SIZE );
+}
+
+/**
+ * Check if a page holds a complete entry.
+ * @param[in] current The page.
+ * @return            1 if the page is valid, 0 otherwise.
+ */
+static uint8_t pageValid( const JournalPage *current ) {
+	return current->magic == JOURNAL_MAGIC && current->check == pageCheck( current );
+}
+
+/**
+ * Copy words, the entries are word aligned.
+ */
+static void copyWords( uint32_t *destination, const uint32_t *source, uint8_t count ) {
+	uint8_t i;
+	for( i=0; i<count; i++ ) {
+		destination[i] = source[i];
+	}
+}
+
+/**
+ * Apply an entry to the state.
+ * @param[in] current The page with the entry.
+ */
+static void applyPage( const JournalPage *current ) {
+	switch( current->type ) {
+	case JOURNAL_SNAPSHOT:
+		copyWords( (uint32_t *)&state, current->data, sizeof(JournalState)/4 );
+		break;
+
+	case JOURNAL_SLOT:
+		{
+			const SlotEntry *entry = (const SlotEntry *)current->data;
+			if( entry->slot < SLOT_COUNT ) {
+				state.active              = entry->active;
+				state.slots[entry->slot]  = entry->header;
+			}
+		}
+		break;
+
+	case JOURNAL_SESSION:
+		{
+			const SessionEntry *entry = (const SessionEntry *)current->data;
+			uint8_t i;
+			state.image  = entry->image;
+			state.first  = entry->first;
+			state.blocks = entry->blocks;
+			for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+				state.done[i] = 0;
+			}
+		}
+		break;
+
+	case JOURNAL_BLOCK:
+		if( current->data[0] < RESUME_BITMAP_SIZE*8 )
+			state.done[current->data[0]/8] |= (1<<(current->data[0]%8));
+		break;
+	}
+
+	// An entry without a count leaves the word erased
+	if( current->type != JOURNAL_SNAPSHOT && current->data[JOURNAL_BOOT_WORD] != 0xFFFFFFFF )
+		state.bootCount = current->data[JOURNAL_BOOT_WORD];
+}
+
+/**
+ * Retrieve the starts of the application that the journal has not saved.
+ * @return The number of starts.
+ */
+static uint32_t unsavedBoots( void ) {
+	uint32_t count = LPC_RTC->JOURNAL_BOOT_GPREG;
+	if( ( count & 0xFFFF0000 ) != JOURNAL_BOOT_MARK )
+		return 0;
+	return count & 0xFFFF;
+}
+
+/**
+ * Write the page to a page of a sector.
+ * @param[in] number The sector of the journal, 0 or 1.
+ * @param[in] index  The number of the page in the sector.
+ * @return           1 if the page was written correctly, 0 otherwise.
+ */
+static uint8_t writePage( uint8_t number, uint8_t index ) {
+	page.magic    = JOURNAL_MAGIC;
+	page.sequence = ++sequence;
+	page.check    = pageCheck( &page );
+
+	return prepareFlash( JOURNAL_SECTOR + number ) == CMD_SUCCESS &&
+	       writeFlash( (uint8_t *)&page, JOURNAL_SECTOR + number, index * JOURNAL_PAGE_SIZE, JOURNAL_PAGE_SIZE ) == CMD_SUCCESS &&
+	       compareFlash( (uint8_t *)&page, JOURNAL_SECTOR + number, index * JOURNAL_PAGE_SIZE, JOURNAL_PAGE_SIZE ) == CMD_SUCCESS;
+}
+
+/**
+ * Move the state to the other sector as a snapshot.
+ * @return 1 if the snapshot was written, 0 otherwise.
+ */
+static uint8_t compact( void ) {
+	uint8_t other = !sector;
+	if( prepareFlash( JOURNAL_SECTOR + other ) != CMD_SUCCESS ||
+			blankFlash( JOURNAL_SECTOR + other ) != CMD_SUCCESS )
+		return 0;
+
+	uint8_t i;
+	for( i=0; i<JOURNAL_DATA_WORDS; i++ ) {
+		page.data[i] = 0xFFFFFFFF;
+	}
+	page.type = JOURNAL_SNAPSHOT;
+	copyWords( page.data, (const uint32_t *)&state, sizeof(JournalState)/4 );
+	if( !writePage( other, 0 ) )
+		return 0;
+
+	sector   = other;
+	nextPage = 1;
+	return 1;
+}
+
+/**
+ * Append the entry in the page to the journal. The state
+ * already contains the change, a full sector is compacted
+ * into a snapshot which makes the entry superfluous.
+ * @param[in] type The JournalType of the entry.
+ * @return         1 if the change is in flash, 0 otherwise.
+ */
+static uint8_t appendPage( JournalType type ) {
+	// Save the starts that were only counted in the register
+	uint32_t boots = unsavedBoots();
+	state.bootCount += boots;
+	page.data[JOURNAL_BOOT_WORD] = state.bootCount;
+
+	uint8_t saved;
+	if( nextPage >= JOURNAL_PAGE_COUNT ) {
+		saved = compact();
+	} else {
+		page.type = type;
+		saved = writePage( sector, nextPage++ );
+	}
+
+	if( saved )
+		LPC_RTC->JOURNAL_BOOT_GPREG = JOURNAL_BOOT_MARK;
+	else
+		state.bootCount -= boots;
+	return saved;
+}
+
+/**
+ * Prepare the page for a new entry.
+ */
+static void clearPage( void ) {
+	uint8_t i;
+	for( i=0; i<JOURNAL_DATA_WORDS; i++ ) {
+		page.data[i] = 0xFFFFFFFF;
+	}
+}
+
+/**
+ * Rebuild the state from the journal in flash.
+ */
+void initJournal( void ) {
+
+	// Without a journal there is no slot to boot and no session
+	uint8_t i;
+	state.bootCount = 0;
+	state.active    = NO_SLOT;
+	for( i=0; i<SLOT_COUNT; i++ ) {
+		state.slots[i].version = 0;
+		state.slots[i].length  = 0;
+		state.slots[i].crc     = 0;
+		state.slots[i].state   = SLOT_EMPTY;
+	}
+	state.image  = 0xFFFFFFFF;
+	state.first  = 0;
+	state.blocks = 0;
+	for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+		state.done[i] = 0;
+	}
+	sequence = 0;
+
+	// The sector with the newest snapshot is the current one
+	uint8_t found = 0;
+	for( i=0; i<2; i++ ) {
+		const JournalPage *first = getPage( i, 0 );
+		if( pageValid( first ) && first->type == JOURNAL_SNAPSHOT &&
+				( !found || first->sequence > sequence ) ) {
+			found    = 1;
+			sector   = i;
+			sequence = first->sequence;
+		}
+	}
+
+	// Start a journal in the first sector when
+	// something changes for the first time
+	if( !found ) {
+		sector   = 1;
+		nextPage = JOURNAL_PAGE_COUNT;
+		return;
+	}
+
+	// Replay the sector up to the free space, a page
+	// that was interrupted while writing is skipped
+	sequence = 0;
+	for( nextPage=0; nextPage<JOURNAL_PAGE_COUNT; nextPage++ ) {
+		const JournalPage *current = getPage( sector, nextPage );
+		if( current->magic == 0xFFFFFFFF )
+			break;
+		if( pageValid( current ) && current->sequence > sequence ) {
+			applyPage( current );
+			sequence = current->sequence;
+		}
+	}
+}
+
+/**
+ * Deinitialize the journal.
+ */
+void deinitJournal( void ) {
+}
+
+/**
+ * Retrieve the current state.
+ * @return The state, it only changes through the journal.
+ */
+const JournalState *getJournal( void ) {
+	return &state;
+}
+
+/**
+ * Save the header of a slot and the slot to boot in one entry.
+ * @param[in] active The slot to boot or NO_SLOT.
+ * @param[in] slot   The slot of the header, below SLOT_COUNT.
+ * @param[in] header The new header of the slot.
+ * @return           1 if the entry was saved, 0 otherwise.
+ */
+uint8_t journalSlot( uint8_t active, uint8_t slot, const SlotHeader *header ) {
+	state.active      = active;
+	state.slots[slot] = *header;
+
+	clearPage();
+	SlotEntry *entry = (SlotEntry *)page.data;
+	entry->active = active;
+	entry->slot   = slot;
+	entry->header = *header;
+	return appendPage( JOURNAL_SLOT );
+}
+
+/**
+ * Start a new session, none of its blocks are flashed.
+ * @param[in] image  The identifier of the image.
+ * @param[in] first  The virtual sector of the first block.
+ * @param[in] blocks The number of blocks in the image.
+ * @return           1 if the entry was saved, 0 otherwise.
+ */
+uint8_t journalSession( uint32_t image, uint8_t first, uint8_t blocks ) {
+	uint8_t i;
+	state.image  = image;
+	state.first  = first;
+	state.blocks = blocks;
+	for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+		state.done[i] = 0;
+	}
+
+	clearPage();
+	SessionEntry *entry = (SessionEntry *)page.data;
+	entry->image  = image;
+	entry->first  = first;
+	entry->blocks = blocks;
+	return appendPage( JOURNAL_SESSION );
+}
+
+/**
+ * Mark a block of the session as flashed.
+ * @param[in] block The number of the block in the session.
+ * @return          1 if the entry was saved, 0 otherwise.
+ */
+uint8_t journalBlock( uint8_t block ) {
+	if( block >= RESUME_BITMAP_SIZE*8 )
+		return 0;
+	state.done[block/8] |= (1<<(block%8));
+
+	clearPage();
+	page.data[0] = block;
+	return appendPage( JOURNAL_BLOCK );
+}
+
+/**
+ * Count a start of the application. The start is only counted in
+ * the register, the next entry of the journal saves the count. An
+ * entry of its own is only written when the register is full.
+ */
+void journalBoot( void ) {
+	uint32_t boots = unsavedBoots() + 1;
+	if( boots > 0xFFFF )
+		boots = 0xFFFF;
+	LPC_RTC->JOURNAL_BOOT_GPREG = JOURNAL_BOOT_MARK | boots;
+
+	if( boots == 0xFFFF ) {
+		clearPage();
+		appendPage( JOURNAL_BOOT );
+	}
+}
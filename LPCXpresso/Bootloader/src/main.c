@@ -9,7 +9,7 @@
  * ===============================================================================================================
  *
  * The main entry point for the CAN Bootloader. This bootloader
- * should work for the LPC1769.
+ * should work for the LPC17xx family.
  *
  * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
  */
@@ -20,110 +20,386 @@
 
 #include "protocol.h"
 #include "flash.h"
+#include "geometry.h"
+#include "journal.h"
 #include "storage.h"
-#include "timer.h"
+#include "resume.h"
 #include "watchdog.h"
+#include "hash.h"
+#include "timer.h"
+#include "bootrequest.h"
+#include "profile.h"
+#include "clock.h"
 
 #include <cr_section_macros.h>
 
+/**
+ * The word the application sets to request an update, it is
+ * the only reserved variable so it is the first word of RAM.
+ */
+__BSS(RESERVED) volatile uint32_t bootRequest;
+
+/** The number of entries in the vector table of the LPC17xx */
+#define VECTOR_COUNT 51
+
+/** The vector table in flash, from the startup code */
+extern void (* const g_pfnVectors[])(void);
+
+/**
+ * The vector table in RAM. While IAP erases or writes the flash the
+ * flash can not be read, so the CAN interrupt only works with its
+ * vector and handler in RAM. VTOR needs the table on a 256 byte boundary.
+ */
+static void (*ramVectors[VECTOR_COUNT])(void) __attribute__((aligned(256)));
+
+/**
+ * The largest block that is received in local RAM, larger blocks are
+ * received in the stage. At least a sector, the parts of a sector are
+ * collected in it. Define it as 13 or 14 in the build to take blocks
+ * of 8kB or 16kB for the large sectors, at the cost of that RAM.
+ */
+#ifndef BLOCK_SHIFT_LOCAL
+#define BLOCK_SHIFT_LOCAL BLOCK_SHIFT_SECTOR
+#endif
+
+/** A sector that is not being collected from parts */
+#define NO_SECTOR 0xFF
+
+/** The receive buffer for blocks up to BLOCK_SHIFT_LOCAL */
+static uint8_t blockData[1<<BLOCK_SHIFT_LOCAL] __attribute__((aligned(4)));
+
+/** The sector that is collected from blocks smaller than a sector, and the parts received */
+static uint8_t partSector = NO_SECTOR;
+static uint16_t partsReceived;
+
 DataBlock block;
+Session session;
+DigestRequest digest;
 
 ProtocolState state;
 uint8_t bootloaderMode = 0; /** If the node is currently in bootloader mode */
 
+/** The slot the session writes to, NO_SLOT if the node refused the session */
+static uint8_t sessionSlot = NO_SLOT;
+
+/** If the image in the active slot did not match its CRC-32C the last time it was checked */
+static uint8_t verifyFailed = 0;
+
 /**
- * The main function of the application, the bootloader starts here.
+ * Flash the received block and report the result to the programmer.
+ *
+ * The blocks are numbered from the start of the slot of the session,
+ * the last block of the image does not wait for the rest of its sector.
+ * Blocks smaller than a sector are reported as pending when they arrive
+ * and flashed with the last part of their sector.
  */
-int main(void) {
+static void flashBlock( void ) {
+	uint8_t count = 1;
+	if ( block.shift > BLOCK_SHIFT_SECTOR ) {
+		count = 1 << ( block.shift - BLOCK_SHIFT_SECTOR );
+	}
+	else if ( block.shift < BLOCK_SHIFT_SECTOR ) {
+		uint8_t lostSector = 0;
+		uint8_t lostParts  = 0;
+		if ( block.sector != partSector ) {
+			// The parts of a sector that was not completed are overwritten
+			if ( partSector != NO_SECTOR && partsReceived ) {
+				lostSector = partSector;
+				lostParts  = 1;
+			}
+			partSector    = block.sector;
+			partsReceived = 0;
+		}
+		partsReceived |= 1 << block.part;
+		if ( partsReceived != (uint16_t)( ( 1UL << ( 1 << ( BLOCK_SHIFT_SECTOR - block.shift ) ) ) - 1 ) ) {
+			dataStatus( FLASH_STAGED, lostSector, lostParts );
+			return;
+		}
+		partSector = NO_SECTOR;
+	}
 
-	// Disable interrupts right from the start
-	__disable_irq();
+	uint8_t last = block.sector + count >= session.blocks;
+	block.sector += getSlotFirstSector( sessionSlot );
 
-	SystemCoreClockUpdate();
+	flashStatus status = flashNode( &block );
+	if ( ( status == FLASH_STAGED || status == FLASH_UNCHANGED ) && last ) {
+		flashStatus flushed = flashFlush();
+		if ( status == FLASH_STAGED || flushed != FLASH_SUCCESS ) {
+			status = flushed;
+		}
+	}
 
-	// Initialize all needed components
-	initProtocol( &block );
-	initFlash();
-	initStorage();
-	initTimer();
+	// Staged blocks of an earlier sector that could not be written
+	uint8_t lostSector;
+	uint8_t lostBlocks = flashLost( &lostSector );
+	dataStatus( status, lostSector - getSlotFirstSector( sessionSlot ), lostBlocks );
+}
 
-	// Set the timer for 1 second. If we have not
-	// received the signal to go into bootloader
-	// mode after 1 second we start the user program.
-	timerSet( 1000 );
+/**
+ * Check if the application asked to be updated before it reset.
+ *
+ * The request is either the magic word in the reserved RAM word,
+ * which survives a reset, or the magic word in the RTC general
+ * purpose register. Both are cleared so the request is only
+ * honoured once.
+ * @return 1 if an update was requested, 0 otherwise.
+ */
+static uint8_t updateRequested( void ) {
+	uint8_t requested = ( bootRequest == BOOT_REQUEST_MAGIC ) ||
+	                    ( LPC_RTC->BOOT_REQUEST_GPREG == BOOT_REQUEST_MAGIC );
 
-	while( !timerPassed() || bootloaderMode ) {
-		state = check();
+	bootRequest = 0;
+	LPC_RTC->BOOT_REQUEST_GPREG = 0;
 
-		switch( state ) {
-		case DATA_READY:
+	return requested;
+}
 
-			// If a program is being written into the bootloader code, give error.
-			if ( block.sector >= 120 ) {
-				dataStatus( BOOTLOADER_SECTOR );
-			}
-			else if ( block.sector == 0 ) {
-
-				// Save user application's ResetISR pointer and stack pointer.
-				uint32_t startPtrUA = ( block.data[7] << 24 ) | ( block.data[6] << 16 ) | ( block.data[5] << 8 ) | ( block.data[4] );
-				uint32_t stackPtrUA = ( block.data[3] << 24 ) | ( block.data[2] << 16 ) | ( block.data[1] << 8 ) | ( block.data[0] );
-				savePointersStorage( startPtrUA, stackPtrUA );
-
-				// Flash first sector with bootloader's ResetISR pointer and stack pointer,
-				// so bootloader is always called first.
-				uint8_t *stackptr = (uint8_t *)0x00;
-				uint8_t i;
-				int32_t checksum = 0;
-				for ( i = 0; i < 8; i++ ) {
-					block.data[i] = *(stackptr+i);
-				}
-
-				// Compute checksum, making the user application a 'valid user application'
-				uint32_t *index = (uint32_t *)block.data;
-				for ( i = 0; i < 7; i++ ) {
-					checksum += *(index+i);
-				}
-				checksum = 0 - checksum;
-				block.data[28] =   checksum & 0xff;
-				block.data[29] = ( checksum >> 8 ) & 0xff;
-				block.data[30] = ( checksum >> 16 ) & 0xff;
-				block.data[31] = ( checksum >> 24 ) & 0xff;
-
-				// Flash the node.
-				dataStatus( flashNode( &block ) );
+/**
+ * Check if a slot holds a committed image that can be started.
+ * @param[in] slot The slot to check.
+ * @return 1 if the image in the slot can be started, 0 otherwise.
+ */
+static uint8_t slotValid( uint8_t slot ) {
+	return slot < SLOT_COUNT &&
+	       getSlotHeaderStorage( slot )->state == SLOT_VALID &&
+	       slotVectorsValidStorage( slot );
+}
 
-			}
-			else {
-				dataStatus( flashNode( &block ) );
-			}
+/**
+ * Check the image in a slot against the CRC-32C in its header,
+ * block by block over the length that was committed.
+ * @param[in] slot The slot to check, below SLOT_COUNT.
+ * @return 1 if the image is intact, 0 otherwise.
+ */
+static uint8_t imageVerified( uint8_t slot ) {
+	const SlotHeader *header = getSlotHeaderStorage( slot );
+	const uint8_t *image = (const uint8_t *)getSlotAddress( slot );
+	if ( header->length > getSlotSectors() * 4096 ) {
+		return 0;
+	}
 
-			break;
+	uint32_t hash = 0;
+	uint32_t offset;
+	for ( offset = 0; offset < header->length; offset += 4096 ) {
+		uint32_t length = header->length - offset;
+		hash = hashData( hash, image + offset, length < 4096 ? length : 4096 );
+	}
+	return hash == header->crc;
+}
 
-		case RESET_NODE:
-			bootloaderMode = 0;
-			//reset();
-			break;
+/**
+ * Check if there is a complete and intact application to start.
+ *
+ * The image is verified every time, so a node never jumps into
+ * an image that was damaged after it was committed.
+ * @return 1 if the application can be started, 0 otherwise.
+ */
+static uint8_t applicationValid( void ) {
+	uint8_t slot = getActiveSlotStorage();
+	if ( !slotValid( slot ) ) {
+		return 0;
+	}
 
-		case BOOTLOADER:
-			bootloaderMode = 1;
-			break;
+	verifyFailed = !imageVerified( slot );
+	return !verifyFailed;
+}
 
-		case NO_ACTION:
-			if ( (getStackPointerStorage() && getStartPointerStorage()) == 0 ) {
-				bootloaderMode = 1;
-			}
-			break;
+/**
+ * Find the largest block a slot can be written with, a block
+ * has to start and end on the boundaries of the slot and the
+ * largest blocks cover a complete physical sector. A block that
+ * does not fit the local buffer is received in the stage, so it
+ * has to cover a complete physical sector.
+ * @param[in] slot The slot, below SLOT_COUNT.
+ * @return The size of the block as a power of two.
+ */
+static uint8_t largestBlock( uint8_t slot ) {
+	uint8_t shift = BLOCK_SHIFT_MAX;
+	while ( shift > BLOCK_SHIFT_SECTOR &&
+	        ( getSlotAddress( slot ) % ( 1UL << shift ) || getSlotSectors() * 4096UL % ( 1UL << shift ) ||
+	          ( shift > BLOCK_SHIFT_LOCAL && ( 1UL << shift ) < FLASH_SECTOR_MAX ) ) ) {
+		--shift;
+	}
+	return shift;
+}
+
+/**
+ * Start the session the programmer announced.
+ *
+ * The image is written into the slot that starts at the sector it
+ * is linked for, a node refuses it if there is no such slot on this
+ * part or if that is the slot it boots. A block size the node can
+ * not take is refused with the largest block it does take. The slot loses its
+ * committed image before the first block is written.
+ */
+static void beginSession( void ) {
+	// Until the session is accepted blocks go to the local buffer
+	block.data  = blockData;
+	block.shift = BLOCK_SHIFT_SECTOR;
+	partSector  = NO_SECTOR;
+
+	uint8_t slot = getSlotOfSector( session.base );
+	if ( slot == NO_SLOT || session.blocks > getSlotSectors() ||
+	     ( slot == getActiveSlotStorage() && applicationValid() ) ) {
+		sessionSlot = NO_SLOT;
+		return;
+	}
+
+	// Between the local buffer and a complete sector the
+	// largest block that is taken is the local buffer
+	uint8_t shift = largestBlock( slot );
+	if ( session.shift > BLOCK_SHIFT_LOCAL && session.shift < shift ) {
+		shift = BLOCK_SHIFT_LOCAL;
+	}
+	if ( session.shift < BLOCK_SHIFT_MIN || session.shift > shift ) {
+		sessionSlot = NO_SLOT;
+		sessionRefused( shift );
+		return;
+	}
+	sessionSlot = slot;
 
+	// Blocks larger than the local buffer are received in the
+	// stage, which has to be written before it is lent out
+	if ( session.shift > BLOCK_SHIFT_LOCAL ) {
+		if ( flashFlush() != FLASH_SUCCESS ) {
+			sessionSlot = NO_SLOT;
+			sessionRefused( BLOCK_SHIFT_LOCAL );
+			return;
 		}
+		block.data = flashStage();
 	}
+	block.shift = session.shift;
 
-	uint32_t stackPtrUA = getStackPointerStorage();
-	uint32_t startPtrUA = getStartPointerStorage();
+	if ( getSlotHeaderStorage( sessionSlot )->state != SLOT_EMPTY ) {
+		SlotHeader empty = { 0, 0, 0, SLOT_EMPTY };
+		saveSlotStorage( getActiveSlotStorage(), sessionSlot, &empty );
+	}
 
-	deinitTimer();
+	// Keep the record if this is the image of the
+	// interrupted session and report what is done
+	resumeBegin( session.image, getSlotFirstSector( sessionSlot ), session.blocks );
+
+	uint8_t bitmap[RESUME_BITMAP_SIZE];
+	resumeGetBitmap( bitmap );
+	sessionStatus( bitmap );
+}
+
+/**
+ * Boot the slot of the session from now on.
+ *
+ * The slot is only committed when all blocks are flashed and the
+ * CRC-32C of the slot matches the image, the boot slot and the
+ * header of the slot are switched with one write.
+ * @return 1 if the slot is committed, 0 otherwise.
+ */
+static uint8_t commitSlot( void ) {
+	if ( sessionSlot == NO_SLOT || flashFlush() != FLASH_SUCCESS || !resumeComplete() ) {
+		return 0;
+	}
+
+	uint32_t length = session.blocks * 4096;
+	if ( hashData( 0, (const uint8_t *)getSlotAddress( sessionSlot ), length ) != session.image ||
+	     !slotVectorsValidStorage( sessionSlot ) ) {
+		return 0;
+	}
+
+	SlotHeader header = { session.version, length, session.image, SLOT_VALID };
+	return saveSlotStorage( sessionSlot, sessionSlot, &header );
+}
+
+/**
+ * Boot the other slot again, its image is still in place.
+ * @return 1 if the other slot is booted from now on, 0 otherwise.
+ */
+static uint8_t rollbackSlot( void ) {
+	uint8_t active = getActiveSlotStorage();
+	uint8_t other  = ( active + 1 ) % SLOT_COUNT;
+	if ( active == NO_SLOT || !slotValid( other ) ||
+	     !saveSlotStorage( other, other, getSlotHeaderStorage( other ) ) ) {
+		return 0;
+	}
+
+	// The session may not write into the slot we boot
+	if ( sessionSlot == other ) {
+		sessionSlot = NO_SLOT;
+	}
+	return 1;
+}
+
+/**
+ * Tell the programmer which slot we boot and what the slots hold.
+ */
+static void reportSlots( void ) {
+	uint8_t states[SLOT_COUNT];
+	uint8_t i;
+	for ( i = 0; i < SLOT_COUNT; i++ ) {
+		states[i] = getSlotHeaderStorage( i )->state;
+	}
+
+	uint8_t active = getActiveSlotStorage();
+	if ( active == NO_SLOT ) {
+		slotStatus( NO_SLOT, states, 0, verifyFailed );
+	} else {
+		slotStatus( getSlotFirstSector( active ), states, getSlotHeaderStorage( active )->version, verifyFailed );
+	}
+}
+
+/**
+ * Tell the programmer the digest of a region of our flash, so it
+ * can verify what we hold without sending the image again.
+ */
+static void reportDigest( void ) {
+	uint8_t last = getSectorCount() - 1;
+	uint32_t end = getSectorAddress( last ) + getSectorSize( last );
+	if ( digest.length > end || digest.address > end - digest.length ) {
+		digestStatus( 0, 0 );
+		return;
+	}
+
+	digestStatus( hashData( 0, (const uint8_t *)digest.address, digest.length ), 1 );
+}
+
+/**
+ * Use a copy of the vector table in RAM and enable interrupts.
+ */
+static void relocateVectors( void ) {
+	uint8_t i;
+	for ( i = 0; i < VECTOR_COUNT; i++ ) {
+		ramVectors[i] = g_pfnVectors[i];
+	}
+	SCB->VTOR = (uint32_t)ramVectors;
+	__DSB();
+
+	__enable_irq();
+}
+
+/**
+ * Deinitialize everything and start the user application
+ * in the active slot.
+ */
+static void startApplication( void ) {
+	const uint32_t *vectors = (const uint32_t *)getSlotAddress( getActiveSlotStorage() );
+	uint32_t stackPtrUA = vectors[0];
+	uint32_t startPtrUA = vectors[1];
+
+	// Count the start, the journal saves it with its next entry
+	journalBoot();
+
+	// The application gets the interrupts in the
+	// same state as after a reset
+	__disable_irq();
+
+	deinitResume();
 	deinitStorage();
+	deinitJournal();
 	deinitFlash();
 	deinitProtocol();
+	deinitTimer();
+	deinitClock();
+
+	// The application uses the vector table of its slot
+	SCB->VTOR = (uint32_t)vectors;
+	__DSB();
 
 	// Set stack pointer to the start of the user application
 	__set_MSP( stackPtrUA );
@@ -140,5 +416,109 @@ int main(void) {
 	(*startUA)();
 
 	while(1);
+}
+
+/**
+ * The main function of the application, the bootloader starts here.
+ */
+int main(void) {
+
+	// Disable interrupts right from the start
+	__disable_irq();
+
+	// Hash and verify at the highest clock of the part
+	initClock();
+
+	// The layout of the flash depends on the part we run on
+	initGeometry();
+
+	// Only the components to validate the application are
+	// needed to decide if we can start it right away
+	initJournal();
+	initStorage();
+
+	// If the application is complete, intact and did not ask
+	// for an update start it without waiting for the programmer.
+	// Otherwise stay here, the programmer sees a failed image
+	// when it asks for the slots.
+	if ( !updateRequested() && applicationValid() ) {
+		startApplication();
+	}
+
+	// Initialize the rest of the components
+	initResume();
+	// The time base first, sending on the bus times out with it
+	initTimer();
+	initProtocol( &block, &session, &digest );
+	initProfile();
+	initFlash();
+	block.data  = blockData;
+	block.shift = BLOCK_SHIFT_SECTOR;
+
+	// Receive CAN messages in the interrupt from
+	// now on, also while the flash is busy
+	relocateVectors();
+
+	// Stay in bootloader mode until the programmer
+	// resets us and there is an application to start
+	bootloaderMode = 1;
+	while( bootloaderMode ) {
+		state = check();
+
+		switch( state ) {
+		case DATA_READY:
+
+			// Only accept blocks of a session we did not refuse,
+			// they never reach the bootloader or the active slot.
+			if ( sessionSlot == NO_SLOT || block.sector >= session.blocks ) {
+				dataStatus( BOOTLOADER_SECTOR, 0, 0 );
+			}
+			else {
+				flashBlock();
+			}
+
+			break;
+
+		case SESSION:
+			beginSession();
+			break;
+
+		case COMMIT:
+			slotResult( commitSlot() );
+			break;
+
+		case ROLLBACK:
+			slotResult( rollbackSlot() );
+			break;
+
+		case SLOT_QUERY:
+			reportSlots();
+			break;
+
+		case DIGEST:
+			reportDigest();
+			break;
+
+		case PROFILE_QUERY:
+			profileStatus();
+			break;
+
+		case RESET_NODE:
+			// Stay in the bootloader while a staged sector is not written
+			if ( flashFlush() == FLASH_SUCCESS && applicationValid() ) {
+				bootloaderMode = 0;
+			}
+			//reset();
+			break;
+
+		case BOOTLOADER:
+		case NO_ACTION:
+			break;
+
+		}
+	}
+
+	startApplication();
+
 	return 0 ;
 }
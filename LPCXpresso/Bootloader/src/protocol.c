@@ -17,47 +17,160 @@
 #include "can.h"
 #include "iap.h"
 #include "hash.h"
+#include "timer.h"
+#include "profile.h"
+#include "resume.h"
+
+/** The reply that waits for the slot of our short address */
+typedef enum {
+	REPLY_NONE,    /** Nothing to send */
+	REPLY_SESSION, /** The blocks of the session that are flashed */
+	REPLY_DIGEST,  /** The digest of a region of flash */
+	REPLY_PROFILE  /** The profile of every phase */
+} PendingReply;
 
 /** The sector to program and the data we have received so far */
 static DataBlock *block;
+/** The session the programmer started */
+static Session *session;
+/** The region of flash the programmer asked the digest of */
+static DigestRequest *digest;
 /** The index in the data for the point until which we received data */
 static uint8_t *index;
+/** The end of the data of the block that is being received */
+static uint8_t *blockEnd;
 
 /** If this node has been selected by the programmer for reprogramming */
 static uint8_t selected = 0;
 
+/** The image stream this node was assigned to during selection */
+static uint8_t stream = 0;
+
+/** If the block that is currently being sent is meant for our stream */
+static uint8_t receiving = 0;
+
+/** If more data was sent than fits in the block */
+static uint8_t overrun = 0;
+
 /** The message object used as temporary object */
 static CanMessage msg;
 
-/** The serial to use in the CAN protocol of this device */
-static uint8_t serial[4];
+/** The full 128 bit device serial, only used during discovery */
+static uint8_t serial[16];
+
+/** The short address the programmer assigned to this node */
+static uint16_t address = NO_ADDRESS;
+
+/** If the serial matched the last address assignment messages */
+static uint8_t armed = 0;
+
+/** If this node asked the programmer to slow down and its buffer has not drained yet */
+static uint8_t paceReported = 0;
+
+/** The number of lost messages this node last reported */
+static uint32_t reportedOverruns = 0;
+
+/** The reply that is sent when the slot of our short address starts */
+static PendingReply pendingReply = REPLY_NONE;
+/** The bitmap of flashed blocks for the session reply */
+static uint8_t replyBitmap[RESUME_BITMAP_SIZE];
+/** The CRC-32C for the digest reply */
+static uint32_t replyHash;
+/** If the region of the digest reply was hashed */
+static uint8_t replyValid;
+
+static ProtocolState handleMessage( void );
+static void sendReply( void );
 
 /**
- * Set the serial of 4 bytes in a uint8_t array.
- *
- * The random ID is generated from the unique device ID
- * set by NXP during production.
- * @param array The array in which to set the random ID.
+ * Compare 8 bytes of the device serial with the data of a message.
+ * @param data The 8 bytes of data to compare against.
+ * @param offset The offset in the serial, 0 or 8.
+ * @return 1 if the bytes match, 0 otherwise.
  */
-static void setSerial( uint8_t *array ) {
+static uint8_t serialMatches( uint8_t *data, uint8_t offset ) {
 	uint8_t i;
-	for( i=0; i<4; i++ ) {
-		array[i] = serial[i]; // TODO Confirm randomness of these 4 bytes
+	for( i=0; i<8; i++ ) {
+		if( data[i] != serial[offset+i] )
+			return 0;
 	}
+	return 1;
+}
+
+/**
+ * Copy 8 bytes of the device serial in a message.
+ * @param data The 8 bytes of data to copy into.
+ * @param offset The offset in the serial, 0 or 8.
+ */
+static void setSerial( uint8_t *data, uint8_t offset ) {
+	uint8_t i;
+	for( i=0; i<8; i++ ) {
+		data[i] = serial[offset+i];
+	}
+}
+
+/**
+ * Ask the programmer to slow down if the receive buffer fills up
+ * or messages were lost. The report wins the arbitration against
+ * the data frames of the programmer, so it arrives while the block
+ * is still sent. It is only queued, if the transmit buffer is busy
+ * it is tried again on the next check.
+ */
+static void reportBacklog( void ) {
+	uint8_t backlog   = canBacklog();
+	uint32_t overruns = canOverruns();
+
+	if( backlog < PACE_LOW_WATER )
+		paceReported = 0;
+
+	if( overruns == reportedOverruns && ( paceReported || backlog < PACE_HIGH_WATER ) )
+		return;
+
+	CanMessage report;
+	report.id      = 0x0F0;
+	report.length  = 4;
+	report.data[0] = address & 0xFF;
+	report.data[1] = address >> 8;
+	report.data[2] = backlog;
+	report.data[3] = overruns > 0xFF ? 0xFF : overruns;
+	if( !canTrySend( &report ) )
+		return;
+
+	paceReported     = 1;
+	reportedOverruns = overruns;
 }
 
 /**
  * Send to the programmer the result of the CRC and the flashing of a block of data.
  * @param crcSuccess 0 if the CRC was wrong and 1 of the CRC was correct.
  * @param flashSuccess 0 if there was a problem while flashing the node and 1 if it went correctly.
+ * @param unchanged 1 if the flash already contained the block, 0 otherwise.
+ * @param pending 1 if the block waits in RAM for the rest of its sector, it is not written yet.
+ * @param lostSector The virtual sector in the image of the first block that was lost.
+ * @param lostBlocks The bitmap of the blocks from lostSector on that were pending
+ *                   and could not be written, 0 if no block was lost.
+ *
+ * The receive and transmit error counters of the node and the number
+ * of messages it lost follow, the programmer keeps them per node.
  */
-static void sendDataResult( uint8_t crcSuccess, uint8_t flashSuccess ) {
+static void sendDataResult( uint8_t crcSuccess, uint8_t flashSuccess, uint8_t unchanged, uint8_t pending, uint8_t lostSector, uint8_t lostBlocks ) {
 	msg.id      = 0x107;
-	msg.length  = 5;
-	setSerial( msg.data );
+	msg.length  = 8;
+	msg.data[0] = address & 0xFF;
+	msg.data[1] = address >> 8;
+
+	msg.data[2] = (crcSuccess<<0)   | // CRC correct
+				  (flashSuccess<<1) | // Flash correct
+				  (unchanged<<2)    | // Nothing had to be written
+				  (pending<<3);       // Written with the rest of its sector
+
+	// The health of the bus seen by this node, for the telemetry of the programmer
+	uint32_t overruns = canOverruns();
+	canErrorCounters( &msg.data[3], &msg.data[4] );
+	msg.data[5] = overruns > 0xFF ? 0xFF : overruns;
 
-	msg.data[4] = (crcSuccess<<0) |  // CRC correct
-				  (flashSuccess<<1); // Flash correct
+	msg.data[6] = lostSector;
+	msg.data[7] = lostBlocks;
 
 	canSend( &msg );
 }
@@ -66,25 +179,30 @@ static void sendDataResult( uint8_t crcSuccess, uint8_t flashSuccess ) {
  * Initialize the CAN peripheral and setup everything needed to
  * comply to the CAN protocol.
  * @param[out] *blockIn The block to load the data in when receiving
+ * @param[out] *sessionIn The session to load the session details in
+ * @param[out] *digestIn The region to load a digest request in
  */
-void initProtocol( DataBlock *blockIn ) {
-	// Initialize the needed peripherals
+void initProtocol( DataBlock *blockIn, Session *sessionIn, DigestRequest *digestIn ) {
+	// Initialize the needed peripherals, only the messages of the
+	// programmer are buffered. The replies of the other nodes would
+	// fill the buffer and count as lost messages.
 	initCan();
+	canAccept( PROGRAMMER_ID(0x100) | PROGRAMMER_ID(0x101) | PROGRAMMER_ID(0x103) |
+	           PROGRAMMER_ID(0x104) | PROGRAMMER_ID(0x105) | PROGRAMMER_ID(0x106) |
+	           PROGRAMMER_ID(0x108) | PROGRAMMER_ID(0x109) | PROGRAMMER_ID(0x10B) |
+	           PROGRAMMER_ID(0x10C) | PROGRAMMER_ID(0x10F) | PROGRAMMER_ID(0x111) |
+	           PROGRAMMER_ID(0x113) | PROGRAMMER_ID(0x114) | PROGRAMMER_ID(0x117) |
+	           PROGRAMMER_ID(0x119) );
 
 	// Save the block pointer to communicate
 	// received data back to main
-	block  = blockIn;
+	block   = blockIn;
+	session = sessionIn;
+	digest  = digestIn;
 
-	// Initialize the serial with 4 bytes of
-	// the device serial
-	uint8_t tmpSerial[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
-	getDeviceSerial( tmpSerial );
-	{
-		uint8_t i;
-		for( i=0; i<4; i++ ) {
-			serial[i] = tmpSerial[i];
-		}
-	}
+	// Use the full device serial during discovery, after
+	// that the programmer assigns us a short address
+	getDeviceSerial( serial );
 }
 
 /**
@@ -96,40 +214,84 @@ void deinitProtocol( void ) {
 
 /**
  * Check the state of the protocol and respond if necessary.
+ *
+ * A call without a message is profiled as waiting.
  * @return The action the bootloader needs to perform.
  */
 ProtocolState check( void ) {
-	if( canReceive( &msg ) == NO_MESSAGE_RECEIVED )
+	PROFILE_BEGIN( start );
+	// The messages of the programmer are handled while a reply
+	// waits for our slot, so none of them are lost in the wait
+	if( pendingReply != REPLY_NONE && timerPassed() )
+		sendReply();
+
+	if( canReceive( &msg ) == NO_MESSAGE_RECEIVED ) {
+		PROFILE_END( PROFILE_IDLE, start );
 		return NO_ACTION;
+	}
+
+	ProtocolState action = handleMessage();
+	PROFILE_END( PROFILE_CHECK, start );
+	return action;
+}
 
+/**
+ * Handle the received message.
+ * @return The action the bootloader needs to perform.
+ */
+static ProtocolState handleMessage( void ) {
 	switch( msg.id ) {
 	case 0x100: // Go into bootloading mode
 		return BOOTLOADER;
 
 	case 0x101: // Register at the programmer
 		msg.id      = 0x102;
-		msg.length  = 4;
-		setSerial( msg.data );
+		msg.length  = 8;
+		setSerial( msg.data, 0 ); // The first half of the serial
 
 		canSend( &msg );
 		return NO_ACTION; // The bootloader should take no further action
 
-	case 0x103: // Select this node for programming
-		// Check if this node is selected for programming
-		if( !selected ) {
-			selected = 1;
-			uint8_t i;
-			for( i=0; i<4; ++i ) {
-				if( msg.data[i] != serial[i] )
-					selected = 0;
+	case 0x103: // Select nodes for programming
+		// The message contains a bitmap of 48 short addresses
+		// starting at data[1]*48 which are selected for stream data[0]
+		{
+			uint16_t base = msg.data[1] * SELECT_BITMAP_SIZE;
+			uint16_t bit  = address - base;
+			if( address != NO_ADDRESS && address >= base && bit < SELECT_BITMAP_SIZE &&
+					( msg.data[2 + bit/8] & (1<<(bit%8)) ) ) {
+				// Remember which image stream we should listen to
+				selected = 1;
+				stream   = msg.data[0];
 			}
 		}
 
 		return NO_ACTION; // The bootloader should take no further action
 
 	case 0x104: // Address of data to come
+		// Only accept the block if it is part of our stream,
+		// the programmer interleaves the blocks of several
+		// images and sends blocks shared by images once.
+		receiving = selected && ( msg.data[1] & (1<<stream) );
+		if( !receiving )
+			return NO_ACTION;
+
 		block->sector = msg.data[0];
-		index = (block->data);
+		block->part   = msg.length > 2 ? msg.data[2] : 0;
+		index    = block->data;
+		blockEnd = block->data + (1 << block->shift);
+		overrun  = 0;
+
+		// A block smaller than a sector is received at its place in
+		// the sector, the sector is flashed when all parts are there
+		if( block->shift < BLOCK_SHIFT_SECTOR ) {
+			if( block->part >= (1 << (BLOCK_SHIFT_SECTOR - block->shift)) ) {
+				receiving = 0;
+				return NO_ACTION;
+			}
+			index    += block->part << block->shift;
+			blockEnd += block->part << block->shift;
+		}
 
 		// Initialize new hashes, create new hashes for every 4kB
 		initHash();
@@ -137,15 +299,16 @@ ProtocolState check( void ) {
 		return NO_ACTION; // The bootloader should take no further action
 
 	case 0x105: // New data
-		// If this node is not selected to receive data ignore the CAN message
-		if( !selected )
+		// If this node is not receiving this block ignore the CAN message
+		if( !receiving )
 			return NO_ACTION;
 
-		// If the index is further then the edge of the data region
-		// this node must have missed a CRC message or something. Go
-		// into error mode.
-		if( index > &(block->data[4096]) ) {
-			while(1); // TODO Better error
+		// If the index is at the edge of the data region the block
+		// is larger than agreed or this node missed a CRC message,
+		// the block is refused when its CRC arrives.
+		if( index >= blockEnd ) {
+			overrun = 1;
+			return NO_ACTION;
 		}
 
 		{
@@ -158,16 +321,18 @@ ProtocolState check( void ) {
 			hashUpdate(&msg.data[0]);
 
 		}
+		reportBacklog();
 		return NO_ACTION; // The bootloader should take no further action
 
 	case 0x106: // CRC of the received data
-		// If this node is not selected to receive data ignore the CAN message
-		if( !selected )
+		// If this node is not receiving this block ignore the CAN message
+		if( !receiving )
 			return NO_ACTION;
+		receiving = 0;
 
 		// Check if we have received enough messages
-		if( index != &(block->data[4096]) ) {
-			sendDataResult(0,0);
+		if( overrun || index != blockEnd ) {
+			sendDataResult(0,0,0,0,0,0);
 			return NO_ACTION;
 		}
 
@@ -175,13 +340,90 @@ ProtocolState check( void ) {
 			return DATA_READY;
 		}
 		else {
-			sendDataResult(0,0);
+			sendDataResult(0,0,0,0,0,0);
 			return NO_ACTION;
 		}
 
 	case 0x108: // Reset the node
 		return RESET_NODE;
 
+	case 0x109: // Arm the nodes with this first half of the serial
+		armed = serialMatches( msg.data, 0 );
+		if( armed ) {
+			// Tell the programmer the rest of our serial
+			msg.id      = 0x10A;
+			msg.length  = 8;
+			setSerial( msg.data, 8 );
+
+			canSend( &msg );
+		}
+		return NO_ACTION; // The bootloader should take no further action
+
+	case 0x10C: // Disarm if the second half of the serial does not match
+		if( armed )
+			armed = serialMatches( msg.data, 8 );
+		return NO_ACTION; // The bootloader should take no further action
+
+	case 0x10F: // Start a session for the image of a stream
+		if( !selected || msg.data[0] != stream )
+			return NO_ACTION;
+
+		session->image  = (msg.data[1]<<0 ) |
+		                  (msg.data[2]<<8 ) |
+		                  (msg.data[3]<<16) |
+		                  (msg.data[4]<<24);
+		session->blocks = msg.data[5];
+		session->base   = msg.data[6];
+		session->shift  = msg.length > 7 ? msg.data[7] : BLOCK_SHIFT_SECTOR;
+
+		return SESSION;
+
+	case 0x111: // Commit the image of a stream
+		if( !selected || msg.data[0] != stream )
+			return NO_ACTION;
+
+		session->version = msg.data[1] | (msg.data[2]<<8);
+		return COMMIT;
+
+	case 0x113: // Roll the nodes of a stream back to their other slot
+		if( !selected || msg.data[0] != stream )
+			return NO_ACTION;
+		return ROLLBACK;
+
+	case 0x114: // Tell the programmer which slot we boot
+		if( address == NO_ADDRESS )
+			return NO_ACTION;
+		return SLOT_QUERY;
+
+	case 0x117: // Hash a region of our flash
+		if( address == NO_ADDRESS )
+			return NO_ACTION;
+
+		digest->address = msg.data[0] | (msg.data[1]<<8) | (msg.data[2]<<16);
+		digest->length  = msg.data[3] | (msg.data[4]<<8) | (msg.data[5]<<16);
+
+		// All nodes hash at the same time, after the window
+		// the programmer gives every node answers in its slot
+		timerSet( (msg.data[6] | (msg.data[7]<<8)) + address * DIGEST_SLOT_MS );
+		return DIGEST;
+
+#ifdef PROFILE
+	case 0x119: // Tell the programmer where our time went
+		if( address == NO_ADDRESS )
+			return NO_ACTION;
+
+		// Every node answers in the slot of its short address
+		timerSet( address * PROFILE_SLOT_MS );
+		return PROFILE_QUERY;
+#endif
+
+	case 0x10B: // Assign the short address to the armed node
+		if( armed ) {
+			address = msg.data[0] | (msg.data[1]<<8);
+			armed   = 0;
+		}
+		return NO_ACTION; // The bootloader should take no further action
+
 	default: // If we do not know the ID do not do anything with it
 		return NO_ACTION;
 	}
@@ -189,18 +431,211 @@ ProtocolState check( void ) {
 
 /**
  * Return the status of the flashing of the node back to the protocol.
+ *
+ * A staged block is only reported as pending, it is written when its
+ * sector is complete. If that fails the block is reported as lost
+ * with the block that was flashed at the time.
  * @param state The return state of the flashing of the node.
+ * @param lostSector The virtual sector in the image of the first lost block.
+ * @param lostBlocks The bitmap of pending blocks that were lost, 0 if none were.
  */
-void dataStatus( flashStatus state ) {
+void dataStatus( flashStatus state, uint8_t lostSector, uint8_t lostBlocks ) {
 	switch( state ) {
+	case FLASH_STAGED:
+		sendDataResult(1,0,0,1,lostSector,lostBlocks);
+		break;
+
 	case FLASH_SUCCESS:
-		sendDataResult(1,1);
+		sendDataResult(1,1,0,0,lostSector,lostBlocks);
+		break;
+
+	case FLASH_UNCHANGED:
+		sendDataResult(1,1,1,0,lostSector,lostBlocks);
 		break;
 
 	case COMPARE_FAILURE: // TODO More bits to give the programmer a better error.
 	case BOOTLOADER_SECTOR:
 	case INVALID_POINTER:
-		sendDataResult(1,0);
+		sendDataResult(1,0,0,0,lostSector,lostBlocks);
+		break;
+	}
+}
+
+/**
+ * Tell the programmer which blocks of the session are already flashed.
+ *
+ * The bitmap is sent in the slot of our short address, so the nodes
+ * that start the session together do not all answer at once. The
+ * reply is sent by check() when the slot starts.
+ * @param bitmap The bitmap of flashed blocks, RESUME_BITMAP_SIZE bytes.
+ */
+void sessionStatus( uint8_t *bitmap ) {
+	uint8_t i;
+	for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+		replyBitmap[i] = bitmap[i];
+	}
+
+	timerSet( address * SESSION_SLOT_MS );
+	pendingReply = REPLY_SESSION;
+}
+
+/**
+ * Send the bitmap of the session in 3 messages of 5 bytes, every
+ * message starts with the short address and the index of the part.
+ */
+static void sendSessionStatus( void ) {
+	msg.id      = 0x110;
+	msg.length  = 8;
+	msg.data[0] = address & 0xFF;
+	msg.data[1] = address >> 8;
+
+	uint8_t part;
+	for( part=0; part<3; part++ ) {
+		msg.data[2] = part;
+
+		uint8_t i;
+		for( i=0; i<5; i++ ) {
+			msg.data[3+i] = replyBitmap[part*5+i];
+		}
+
+		canSend( &msg );
+	}
+}
+
+/**
+ * Tell the programmer the block size of the session can not be used.
+ * @param shift The largest block this node accepts for the session, as a power of two.
+ */
+void sessionRefused( uint8_t shift ) {
+	msg.id      = 0x116;
+	msg.length  = 3;
+	msg.data[0] = address & 0xFF;
+	msg.data[1] = address >> 8;
+	msg.data[2] = shift;
+
+	canSend( &msg );
+}
+
+/**
+ * Tell the programmer if a commit or rollback succeeded.
+ * @param success 1 if the node boots the requested slot now, 0 otherwise.
+ */
+void slotResult( uint8_t success ) {
+	msg.id      = 0x112;
+	msg.length  = 3;
+	msg.data[0] = address & 0xFF;
+	msg.data[1] = address >> 8;
+	msg.data[2] = success;
+
+	canSend( &msg );
+}
+
+/**
+ * Tell the programmer which slot the node boots.
+ * @param active The first virtual sector of the slot the node boots, or NO_SLOT.
+ * @param states The SlotState of every slot.
+ * @param version The version of the image in the active slot.
+ * @param failed 1 if the image in the active slot did not match its CRC, 0 otherwise.
+ */
+void slotStatus( uint8_t active, uint8_t *states, uint16_t version, uint8_t failed ) {
+	msg.id      = 0x115;
+	msg.length  = 8;
+	msg.data[0] = address & 0xFF;
+	msg.data[1] = address >> 8;
+	msg.data[2] = active;
+	msg.data[3] = states[0];
+	msg.data[4] = states[1];
+	msg.data[5] = version & 0xFF;
+	msg.data[6] = version >> 8;
+	msg.data[7] = failed;
+
+	canSend( &msg );
+}
+
+/**
+ * Tell the programmer the digest of the requested region of flash,
+ * the reply is sent by check() when the slot of our short address starts.
+ * @param hash The CRC-32C of the region.
+ * @param valid 1 if the region is in flash, 0 if it was not hashed.
+ */
+void digestStatus( uint32_t hash, uint8_t valid ) {
+	replyHash    = hash;
+	replyValid   = valid;
+	pendingReply = REPLY_DIGEST;
+}
+
+/**
+ * Send the digest of the requested region of flash.
+ */
+static void sendDigestStatus( void ) {
+	msg.id      = 0x118;
+	msg.length  = 7;
+	msg.data[0] = address & 0xFF;
+	msg.data[1] = address >> 8;
+	msg.data[2] = (replyHash>>0 ) & 0xFF;
+	msg.data[3] = (replyHash>>8 ) & 0xFF;
+	msg.data[4] = (replyHash>>16) & 0xFF;
+	msg.data[5] = (replyHash>>24) & 0xFF;
+	msg.data[6] = replyValid;
+
+	canSend( &msg );
+}
+
+/**
+ * Send the profile of every phase when the slot of our short
+ * address starts, the reply is sent by check().
+ */
+void profileStatus( void ) {
+	pendingReply = REPLY_PROFILE;
+}
+
+/**
+ * Send the profile of every phase. Every phase is sent as 2 messages, the
+ * number of calls and the cycles in units of 1 << PROFILE_CYCLE_SHIFT.
+ */
+static void sendProfileStatus( void ) {
+	uint8_t phase;
+	for( phase=0; phase<PROFILE_COUNT; phase++ ) {
+		const ProfileEntry *entry = profileEntry( phase );
+		uint64_t cycles = entry->cycles >> PROFILE_CYCLE_SHIFT;
+		uint32_t values[2];
+		values[0] = entry->calls;
+		values[1] = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : cycles;
+
+		uint8_t field;
+		for( field=0; field<2; field++ ) {
+			msg.id      = 0x11A;
+			msg.length  = 8;
+			msg.data[0] = address & 0xFF;
+			msg.data[1] = address >> 8;
+			msg.data[2] = phase;
+			msg.data[3] = field;
+			msg.data[4] = (values[field]>>0 ) & 0xFF;
+			msg.data[5] = (values[field]>>8 ) & 0xFF;
+			msg.data[6] = (values[field]>>16) & 0xFF;
+			msg.data[7] = (values[field]>>24) & 0xFF;
+
+			canSend( &msg );
+		}
+	}
+}
+
+/**
+ * Send the reply that waited for the slot of our short address.
+ */
+static void sendReply( void ) {
+	switch( pendingReply ) {
+	case REPLY_SESSION:
+		sendSessionStatus();
+		break;
+	case REPLY_DIGEST:
+		sendDigestStatus();
+		break;
+	case REPLY_PROFILE:
+		sendProfileStatus();
+		break;
+	default:
 		break;
 	}
+	pendingReply = REPLY_NONE;
 }
@@ -0,0 +1,93 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The record of the blocks that have been flashed in the current session,
+ * so an interrupted programming session can be resumed.
+ *
+ * The record is part of the journal, the session is one entry and every
+ * flashed block is another one, so a block costs one small write.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "resume.h"
+#include "journal.h"
+
+/**
+ * Initialize the resume record, the journal holds the record.
+ */
+void initResume( void ) {
+}
+
+/**
+ * Deinitialize the resume record.
+ */
+void deinitResume( void ) {
+}
+
+/**
+ * Start or continue a session for an image.
+ *
+ * If the image is the same as the one of the interrupted session
+ * and goes to the same place the record is kept, otherwise it is
+ * started over.
+ * @param[in] imageId     The identifier of the image.
+ * @param[in] firstSector The virtual sector of the first block.
+ * @param[in] blockCount  The number of blocks in the image.
+ */
+void resumeBegin( uint32_t imageId, uint8_t firstSector, uint8_t blockCount ) {
+	const JournalState *journal = getJournal();
+	if( imageId == journal->image && firstSector == journal->first && blockCount == journal->blocks )
+		return;
+
+	journalSession( imageId, firstSector, blockCount );
+}
+
+/**
+ * Mark a block as flashed in the record.
+ * @param[in] sector The virtual sector that was flashed.
+ */
+void resumeBlockDone( uint8_t sector ) {
+	const JournalState *journal = getJournal();
+	if( sector < journal->first || sector - journal->first >= journal->blocks )
+		return;
+
+	uint8_t block = sector - journal->first;
+	if( block >= RESUME_BITMAP_SIZE*8 || ( journal->done[block/8] & (1<<(block%8)) ) )
+		return;
+
+	journalBlock( block );
+}
+
+/**
+ * Check if all blocks of the image of the session have been flashed.
+ * @return 1 if the session is complete, 0 otherwise.
+ */
+uint8_t resumeComplete( void ) {
+	const JournalState *journal = getJournal();
+	uint8_t i;
+	for( i=0; i<journal->blocks; i++ ) {
+		if( !( journal->done[i/8] & (1<<(i%8)) ) )
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Copy the bitmap of flashed blocks.
+ * @param[out] bitmap The bitmap, RESUME_BITMAP_SIZE bytes.
+ */
+void resumeGetBitmap( uint8_t *bitmap ) {
+	const JournalState *journal = getJournal();
+	uint8_t i;
+	for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+		bitmap[i] = journal->done[i];
+	}
+}
@@ -0,0 +1,221 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The services the bootloader offers a running application, see
+ * bootservice.h for how an application uses them.
+ *
+ * The table is the first thing in the .canbootloader section, which the
+ * linker script puts at BOOT_SERVICE_ADDRESS. The services use the same
+ * modules as the bootloader. The modules keep the state the services
+ * need in the SERVICE section, which the linker script puts in the RAM
+ * the application leaves free. open clears it and builds it again, the
+ * startup code of the application never touched it.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "LPC17xx.h"
+
+#include "bootservice.h"
+#include "flash.h"
+#include "geometry.h"
+#include "journal.h"
+#include "storage.h"
+#include "resume.h"
+#include "hash.h"
+
+#include <cr_section_macros.h>
+
+/** The start and the end of the SERVICE section, from the linker script */
+extern uint32_t _service_bss;
+extern uint32_t _service_ebss;
+
+/** The slot the update is written to, NO_SLOT without a session */
+__BSS(SERVICE) static uint8_t updateSlot;
+
+/** The image of the session and its number of blocks */
+__BSS(SERVICE) static uint32_t updateImage;
+__BSS(SERVICE) static uint8_t updateBlocks;
+
+/**
+ * Find the slot an update goes to, the slot that is not booted.
+ * @return The free slot, NO_SLOT if no slot is booted.
+ */
+static uint8_t freeSlot( void ) {
+	uint8_t active = getActiveSlotStorage();
+	return active == NO_SLOT ? NO_SLOT : ( active + 1 ) % SLOT_COUNT;
+}
+
+/**
+ * Rebuild the state of the services.
+ * @return The address of the free slot, 0 if there is none.
+ */
+static uint32_t serviceOpen( void ) {
+	uint32_t *word;
+	for ( word = &_service_bss; word < &_service_ebss; word++ ) {
+		*word = 0;
+	}
+
+	// IAP is told the clock the application runs at
+	SystemCoreClockUpdate();
+
+	initGeometry();
+	initJournal();
+	initStorage();
+	initResume();
+	initFlash();
+	updateSlot = NO_SLOT;
+
+	uint8_t slot = freeSlot();
+	return slot == NO_SLOT ? 0 : getSlotAddress( slot );
+}
+
+/**
+ * Start or continue the session of an image in the free slot,
+ * the slot loses its committed image.
+ * @param[in] image The CRC-32C of the image.
+ * @param[in] blocks The number of blocks of 4kB in the image.
+ * @param[out] bitmap The blocks that are already done.
+ * @return 1 if the session started, 0 otherwise.
+ */
+static uint8_t serviceBegin( uint32_t image, uint8_t blocks, uint8_t *bitmap ) {
+	uint8_t slot = freeSlot();
+	if ( slot == NO_SLOT || blocks == 0 || blocks > getSlotSectors() ) {
+		return 0;
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint8_t result = 1;
+	if ( getSlotHeaderStorage( slot )->state != SLOT_EMPTY ) {
+		SlotHeader empty = { 0, 0, 0, SLOT_EMPTY };
+		result = saveSlotStorage( getActiveSlotStorage(), slot, &empty );
+	}
+	if ( result ) {
+		resumeBegin( image, getSlotFirstSector( slot ), blocks );
+	}
+
+	__set_PRIMASK( primask );
+
+	if ( !result ) {
+		return 0;
+	}
+	updateSlot   = slot;
+	updateImage  = image;
+	updateBlocks = blocks;
+	resumeGetBitmap( bitmap );
+	return 1;
+}
+
+/**
+ * Find the size of the physical sector that starts at an address.
+ * @param[in] address The address in flash.
+ * @return The size in bytes, 0 if no physical sector starts there.
+ */
+static uint32_t serviceWriteSize( uint32_t address ) {
+	if ( address % 4096 ) {
+		return 0;
+	}
+	uint8_t sector = getPhysicalSector( address / 4096 );
+	if ( sector >= getSectorCount() || getSectorAddress( sector ) != address ) {
+		return 0;
+	}
+	return getSectorSize( sector );
+}
+
+/**
+ * Write a physical sector of the slot of the session.
+ *
+ * A complete physical sector is written without the stage
+ * of the bootloader, the application owns that RAM.
+ * @param[in] address The start of the physical sector.
+ * @param[in] data The word aligned data in RAM.
+ * @return The flashStatus of the write.
+ */
+static int8_t serviceWrite( uint32_t address, const uint32_t *data ) {
+	uint32_t size = serviceWriteSize( address );
+	if ( updateSlot == NO_SLOT || size == 0 ) {
+		return INVALID_POINTER;
+	}
+
+	uint32_t slotAddress = getSlotAddress( updateSlot );
+	if ( address < slotAddress || address + size > slotAddress + getSlotSectors() * 4096 ) {
+		return BOOTLOADER_SECTOR;
+	}
+
+	DataBlock block;
+	block.sector = address / 4096;
+	block.part   = 0;
+	block.shift  = BLOCK_SHIFT_SECTOR;
+	while ( ( 1UL << block.shift ) < size ) {
+		++block.shift;
+	}
+	block.data   = (uint8_t *)data;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	flashStatus status = flashNode( &block );
+	__set_PRIMASK( primask );
+
+	return status;
+}
+
+/**
+ * Check if the session is complete and the slot matches the image.
+ * @return 1 if the image can be committed, 0 otherwise.
+ */
+static uint8_t serviceVerify( void ) {
+	if ( updateSlot == NO_SLOT || !resumeComplete() ) {
+		return 0;
+	}
+
+	const uint8_t *image = (const uint8_t *)getSlotAddress( updateSlot );
+	return hashData( 0, image, updateBlocks * 4096 ) == updateImage &&
+	       slotVectorsValidStorage( updateSlot );
+}
+
+/**
+ * Boot the slot of the session from the next reset on, the
+ * boot slot and the header are switched with one write.
+ * @param[in] version The version of the image.
+ * @return 1 if the slot is committed, 0 otherwise.
+ */
+static uint8_t serviceCommit( uint32_t version ) {
+	if ( !serviceVerify() ) {
+		return 0;
+	}
+
+	SlotHeader header = { version, updateBlocks * 4096, updateImage, SLOT_VALID };
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t result = saveSlotStorage( updateSlot, updateSlot, &header );
+	__set_PRIMASK( primask );
+
+	return result;
+}
+
+/**
+ * The table of services, at BOOT_SERVICE_ADDRESS.
+ */
+__attribute__ ((section(".canbootloader"), used))
+const BootService bootService = {
+	BOOT_SERVICE_MAGIC,
+	BOOT_SERVICE_VERSION,
+	sizeof(BootService),
+	serviceOpen,
+	serviceBegin,
+	serviceWrite,
+	serviceVerify,
+	serviceCommit,
+	serviceWriteSize,
+	hashData
+};
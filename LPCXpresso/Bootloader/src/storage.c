@@ -8,15 +8,21 @@
  *
  * ===============================================================================================================
  *
- * The functions to deal with the storage of the start and stack pointers.
+ * The record of the application slots, which slot the node boots and
+ * what image every slot holds.
+ *
+ * The record is part of the journal, a change to a header and the slot
+ * to boot is one entry so a commit or a rollback is atomic.
  *
  * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
  */
 
 #include "storage.h"
+#include "journal.h"
+#include "geometry.h"
 
 /**
- * Initialize the storage unit.
+ * Initialize the storage unit, the journal holds the record.
  */
 void initStorage( void ) {
 }
@@ -28,33 +34,56 @@ void deinitStorage( void ) {
 }
 
 /**
- * Save both the start and the stack pointer in the storage unit at the predefined address.
- * @param[in] startpointer The value of the startpointer.
- * @param[in] stackpointer The value of the stackpointer.
+ * Retrieve the slot the node boots.
+ * @return The active slot or NO_SLOT.
+ */
+uint8_t getActiveSlotStorage( void ) {
+
+	uint32_t active = getJournal()->active;
+	return active < SLOT_COUNT ? active : NO_SLOT;
+
+}
+
+/**
+ * Retrieve the header of a slot.
+ * @param[in] slot The slot, below SLOT_COUNT.
+ * @return         The header of the slot.
  */
-void savePointersStorage( uint32_t startpointer, uint32_t stackpointer ) {
+const SlotHeader *getSlotHeaderStorage( uint8_t slot ) {
 
-	*((uint32_t *)0x20) = stackpointer;
-	*((uint32_t *)0x24) = startpointer;
+	return &getJournal()->slots[slot];
 
 }
 
 /**
- * Retrieve the start pointer from the storage unit.
- * @return The value of the start pointer.
+ * Save the header of a slot and the slot to boot in one write.
+ * @param[in] active The slot to boot or NO_SLOT.
+ * @param[in] slot   The slot of the header, below SLOT_COUNT.
+ * @param[in] header The new header of the slot.
+ * @return           1 if the record was saved, 0 otherwise.
  */
-uint32_t getStartPointerStorage( void ) {
+uint8_t saveSlotStorage( uint8_t active, uint8_t slot, const SlotHeader *header ) {
 
-	return *((uint32_t *)0x24);
+	return journalSlot( active, slot, header );
 
 }
 
 /**
- * Retrieve the stack pointer from the storage unit.
- * @return The value of the stack pointer.
+ * Check if the vector table of a slot belongs to an image linked for it.
+ *
+ * The stack has to be in one of the RAM banks and the
+ * reset handler in the slot the image is linked for.
+ * @param[in] slot The slot to check, below SLOT_COUNT.
+ * @return 1 if the vectors are plausible, 0 otherwise.
  */
-uint32_t getStackPointerStorage( void ) {
+uint8_t slotVectorsValidStorage( uint8_t slot ) {
 
-	return *((uint32_t *)0x20);
+	const uint32_t *vectors = (const uint32_t *)getSlotAddress( slot );
+	uint32_t stackPtrUA = vectors[0];
+	uint32_t startPtrUA = vectors[1];
+	return ( ( stackPtrUA > 0x10000000 && stackPtrUA <= 0x10008000 ) ||
+	         ( stackPtrUA > 0x2007C000 && stackPtrUA <= 0x20084000 ) ) &&
+	       startPtrUA >= getSlotAddress( slot ) &&
+	       startPtrUA <  getSlotAddress( slot ) + getSlotSectors() * 4096;
 
 }
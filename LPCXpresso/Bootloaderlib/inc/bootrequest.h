@@ -0,0 +1,36 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The interface for an application to request an update from the bootloader.
+ *
+ * The bootloader starts a complete application right away. To get
+ * into bootloader mode the application writes BOOT_REQUEST_MAGIC to
+ * BOOT_REQUEST_ADDRESS, the first word of RAM which the bootloader
+ * does not initialize, or to the RTC general purpose register and
+ * resets the processor.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#ifndef BOOTREQUEST_H__
+#define BOOTREQUEST_H__
+
+/** The value that requests an update */
+#define BOOT_REQUEST_MAGIC   0xB007C0DE
+
+/** The RAM word that survives a reset */
+#define BOOT_REQUEST_ADDRESS 0x10000000
+
+/** The RTC general purpose register, it also survives a power cycle on the battery */
+#define BOOT_REQUEST_GPREG   GPREG4
+
+#endif
@@ -0,0 +1,127 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The services the bootloader offers a running application.
+ *
+ * With these services an application receives an update in the background,
+ * over its own CAN traffic, while it keeps running. Only the reset into the
+ * new image stops it. The table of services is at BOOT_SERVICE_ADDRESS in the
+ * bootloader. An application checks the magic word and the version before it
+ * calls a service, later versions only add services to the end of the table.
+ *
+ * An update is received like this:
+ *
+ *   open      Find the slot the update has to be linked for, the slot
+ *             that is not booted. Call it after the clock setup, IAP
+ *             needs the core clock.
+ *   begin     Start the session of the image, or continue the one that
+ *             was interrupted, the bitmap tells which blocks are done.
+ *   write     Write one physical sector of the slot at a time, see
+ *             writeSize. The blocks of 4kB in it are marked as done.
+ *   commit    Check the CRC-32C of the image and boot it from the next
+ *             reset on.
+ *
+ * The services run on the stack of the application. Their state is in
+ * the RAM from BOOT_SERVICE_RAM to BOOT_SERVICE_RAM_END, which the
+ * application may not use, and the top 32 bytes of the local RAM are
+ * used by IAP. Interrupts are disabled while the flash is busy, because
+ * the flash can not be read while IAP erases or writes it.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#ifndef BOOTSERVICE_H__
+#define BOOTSERVICE_H__
+
+/** The address of the table of services, the start of the .canbootloader section */
+#define BOOT_SERVICE_ADDRESS   0xA000
+
+/** The magic word of the table, "BSVC" */
+#define BOOT_SERVICE_MAGIC     0x42535643
+
+/** The version of the table */
+#define BOOT_SERVICE_VERSION   1
+
+/** The RAM the services keep their state in, after the boot request word */
+#define BOOT_SERVICE_RAM       0x10000004
+#define BOOT_SERVICE_RAM_END   0x10001400
+
+/** The size of the bitmap of blocks that are done, one bit per 4kB block */
+#define BOOT_SERVICE_BITMAP_SIZE 15
+
+/**
+ * The table of services.
+ */
+typedef struct {
+	uint32_t magic;   /** BOOT_SERVICE_MAGIC */
+	uint16_t version; /** The BOOT_SERVICE_VERSION of the bootloader */
+	uint16_t size;    /** The size of the table in bytes */
+
+	/**
+	 * Rebuild the state of the services.
+	 * @return The address of the slot the update has to be
+	 *         linked for, 0 if there is no such slot.
+	 */
+	uint32_t (*open)( void );
+
+	/**
+	 * Start or continue the session of an image in the free slot.
+	 * @param[in] image The CRC-32C of the image, the first blocks * 4kB bytes of the slot.
+	 * @param[in] blocks The number of blocks of 4kB in the image.
+	 * @param[out] bitmap The blocks that are already done, BOOT_SERVICE_BITMAP_SIZE bytes.
+	 * @return 1 if the session started, 0 if the image does not fit the slot.
+	 */
+	uint8_t (*begin)( uint32_t image, uint8_t blocks, uint8_t *bitmap );
+
+	/**
+	 * Write a physical sector of the free slot.
+	 * @param[in] address The start of the physical sector.
+	 * @param[in] data The word aligned data in RAM, writeSize( address ) bytes.
+	 * @return 0 if written, 2 if the flash already held the data,
+	 *         a negative number if the sector could not be written.
+	 */
+	int8_t (*write)( uint32_t address, const uint32_t *data );
+
+	/**
+	 * Check if the session is complete and the slot matches the image.
+	 * @return 1 if the image can be committed, 0 otherwise.
+	 */
+	uint8_t (*verify)( void );
+
+	/**
+	 * Boot the image of the session from the next reset on.
+	 * @param[in] version The version of the image.
+	 * @return 1 if the image is committed, 0 otherwise.
+	 */
+	uint8_t (*commit)( uint32_t version );
+
+	/**
+	 * Find the size of the physical sector that starts at an address.
+	 * @param[in] address The address in flash.
+	 * @return The size in bytes, 0 if no physical sector starts there.
+	 */
+	uint32_t (*writeSize)( uint32_t address );
+
+	/**
+	 * Continue the CRC-32C of a region, the one of the bootloader.
+	 * @param[in] hash The CRC of the data before, 0 for the first piece.
+	 * @param[in] data The data.
+	 * @param[in] length The size of the data in bytes.
+	 * @return The CRC of the data up to here.
+	 */
+	uint32_t (*hash)( uint32_t hash, const uint8_t *data, uint32_t length );
+} BootService;
+
+/** The table of services in the bootloader */
+#define BOOT_SERVICE ( (const BootService *)BOOT_SERVICE_ADDRESS )
+
+#endif
@@ -15,6 +15,9 @@
 
 #include <stdint.h>
 
+#include "LPC17xx.h"
+#include "timer.h"
+
 #ifndef CAN_H__
 #define CAN_H__
 
@@ -22,6 +25,7 @@ typedef struct {
 	uint16_t id;
 	uint8_t length;
 	uint8_t data[8];
+	uint32_t timestamp; /** The time the message was received, see timerNow */
 } CanMessage;
 
 typedef enum {
@@ -29,9 +33,59 @@ typedef enum {
 	MESSAGE_RECEIVED    = 1
 } CanReceiveStatus;
 
+/** The number of received messages that can be buffered, a power of 2 */
+#define CAN_RX_BUFFER_SIZE 128
+
+/** The IDs a bus buffers unless canBusAccept is called, every ID */
+#define CAN_ACCEPT_ALL 0xFFFFFFFF
+
+/**
+ * The CAN controllers of the LPC17xx.
+ */
+typedef enum {
+	CAN_BUS_1     = 0, /** CAN1 on P0.0 and P0.1 */
+	CAN_BUS_2     = 1, /** CAN2 on P0.4 and P0.5, the bus of the bootloader */
+	CAN_BUS_COUNT
+} CanController;
+
+/**
+ * A CAN controller and the messages it received.
+ */
+typedef struct {
+	LPC_CAN_TypeDef *peripheral;                    /** The registers, 0 while the bus is not initialized */
+	volatile CanMessage rxBuffer[CAN_RX_BUFFER_SIZE]; /** The received messages, filled by the interrupt handler */
+	volatile uint8_t rxHead;                        /** The index where the interrupt handler puts the next message */
+	volatile uint8_t rxTail;                        /** The index of the next message to return */
+	volatile uint32_t rxOverruns;                   /** The number of messages lost because the buffer was full */
+	uint32_t rxAccepted;                            /** The IDs that are buffered, bit n for 0x100+n, or CAN_ACCEPT_ALL */
+} CanBus;
+
+CanBus *canBus( CanController controller );
+void initCanBus( CanBus *bus );
+void deinitCanBus( CanBus *bus );
+void canBusAccept( CanBus *bus, uint32_t ids );
+CanReceiveStatus canBusReceive( CanBus *bus, CanMessage *msg );
+uint8_t canBusSend( CanBus *bus, CanMessage *msg );
+uint8_t canBusTrySend( CanBus *bus, CanMessage *msg );
+void canBusQueueFrame( CanBus *bus, uint16_t id, const uint32_t *data );
+uint8_t canBusTransmitReady( CanBus *bus );
+uint8_t canBusPending( CanBus *bus );
+uint8_t canBusBacklog( CanBus *bus );
+uint32_t canBusOverruns( CanBus *bus );
+void canBusErrorCounters( CanBus *bus, uint8_t *receive, uint8_t *transmit );
+
 void initCan( void );
 void deinitCan( void );
+void canAccept( uint32_t ids );
 CanReceiveStatus canReceive( CanMessage *msg );
-void canSend( CanMessage *msg );
+uint8_t canSend( CanMessage *msg );
+uint8_t canTrySend( CanMessage *msg );
+void canQueueFrame( uint16_t id, const uint32_t *data );
+uint8_t canTransmitReady( void );
+uint8_t canPending( void );
+uint8_t canBacklog( void );
+uint32_t canOverruns( void );
+void canErrorCounters( uint8_t *receive, uint8_t *transmit );
+void CAN_IRQHandler( void );
 
 #endif
@@ -18,10 +18,7 @@
 #ifndef _hash_h
 #define _hash_h
 
-/** The number of hashes that are generated during every update cycle */
-#define HASH_COUNT       4
-
-/** The final amount of hashes (32bit) that will be transmitted */
+/** The number of 32 bit words of the block hash that will be transmitted */
 #define HASH_COUNT_FINAL 2
 
 void initHash( void );
@@ -29,5 +26,6 @@ void deinitHash( void );
 void hashUpdate( uint8_t *data );
 uint8_t hashCheck( uint32_t *receivedHash );
 void hashCopy( uint32_t *storage );
+uint32_t hashData( uint32_t hash, const uint8_t *data, uint32_t length );
 
 #endif /* _hash_h */
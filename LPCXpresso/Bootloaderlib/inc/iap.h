@@ -22,6 +22,7 @@
 uint8_t prepareFlash( uint8_t sector );
 uint8_t blankFlash( uint8_t sector );
 uint8_t checkBlank( uint8_t sector );
-uint8_t compareFlash( uint8_t *data, uint8_t sector, uint16_t offset );
-uint8_t writeFlash( uint8_t *data, uint8_t sector, uint16_t offset );
+uint8_t compareFlash( uint8_t *data, uint8_t sector, uint16_t offset, uint16_t length );
+uint8_t writeFlash( uint8_t *data, uint8_t sector, uint16_t offset, uint16_t length );
 void getDeviceSerial( uint8_t *serial );
+uint32_t getPartId( void );
@@ -0,0 +1,76 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The profile of where the time of a node goes, in cycles.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#ifndef PROFILE_H__
+#define PROFILE_H__
+
+#include <stdint.h>
+
+/**
+ * The phases that are profiled, the numbers are part of the protocol.
+ */
+typedef enum {
+	PROFILE_RECEIVE = 0, /** Taking a message out of the receive buffer, canReceive */
+	PROFILE_CHECK   = 1, /** Handling a message, check, including its receive and hash */
+	PROFILE_HASH    = 2, /** Hashing a frame, hashUpdate */
+	PROFILE_PREPARE = 3, /** Preparing a sector for IAP */
+	PROFILE_ERASE   = 4, /** Erasing a sector */
+	PROFILE_BLANK   = 5, /** Checking if a sector is blank */
+	PROFILE_WRITE   = 6, /** Writing to the flash */
+	PROFILE_COMPARE = 7, /** Comparing the flash with RAM */
+	PROFILE_IDLE    = 8, /** Waiting for a message, check when there is none */
+	PROFILE_COUNT
+} ProfilePhase;
+
+/** The cycles are reported in units of 1 << PROFILE_CYCLE_SHIFT */
+#define PROFILE_CYCLE_SHIFT 8
+
+/**
+ * The cycles and the number of calls of a phase.
+ */
+typedef struct {
+	uint64_t cycles; /** The cycles spent in the phase */
+	uint32_t calls;  /** The number of times the phase ran */
+} ProfileEntry;
+
+/*
+ * The profile is only kept if PROFILE is defined for the build
+ * of both Bootloaderlib and the Bootloader, without it the
+ * measurements compile to nothing.
+ */
+#ifdef PROFILE
+
+/** The cycle counter of the DWT, CMSIS 2.10 does not define the DWT */
+#define PROFILE_DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define PROFILE_DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+
+/** Start to measure a phase, the start is kept in a local variable */
+#define PROFILE_BEGIN( start )        uint32_t start = PROFILE_DWT_CYCCNT
+
+/** Add the cycles since the start to a phase */
+#define PROFILE_END( phase, start )   profileAdd( phase, start )
+
+#else
+
+#define PROFILE_BEGIN( start )
+#define PROFILE_END( phase, start )
+
+#endif
+
+void initProfile( void );
+void profileAdd( ProfilePhase phase, uint32_t start );
+const ProfileEntry *profileEntry( ProfilePhase phase );
+
+#endif
@@ -16,10 +16,67 @@
 #ifndef TIMER__H_
 #define TIMER__H_
 
+#include <stdint.h>
+
+#include "LPC17xx.h"
+
+/** Place a function in RAM, so it can run while IAP blocks the flash */
+#define RAMFUNC __attribute__ ((section(".data.ramfunc"), noinline))
+
+/** The number of software timers */
+#define TIMER_COUNT 8
+
+/**
+ * The software timers, every one of them runs a
+ * single delay that is polled with timerDone.
+ */
+typedef enum {
+	TIMER_0 = 0, /** Used by timerSet and timerPassed */
+	TIMER_1 = 1, /** Used by timerSetMicros and timerMicrosPassed */
+	TIMER_2 = 2,
+	TIMER_3 = 3,
+	TIMER_4 = 4,
+	TIMER_5 = 5,
+	TIMER_6 = 6,
+	TIMER_7 = 7
+} Timer;
+
+/**
+ * The time base, a free running counter of microseconds.
+ *
+ * It wraps after 71 minutes, so only compare the
+ * difference between two times, see timerSince.
+ *
+ * It is always inlined, so the interrupt handlers
+ * in RAM can take a time while IAP blocks the flash.
+ *
+ * @return The current time in microseconds.
+ */
+static inline __attribute__ ((always_inline)) uint32_t timerNow( void ) {
+	return LPC_TIM0->TC;
+}
+
+/**
+ * The time since an earlier time of timerNow.
+ *
+ * @param[in] then The earlier time.
+ * @return The elapsed microseconds.
+ */
+static inline uint32_t timerSince( uint32_t then ) {
+	return timerNow() - then;
+}
+
 void initTimer( void );
 void deinitTimer( void );
 void timerDelay( uint16_t milliSeconds );
-void timerSet( uint16_t milliSeconds );
+void timerSet( uint32_t milliSeconds );
 uint8_t timerPassed( void );
+uint32_t timerElapsed( void );
+void timerSetMicros( uint32_t microSeconds );
+uint8_t timerMicrosPassed( void );
+void timerStart( Timer timer, uint32_t microSeconds );
+uint8_t timerDone( Timer timer );
+uint32_t timerMicros( Timer timer );
+void TIMER0_IRQHandler( void );
 
 #endif
@@ -18,10 +18,16 @@
 #ifndef UART_H__
 #define UART_H__
 
+/** The number of received bytes that can be buffered, a power of 2 */
+#define UART_RX_BUFFER_SIZE 512
+
 void initUART();
 void deinitUART();
 void uartSend(uint8_t *data, uint32_t length);
 void uartReceive( uint8_t *destination, uint32_t length );
+uint16_t uartRead( uint8_t *destination, uint16_t length );
+uint16_t uartAvailable( void );
+uint32_t uartOverruns( void );
 void UART0_IRQHandler( void );
 
 #endif
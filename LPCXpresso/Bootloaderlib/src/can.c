@@ -10,140 +10,515 @@
  *
  * The driver functions for the CAN peripheral.
  *
+ * Both controllers of the LPC17xx can be used, every controller is a
+ * CanBus with its own receive buffer. The functions without a bus are
+ * for CAN2, the bus of the bootloader.
+ *
  * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
  */
 
 #include "LPC17xx.h"
 #include "can.h"
+#include "profile.h"
+
+/** The bit rate of the bus */
+#define CAN_BITRATE    100000
+
+/** The number of time quanta in a bit, 1 + TSEG1 + TSEG2 */
+#define CAN_BIT_QUANTA 20
+
+/**
+ * The time a frame gets to leave the transmit buffer, in us. A frame
+ * that no node acknowledges is sent again forever, so on a bus without
+ * nodes the transmission is aborted after this time.
+ */
+#define CAN_TRANSMIT_TIMEOUT_US 10000
+
+static void canResetError( CanBus *bus );
+
+/**
+ * The controllers. The received messages are copied out of the
+ * peripheral by the interrupt handler, which runs from RAM so
+ * messages are not lost while the flash is being erased or written.
+ */
+static CanBus buses[CAN_BUS_COUNT];
 
-static void canResetError( void );
+/**
+ * The pins, power and clock of a controller.
+ */
+typedef struct {
+	LPC_CAN_TypeDef *peripheral;
+	uint8_t power;     /** The bit in PCONP */
+	uint8_t clock;     /** The first of the 2 bits in PCLKSEL0 */
+	uint8_t rdPin;     /** The first of the 2 bits of the RD pin in PINSEL0 */
+	uint8_t tdPin;     /** The first of the 2 bits of the TD pin in PINSEL0 */
+	uint8_t function;  /** The pin function of RD and TD */
+} CanPins;
+
+static const CanPins pins[CAN_BUS_COUNT] = {
+	{ LPC_CAN1, 13, 26, 0, 2,  0x1 }, // RD1 on P0.0, TD1 on P0.1
+	{ LPC_CAN2, 14, 28, 8, 10, 0x2 }  // RD2 on P0.4, TD2 on P0.5
+};
 
 /**
- * Setup the CAN peripheral.
+ * Get a controller, it has to be initialized before use.
  *
- * The pins for the 2th CAN peripheral are set to the right
- * mode, the power and clock are setup for the CAN peripheral
- * and CAN peripheral 2 is cleared and setup (timing and such).
+ * @param[in] controller The controller.
+ * @return The bus of the controller.
  */
-void initCan( void ) {
+CanBus *canBus( CanController controller ) {
+	return &buses[controller];
+}
+
+/**
+ * Setup a CAN controller.
+ *
+ * The pins of the controller are set to the right mode, the
+ * power and clock are setup for the controller and it is
+ * cleared and setup (timing and such).
+ *
+ * @param[in] bus The bus of the controller, see canBus.
+ */
+void initCanBus( CanBus *bus ) {
+	const CanPins *setup = &pins[bus - buses];
+	LPC_CAN_TypeDef *can = setup->peripheral;
+
 	// Set the processor pins to the correct mode
-	LPC_PINCON->PINSEL0 &= ~(0x2<<8);  // Reset the function of Pin 0.4
-	LPC_PINCON->PINSEL0 |= (0x2<<8);   // Set the function of Pin 0.4 to RD2
-	LPC_PINCON->PINSEL0 &= ~(0x2<<10); // Reset the function of Pin 0.5
-	LPC_PINCON->PINSEL0 |= (0x2<<10);  // Set the function of Pin 0.5 to TD2
+	LPC_PINCON->PINSEL0 &= ~(0x3<<setup->rdPin);            // Reset the function of the RD pin
+	LPC_PINCON->PINSEL0 |= (setup->function<<setup->rdPin); // Set the function of the pin to RD
+	LPC_PINCON->PINSEL0 &= ~(0x3<<setup->tdPin);            // Reset the function of the TD pin
+	LPC_PINCON->PINSEL0 |= (setup->function<<setup->tdPin); // Set the function of the pin to TD
 
 	// Setup the power and clock for the peripheral
-	LPC_SC->PCONP    |= (1<<14);  // Set the power bit for CAN peripheral 2
-	LPC_SC->PCLKSEL0 &= ~(3<<28); // Clear the 2 CAN clock divider bits for can peripheral 2
-	LPC_SC->PCLKSEL0 |= (1<<28);  // Set the clock divider for CAN peripheral 2 to 1,
-	                              // so the main clock is the CAN clock
+	LPC_SC->PCONP    |= (1<<setup->power);  // Set the power bit for the CAN peripheral
+	LPC_SC->PCLKSEL0 &= ~(3<<setup->clock); // Clear the 2 CAN clock divider bits for the peripheral
+	LPC_SC->PCLKSEL0 |= (1<<setup->clock);  // Set the clock divider for the peripheral to 1,
+	                                        // so the main clock is the CAN clock
 	LPC_SC->PCLKSEL0 &= ~(3<<30); // Clear the 2 clock divider bits for the can acceptance filter
 	LPC_SC->PCLKSEL0 |= (1<<30);  // Set the clock divider for acceptance filter to 1
 
 	// Setup peripheral related settings
-	LPC_CAN2->MOD = 0x1; // Set the CAN peripheral in reset mode so you can change values
-	LPC_CAN2->IER = 0x0; // Turn off all CAN related interrupts, they would not fire anyway
-	LPC_CAN2->GSR = 0x0; // Set the error counters to 0
+	can->MOD = 0x1; // Set the CAN peripheral in reset mode so you can change values
+	can->IER = 0x0; // Turn off all CAN related interrupts while setting up
+	can->GSR = 0x0; // Set the error counters to 0
 	// Clear everything you can via the command register
-	LPC_CAN2->CMR = (0x1<<1) | // Abort transmission bit
-	                (0x1<<2) | // Release receive buffer
-	                (0x1<<3);  // Clear data overrun bit
+	can->CMR = (0x1<<1) | // Abort transmission bit
+	           (0x1<<2) | // Release receive buffer
+	           (0x1<<3);  // Clear data overrun bit
 
-	LPC_CAN2->BTR = 0xDCC001; // Set the bit rate of the CAN peripheral to 100kbit/s
-	                          // BRP   = 1
-	                          // SJW   = 3
-	                          // TESG1 = 12
-	                          // TESG2 = 5
-	                          // SAM   = 1
+	// Set the bit rate of the CAN peripheral to 100kbit/s at any core clock
+	can->BTR = 0xDCC000 | ( SystemCoreClock / ( CAN_BITRATE * CAN_BIT_QUANTA ) - 1 );
+	                     // BRP   = clock / 2MHz - 1
+	                     // SJW   = 3
+	                     // TESG1 = 12
+	                     // TESG2 = 5
+	                     // SAM   = 1
 
-	LPC_CAN2->MOD = 0; // Enable the CAN peripheral again
+	can->MOD = 0; // Enable the CAN peripheral again
 
 	LPC_CANAF->AFMR |= (1<<1); // Set the acceptance filter in bypass mode
+
+	// Empty the receive buffer and receive messages in the interrupt
+	bus->rxHead     = 0;
+	bus->rxTail     = 0;
+	bus->rxOverruns = 0;
+	bus->rxAccepted = CAN_ACCEPT_ALL;
+	bus->peripheral = can;
+	can->IER = (1<<0);    // Receive interrupt
+	NVIC_EnableIRQ( CAN_IRQn );
 }
 
 /**
- * Deinitialize the CAN peripheral.
+ * Deinitialize a CAN controller.
+ *
+ * @param[in] bus The bus of the controller.
  */
-void deinitCan( void ) {
+void deinitCanBus( CanBus *bus ) {
+	const CanPins *setup = &pins[bus - buses];
+
+	// Stop receiving messages in the interrupt, the
+	// interrupt is shared by both controllers
+	setup->peripheral->IER = 0;
+	bus->peripheral = 0;
+	uint8_t i;
+	for( i=0; i<CAN_BUS_COUNT && !buses[i].peripheral; i++ );
+	if( i == CAN_BUS_COUNT ) {
+		NVIC_DisableIRQ( CAN_IRQn );
+		NVIC_ClearPendingIRQ( CAN_IRQn );
+	}
+
 	// Disable power to the CAN block
-	LPC_SC->PCONP &= ~(1<<14);
+	LPC_SC->PCONP &= ~(1<<setup->power);
 
 	// Reset the pins
-	LPC_PINCON->PINSEL0 &= ~(0x2<<8);  // Reset the function of Pin 0.4
-	LPC_PINCON->PINSEL0 &= ~(0x2<<10); // Reset the function of Pin 0.5
+	LPC_PINCON->PINSEL0 &= ~(0x3<<setup->rdPin);
+	LPC_PINCON->PINSEL0 &= ~(0x3<<setup->tdPin);
 }
 
 /**
  * Resets the transmit and receive error counts.
  */
-static void canResetError( void ) {
+static void canResetError( CanBus *bus ) {
+
+	bus->peripheral->MOD |= 1; // Go into reset mode so error counters can be changed
+	bus->peripheral->GSR &= 0xffff << 16; // Reset transmit and receive error counters
+	bus->peripheral->MOD &= 0; // Change to normal mode again
+}
 
-	LPC_CAN2->MOD |= 1; // Go into reset mode so error counters can be changed
-	LPC_CAN2->GSR &= 0xffff << 16; // Reset transmit and receive error counters
-	LPC_CAN2->MOD &= 0; // Change to normal mode again
+/**
+ * Copy the received messages out of the peripherals in their receive buffer.
+ *
+ * This handler runs from RAM and does not call any function in flash,
+ * the vector table has to be in RAM as well for it to fire while IAP
+ * is erasing or writing the flash.
+ */
+RAMFUNC void CAN_IRQHandler( void ) {
+	uint8_t i;
+	for( i=0; i<CAN_BUS_COUNT; i++ ) {
+		CanBus *bus = &buses[i];
+		LPC_CAN_TypeDef *can = bus->peripheral;
+		if( !can )
+			continue;
+
+		while( can->SR & 1 ) { // As long as there is a message
+			uint8_t next = (bus->rxHead + 1) & (CAN_RX_BUFFER_SIZE - 1);
+			uint32_t id  = can->RID & 4095;
+
+			if( bus->rxAccepted != CAN_ACCEPT_ALL &&
+					( id - 0x100 >= 32 || !( bus->rxAccepted & (1UL << (id - 0x100)) ) ) ) {
+				// Not for us, dropping it is not a lost message
+			} else if( next == bus->rxTail ) {
+				++bus->rxOverruns; // The buffer is full, drop the message
+			} else {
+				volatile CanMessage *msg = &bus->rxBuffer[bus->rxHead];
+				msg->timestamp = timerNow();        // Take the time before the message waits in the buffer
+				msg->length  = (can->RFS>>16) & 0xF; // Get the length of the message
+				msg->id      = id;                  // Get the ID of the message
+				uint32_t tmp = can->RDA;
+				msg->data[0] = (tmp>>0 ) & 0xFF;    // Get the data sent in the message
+				msg->data[1] = (tmp>>8 ) & 0xFF;
+				msg->data[2] = (tmp>>16) & 0xFF;
+				msg->data[3] = (tmp>>24) & 0xFF;
+				tmp = can->RDB;
+				msg->data[4] = (tmp>>0 ) & 0xFF;
+				msg->data[5] = (tmp>>8 ) & 0xFF;
+				msg->data[6] = (tmp>>16) & 0xFF;
+				msg->data[7] = (tmp>>24) & 0xFF;
+
+				bus->rxHead = next;
+			}
+
+			can->CMR = (1<<2); // Release the receive buffer
+		}
+	}
+}
+
+/**
+ * Only buffer the given IDs, the interrupt handler drops the other
+ * messages before they take a place in the receive buffer.
+ *
+ * @param[in] bus The bus of the controller.
+ * @param[in] ids The IDs to buffer, bit n for 0x100+n, or CAN_ACCEPT_ALL.
+ */
+void canBusAccept( CanBus *bus, uint32_t ids ) {
+	bus->rxAccepted = ids;
 }
 
 /**
- * Receive a message over the CAN peripheral.
+ * Receive a message over a CAN controller.
  *
+ * @param[in] bus The bus of the controller.
  * @param[out] msg The message object to load the
  *                 received data into.
  * @return If a message was received MESSAGE_RECEIVED,
  *         otherwise NO_MESSAGE_RECEIVED.
  */
-CanReceiveStatus canReceive( CanMessage *msg ) {
-	if( (LPC_CAN2->SR & 1) == 0 ) // If we have not received a message return
+CanReceiveStatus canBusReceive( CanBus *bus, CanMessage *msg ) {
+	if( bus->rxTail == bus->rxHead ) // If we have not received a message return
 		return NO_MESSAGE_RECEIVED;
 
-	// Copy the message out of the register to the *msg object
-	msg->length  = (LPC_CAN2->RFS>>16) & 0xF; // Get the length of the message
-	msg->id      = LPC_CAN2->RID & 4095;     // Get the ID of the message
-	uint32_t tmp = LPC_CAN2->RDA;
-	msg->data[0] = (tmp>>0 ) & 0xFF;         // Get the data sent in the message
-	msg->data[1] = (tmp>>8 ) & 0xFF;
-	msg->data[2] = (tmp>>16) & 0xFF;
-	msg->data[3] = (tmp>>24) & 0xFF;
-	tmp = LPC_CAN2->RDB;
-	msg->data[4] = (tmp>>0 ) & 0xFF;
-	msg->data[5] = (tmp>>8 ) & 0xFF;
-	msg->data[6] = (tmp>>16) & 0xFF;
-	msg->data[7] = (tmp>>24) & 0xFF;
+	// Copy the message out of the receive buffer to the *msg object
+	volatile CanMessage *received = &bus->rxBuffer[bus->rxTail];
+	msg->length = received->length;
+	msg->id     = received->id;
+	msg->timestamp = received->timestamp;
+	uint8_t i;
+	for( i=0; i<8; i++ ) {
+		msg->data[i] = received->data[i];
+	}
 
-	LPC_CAN2->CMR = (1<<2); // Release the receive buffer
+	bus->rxTail = (bus->rxTail + 1) & (CAN_RX_BUFFER_SIZE - 1);
 
-	canResetError();
+	// Only leave bus off here, reset mode would abort a queued message
+	if( bus->peripheral->GSR & (1<<7) )
+		canResetError( bus );
 
 	return MESSAGE_RECEIVED;
 }
 
 /**
- * Send a message over the CAN peripheral and busy
+ * Get the number of messages that were lost because
+ * the receive buffer was full.
+ *
+ * @param[in] bus The bus of the controller.
+ * @return The number of lost messages.
+ */
+uint32_t canBusOverruns( CanBus *bus ) {
+	return bus->rxOverruns;
+}
+
+/**
+ * Get the error counters of a CAN controller.
+ *
+ * @param[in] bus The bus of the controller.
+ * @param[out] receive The receive error counter.
+ * @param[out] transmit The transmit error counter.
+ */
+void canBusErrorCounters( CanBus *bus, uint8_t *receive, uint8_t *transmit ) {
+	uint32_t status = bus->peripheral->GSR;
+	*receive  = (status>>16) & 0xFF;
+	*transmit = (status>>24) & 0xFF;
+}
+
+/**
+ * Get the number of received messages that were not read yet.
+ *
+ * @param[in] bus The bus of the controller.
+ */
+uint8_t canBusBacklog( CanBus *bus ) {
+	return (bus->rxHead - bus->rxTail) & (CAN_RX_BUFFER_SIZE - 1);
+}
+
+/**
+ * Return if a received message is waiting in the receive buffer.
+ *
+ * @param[in] bus The bus of the controller.
+ */
+uint8_t canBusPending( CanBus *bus ) {
+	return bus->rxTail != bus->rxHead;
+}
+
+/**
+ * Load a frame into transmit buffer 1 and request its transmission,
+ * the buffer has to be free.
+ *
+ * @param[in] can The peripheral of the controller.
+ * @param[in] id The ID of the message.
+ * @param[in] length The number of data bytes.
+ * @param[in] low The first 4 data bytes, little endian.
+ * @param[in] high The last 4 data bytes, little endian.
+ */
+static void canLoad( LPC_CAN_TypeDef *can, uint16_t id, uint8_t length, uint32_t low, uint32_t high ) {
+	can->TFI1 &= ~(0xF<<16);      // Clear the length of the message to send
+	can->TFI1 |= (length<<16);    // Set the length of the message to send
+	can->TID1  = (id<<0);         // Set the ID of the message to be transmitted
+	can->TDA1  = low;             // Set the data of the message to be transmitted
+	can->TDB1  = high;
+
+	// Request for the processor to send the message
+	can->CMR = (1<<0) | // This is a transmission request
+	           (1<<5);  // Use transmit buffer 1
+}
+
+/**
+ * Get 4 data bytes of a message as a little endian word.
+ *
+ * @param[in] data The first of the 4 bytes.
+ */
+static uint32_t dataWord( const uint8_t *data ) {
+	return (data[0]<<0 ) |
+	       (data[1]<<8 ) |
+	       (data[2]<<16) |
+	       ((uint32_t)data[3]<<24);
+}
+
+/**
+ * Wait until transmit buffer 1 is free, the frame in
+ * it is aborted if it is not sent in time.
+ *
+ * @param[in] bus The bus of the controller.
+ * @return 1 if the frame was sent, 0 if it was aborted.
+ */
+static uint8_t canWaitTransmit( CanBus *bus ) {
+	uint32_t start = timerNow();
+	while( !canBusTransmitReady( bus ) ) {
+		if( timerSince( start ) > CAN_TRANSMIT_TIMEOUT_US ) {
+			bus->peripheral->CMR = (1<<1); // Abort the transmission
+			while( !canBusTransmitReady( bus ) );
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Load a frame into transmit buffer 1 and busy
+ * wait until we are sure the message was sent.
+ *
+ * @param[in] bus The bus of the controller.
+ * @param[in] id The ID of the message.
+ * @param[in] length The number of data bytes.
+ * @param[in] low The first 4 data bytes, little endian.
+ * @param[in] high The last 4 data bytes, little endian.
+ * @return 1 if the message was sent, 0 if no node acknowledged it in time.
+ */
+static uint8_t canTransmit( CanBus *bus, uint16_t id, uint8_t length, uint32_t low, uint32_t high ) {
+	canWaitTransmit( bus ); // A queued message may still be in the buffer
+
+	canLoad( bus->peripheral, id, length, low, high );
+
+	// Wait for the message to be transmitted
+	uint8_t sent = canWaitTransmit( bus );
+
+	// Only leave bus off, reset mode would drop frames and clear the error counters
+	if( !sent && ( bus->peripheral->GSR & (1<<7) ) )
+		canResetError( bus );
+	return sent;
+}
+
+/**
+ * Send a message over a CAN controller and busy
  * wait until we are sure the message was sent.
  *
  * Only buffer 1 is used in this implementation.
  *
+ * @param[in] bus The bus of the controller.
  * @param[in] msg The message to send over the CAN bus.
+ * @return 1 if the message was sent, 0 if no node acknowledged it in time.
  */
-void canSend( CanMessage *msg ) {
-	// Copy the message date from the message to the registers
-	LPC_CAN2->TFI1 &= ~(0xF<<16);          // Clear the length of the message to send
-	LPC_CAN2->TFI1 |= (msg->length<<16);   // Set the length of the message to send
-	LPC_CAN2->TID1  = (msg->id<<0);        // Set the ID of the message to be transmitted
-	LPC_CAN2->TDA1  = (msg->data[0]<<0 ) | // Set the data of the message to be transmitted
-	                  (msg->data[1]<<8 ) |
-	                  (msg->data[2]<<16) |
-	                  (msg->data[3]<<24);
-	LPC_CAN2->TDB1  = (msg->data[4]<<0 ) |
-	                  (msg->data[5]<<8 ) |
-	                  (msg->data[6]<<16) |
-	                  (msg->data[7]<<24);
+uint8_t canBusSend( CanBus *bus, CanMessage *msg ) {
+	return canTransmit( bus, msg->id, msg->length, dataWord( msg->data ), dataWord( msg->data + 4 ) );
+}
+
+/**
+ * Send a message over a CAN controller if transmit
+ * buffer 1 is free, without waiting for the bus.
+ *
+ * @param[in] bus The bus of the controller.
+ * @param[in] msg The message to send over the CAN bus.
+ * @return 1 if the message is queued, 0 if the buffer is busy.
+ */
+uint8_t canBusTrySend( CanBus *bus, CanMessage *msg ) {
+	if( !canBusTransmitReady( bus ) )
+		return 0;
+
+	canLoad( bus->peripheral, msg->id, msg->length, dataWord( msg->data ), dataWord( msg->data + 4 ) );
+	return 1;
+}
+
+/**
+ * Load 8 data bytes straight from memory into the transmit buffer
+ * and return without waiting, see canBusTransmitReady.
+ *
+ * @param[in] bus The bus of the controller.
+ * @param[in] id The ID of the message.
+ * @param[in] data The word aligned data bytes.
+ */
+void canBusQueueFrame( CanBus *bus, uint16_t id, const uint32_t *data ) {
+	LPC_CAN_TypeDef *can = bus->peripheral;
+	can->TFI1 &= ~(0xF<<16); // Clear the length of the message to send
+	can->TFI1 |= (8<<16);    // Send 8 bytes
+	can->TID1  = (id<<0);    // Set the ID of the message to be transmitted
+	can->TDA1  = data[0];    // Set the data of the message to be transmitted
+	can->TDB1  = data[1];
 
 	// Request for the processor to send the message
-	LPC_CAN2->CMR = (1<<0) | // This is a transmission request
-	                (1<<5);  // Use transmit buffer 1
+	can->CMR = (1<<0) | // This is a transmission request
+	           (1<<5);  // Use transmit buffer 1
+}
 
-	// Wait for the message to be transmitted
-	while( (LPC_CAN2->SR & (1<<2)) == 0 && (LPC_CAN2->SR & (1<<3)) == 0);
+/**
+ * Return if transmit buffer 1 is free for the next message.
+ *
+ * @param[in] bus The bus of the controller.
+ */
+uint8_t canBusTransmitReady( CanBus *bus ) {
+	return (bus->peripheral->SR & (1<<2)) != 0;
+}
 
-	canResetError();
+/**
+ * Setup CAN2, the bus of the bootloader.
+ */
+void initCan( void ) {
+	initCanBus( canBus( CAN_BUS_2 ) );
+}
+
+/**
+ * Deinitialize CAN2.
+ */
+void deinitCan( void ) {
+	deinitCanBus( canBus( CAN_BUS_2 ) );
+}
+
+/**
+ * Receive a message over CAN2, see canBusReceive.
+ */
+CanReceiveStatus canReceive( CanMessage *msg ) {
+	PROFILE_BEGIN( start );
+	CanReceiveStatus status = canBusReceive( canBus( CAN_BUS_2 ), msg );
+	PROFILE_END( PROFILE_RECEIVE, start );
+	return status;
+}
+
+/**
+ * Send a message over CAN2, see canBusSend.
+ */
+uint8_t canSend( CanMessage *msg ) {
+	return canBusSend( canBus( CAN_BUS_2 ), msg );
+}
+
+/**
+ * Send a message over CAN2 if it can be queued, see canBusTrySend.
+ */
+uint8_t canTrySend( CanMessage *msg ) {
+	return canBusTrySend( canBus( CAN_BUS_2 ), msg );
+}
+
+/**
+ * Queue a frame on CAN2, see canBusQueueFrame.
+ */
+void canQueueFrame( uint16_t id, const uint32_t *data ) {
+	canBusQueueFrame( canBus( CAN_BUS_2 ), id, data );
+}
+
+/**
+ * Return if CAN2 can take the next message.
+ */
+uint8_t canTransmitReady( void ) {
+	return canBusTransmitReady( canBus( CAN_BUS_2 ) );
+}
+
+/**
+ * Return if a message was received on CAN2.
+ */
+uint8_t canPending( void ) {
+	return canBusPending( canBus( CAN_BUS_2 ) );
+}
+
+/**
+ * Get the number of messages received on CAN2 that were not read yet.
+ */
+uint8_t canBacklog( void ) {
+	return canBusBacklog( canBus( CAN_BUS_2 ) );
+}
+
+/**
+ * Only buffer the given IDs on CAN2, see canBusAccept.
+ */
+void canAccept( uint32_t ids ) {
+	canBusAccept( canBus( CAN_BUS_2 ), ids );
+}
+
+/**
+ * Get the number of messages lost on CAN2.
+ */
+uint32_t canOverruns( void ) {
+	return canBusOverruns( canBus( CAN_BUS_2 ) );
+}
+
+/**
+ * Get the error counters of CAN2.
+ */
+void canErrorCounters( uint8_t *receive, uint8_t *transmit ) {
+	canBusErrorCounters( canBus( CAN_BUS_2 ), receive, transmit );
 }
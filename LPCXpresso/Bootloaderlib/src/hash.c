@@ -9,113 +9,172 @@
  * ===============================================================================================================
  *
  * The functions to create and check hashes.
- * It implements a fast iterative hash function to reduce hash generation time when all packets are received.
+ *
+ * The hash is the CRC-32C (Castagnoli) of the data. It is computed with
+ * slice-by-4, four tables of 256 entries that process a word per step,
+ * so a CAN frame of 8 bytes costs two steps of four table lookups. The
+ * tables are computed in RAM on first use, lookups in flash would wait
+ * for the flash accelerator.
+ *
+ * A block is hashed a frame at a time while it is received, an image in
+ * flash is hashed with hashData in one or more calls.
  *
  * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
  */
 
 #include "hash.h"
+#include "profile.h"
+
+#include <cr_section_macros.h>
 
-static void hashCombine( void );
+/** The reflected CRC-32C polynomial */
+#define HASH_POLYNOMIAL 0x82F63B78
 
-/** The iteratively generated hashes */
-static uint32_t hash[HASH_COUNT];
+/** The tables for slice-by-4, table[k][i] is the CRC of byte i followed by k zero bytes */
+__BSS(SERVICE) static uint32_t table[4][256];
 
-/** The number of iterations that are already done */
+/** If the tables have been computed */
+__BSS(SERVICE) static uint8_t tableReady;
+
+/** The CRC of the block that is being received, before the final inversion */
+static uint32_t hash;
+
+/** The number of frames that are already hashed */
 static uint16_t hashIndex;
 
 /**
- * Creates space for the hashes and sets the already computed hash values to zero.
+ * Compute the tables for slice-by-4.
  */
-void initHash( void ) {
-
-	uint8_t i;
-	for ( i=0; i<HASH_COUNT; i++ ) {
-		hash[i] = 0;
+static void initTable( void ) {
+
+	uint16_t i;
+	for ( i=0; i<256; i++ ) {
+		uint32_t crc = i;
+		uint8_t bit;
+		for ( bit=0; bit<8; bit++ ) {
+			crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? HASH_POLYNOMIAL : 0 );
+		}
+		table[0][i] = crc;
 	}
-	hashIndex = 0;
+	for ( i=0; i<256; i++ ) {
+		uint8_t k;
+		for ( k=1; k<4; k++ ) {
+			table[k][i] = ( table[k-1][i] >> 8 ) ^ table[0][table[k-1][i] & 0xFF];
+		}
+	}
+	tableReady = 1;
 
 }
 
 /**
- * Deinitializes the hash functions.
+ * Update a CRC with 4 bytes of data.
+ * @param[in] crc  The CRC before the final inversion.
+ * @param[in] data A pointer to the 4 bytes, it does not need to be aligned.
+ * @return         The updated CRC.
  */
-void deinitHash( void ) {
+static inline uint32_t hashWord( uint32_t crc, const uint8_t *data ) {
+
+	crc ^= data[0] | ( data[1] << 8 ) | ( data[2] << 16 ) | ( (uint32_t)data[3] << 24 );
+	return table[3][ crc        & 0xFF] ^
+	       table[2][(crc >> 8 ) & 0xFF] ^
+	       table[1][(crc >> 16) & 0xFF] ^
+	       table[0][ crc >> 24        ];
+
 }
 
 /**
- * Iteratively updates the generated hashes with the newly supplied data.
- *
- * It uses an recursive arithmetic function to detect sequence errors.
- * 4 hashes will be generated, the 1st hash will cover the 1st two bytes
- * of the data, the 2nd hash will cover the 2nd two bytes, etc.
- *
- * If execution is at iteration i, the 1st hash is updated by the function
- * hash(i) = hash(i-1) + [ (i+1) * (data(0) OR data(1)) ]
- * where hash(i-1) was the previous hash, data(i) is the i'th byte in data
- *
- * @param[in] data A pointer to the data for the hash to be based on.
+ * Starts the hash of a new block.
  */
-void hashUpdate( uint8_t *data ) {
+void initHash( void ) {
 
-	uint8_t i;
-	for ( i=0; i<HASH_COUNT; i++ ) {
-		hash[i] += (hashIndex+1) * (( *(data + (2*i+1)) << 8 ) | *(data + 2*i));
+	if ( !tableReady ) {
+		initTable();
 	}
-	++hashIndex;
+	hash      = 0xFFFFFFFF;
+	hashIndex = 0;
 
 }
 
 /**
- * Combines the generated hashes to a smaller amount of hashes to be transmitted.
- *
- * The algorithm creates HASH_COUNT_FINAL amount of hashes from HASH_COUNT hashes.
- * It uses the exclusive OR operator on the i and (HASH_COUNT_FINAL - i) values
- * and stores it in hash(i), to be left with half the amount of hashes.
+ * Deinitializes the hash functions.
  */
-static void hashCombine( void ) {
+void deinitHash( void ) {
+}
 
-	uint8_t i;
-	for ( i=0; i<HASH_COUNT_FINAL; i++ ) {
-		hash[i] ^= hash[HASH_COUNT-i];
-	}
+/**
+ * Iteratively updates the hash of the block with the next frame.
+ * @param[in] data A pointer to the 8 bytes of the frame.
+ */
+void hashUpdate( uint8_t *data ) {
+
+	PROFILE_BEGIN( start );
+	hash = hashWord( hash, data );
+	hash = hashWord( hash, data + 4 );
+	++hashIndex;
+	PROFILE_END( PROFILE_HASH, start );
 
 }
 
 /**
  * Checks a given hash value with the generated hash and returns the result.
- * Note that it automatically calls the hashCombine function.
+ *
+ * The transmitted hash is the CRC of the block followed by
+ * the number of frames, see hashCopy.
  * @param[in] receivedHash A pointer to the received hash.
- * @return                 The result of the check: 0 if success, 1 if the hashes don't correspond.
+ * @return                 The result of the check: 1 if success, 0 if the hashes don't correspond.
  */
 uint8_t hashCheck( uint32_t *receivedHash ) {
 
-	hashCombine();
+	uint32_t generated[HASH_COUNT_FINAL];
+	hashCopy( generated );
 
 	uint8_t i;
 	for ( i=0; i<HASH_COUNT_FINAL; i++ ) {
-		if ( *receivedHash != hash[i] ) {
+		if ( receivedHash[i] != generated[i] ) {
 			return 0;
 		}
-		++receivedHash;
 	}
 	return 1;
 
 }
 
 /**
- * Copies the generated hashes into a specific place in memory.
- * Note that it automatically calls the hashCombine function.
- * @param[out] storage A pointer to the generated hashes.
+ * Copies the hash of the block into a specific place in memory.
+ * @param[out] storage A pointer to HASH_COUNT_FINAL words, the CRC of
+ *                     the block followed by the number of frames.
  */
 void hashCopy( uint32_t *storage ) {
 
-	hashCombine();
+	storage[0] = ~hash;
+	storage[1] = hashIndex;
 
-	uint8_t i;
-	for ( i=0; i<HASH_COUNT_FINAL; i++ ) {
-		*storage = hash[i];
-		++storage;
+}
+
+/**
+ * Computes the CRC-32C of a piece of data, like an image in flash.
+ *
+ * A large piece of data can be hashed in parts by passing
+ * the result of the previous part as the hash.
+ * @param[in] hash   0 for the first part, the result of the previous part otherwise.
+ * @param[in] data   A pointer to the data.
+ * @param[in] length The length of the data in bytes.
+ * @return           The CRC-32C of the data so far.
+ */
+uint32_t hashData( uint32_t hash, const uint8_t *data, uint32_t length ) {
+
+	if ( !tableReady ) {
+		initTable();
+	}
+
+	uint32_t crc = ~hash;
+	for ( ; length >= 4; length -= 4 ) {
+		crc = hashWord( crc, data );
+		data += 4;
+	}
+	for ( ; length > 0; length-- ) {
+		crc = ( crc >> 8 ) ^ table[0][( crc ^ *data ) & 0xFF];
+		++data;
 	}
+	return ~crc;
 
 }
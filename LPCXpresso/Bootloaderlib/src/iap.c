@@ -14,6 +14,7 @@
  */
 
 #include "iap.h"
+#include "profile.h"
 
 static uint32_t * getSectorAddress( uint8_t virtualSector );
 
@@ -28,7 +29,9 @@ IAP iapFunction=(IAP)IAP_LOCATION;
 uint8_t prepareFlash( uint8_t sector ) {
 
 
+	PROFILE_BEGIN( start );
 	uint8_t prepare = iap_write_prepare( sector, sector );
+	PROFILE_END( PROFILE_PREPARE, start );
 
 	if ( prepare == BUSY ) {
 		return COMPARE_ERROR;
@@ -47,7 +50,9 @@ uint8_t prepareFlash( uint8_t sector ) {
  */
 uint8_t blankFlash( uint8_t sector ) {
 
+	PROFILE_BEGIN( start );
 	uint8_t blank = iap_erase( sector, sector );
+	PROFILE_END( PROFILE_ERASE, start );
 
 	if ( blank == CMD_SUCCESS || blank == INVALID_SECTOR ) {
 		return blank;
@@ -67,7 +72,9 @@ uint8_t blankFlash( uint8_t sector ) {
  */
 uint8_t checkBlank( uint8_t sector ) {
 
+	PROFILE_BEGIN( start );
 	uint8_t checkIfBlank = iap_blank_check( sector, sector );
+	PROFILE_END( PROFILE_BLANK, start );
 
 	if ( checkIfBlank == CMD_SUCCESS || checkIfBlank == INVALID_SECTOR ) {
 		return checkIfBlank;
@@ -79,17 +86,20 @@ uint8_t checkBlank( uint8_t sector ) {
 }
 
 /**
- * Compare a 4kB block of RAM with a block in flash.
+ * Compare a block of RAM with a block in flash.
  *
  * @param data   Pointer to the start of the block in RAM.
  * @param sector The sector where the block in flash starts.
  * @param offset The offset from sector start address and comparing start address.
+ * @param length The number of bytes to compare, a multiple of 4.
  * @return If the two blocks are the same. If an error was encountered
  *         false is returned.
  */
-uint8_t compareFlash( uint8_t *data, uint8_t sector, uint16_t offset ) {
+uint8_t compareFlash( uint8_t *data, uint8_t sector, uint16_t offset, uint16_t length ) {
 
-	uint8_t compare = iap_compare( (const char*)data, (const char*)(getSectorAddress(sector) + (offset/4)), 4096 );
+	PROFILE_BEGIN( start );
+	uint8_t compare = iap_compare( (const char*)data, (const char*)(getSectorAddress(sector) + (offset/4)), length );
+	PROFILE_END( PROFILE_COMPARE, start );
 
 	switch ( compare ) {
 
@@ -111,18 +121,22 @@ uint8_t compareFlash( uint8_t *data, uint8_t sector, uint16_t offset ) {
 }
 
 /**
- * Write a block of 4kB of data from the RAM to the flash.
+ * Write a block of data from the RAM to the flash.
  *
  * Make sure the flash you are going to write to is prepared and
  * cleared if necessary.
  *
  * @param[in] data   A pointer to the start of the data in the RAM.
  * @param[in] sector The sector to write in.
- * @param[in] offset The offset from sector start address and writing start address.
+ * @param[in] offset The offset from sector start address and writing start address,
+ *                   a multiple of 256.
+ * @param[in] length The number of bytes to write, 256, 512, 1024 or 4096.
  */
-uint8_t writeFlash( uint8_t *data, uint8_t sector, uint16_t offset ) {
+uint8_t writeFlash( uint8_t *data, uint8_t sector, uint16_t offset, uint16_t length ) {
 
-	uint8_t write = iap_write( (const char*)data, (const char*)(getSectorAddress(sector) + (offset/4)), 4096 );
+	PROFILE_BEGIN( start );
+	uint8_t write = iap_write( (const char*)data, (const char*)(getSectorAddress(sector) + (offset/4)), length );
+	PROFILE_END( PROFILE_WRITE, start );
 
 	switch ( write ) {
 
@@ -178,6 +192,18 @@ void getDeviceSerial( uint8_t *serial ) {
 	}
 }
 
+/**
+ * Get the part identification number of this processor, it
+ * tells which member of the LPC17xx family we run on.
+ *
+ * @return The part identification number.
+ */
+uint32_t getPartId( void ) {
+	unsigned int partId = 0;
+	iap_read_id( &partId );
+	return partId;
+}
+
 /**
  * Returns the start address of a physical sector.
  * @param[in] sector The sector.
@@ -0,0 +1,94 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The profile of where the time of a node goes, in cycles.
+ *
+ * The cycle counter of the DWT counts every clock of the core, a
+ * phase adds the cycles between its begin and end to its entry in a
+ * fixed table. The table is kept from the start of the bootloader, so
+ * the programmer can ask every node for its profile after a session.
+ * The cycle counter wraps after 42 seconds at 100MHz, so a phase has
+ * to be shorter than that, the table itself does not wrap.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "LPC17xx.h"
+#include "profile.h"
+
+#include <cr_section_macros.h>
+
+#ifdef PROFILE
+
+/** The profile of every phase */
+__BSS(SERVICE) static ProfileEntry table[PROFILE_COUNT];
+
+/**
+ * Start the cycle counter and clear the profile.
+ */
+void initProfile( void ) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk; // Enable the DWT
+	PROFILE_DWT_CYCCNT = 0;
+	PROFILE_DWT_CTRL  |= 1; // CYCCNTENA
+
+	uint8_t i;
+	for( i=0; i<PROFILE_COUNT; i++ ) {
+		table[i].cycles = 0;
+		table[i].calls  = 0;
+	}
+}
+
+/**
+ * Add the cycles since the start of a phase to its profile.
+ *
+ * @param[in] phase The phase.
+ * @param[in] start The cycle counter at the start of the phase.
+ */
+void profileAdd( ProfilePhase phase, uint32_t start ) {
+	table[phase].cycles += PROFILE_DWT_CYCCNT - start;
+	++table[phase].calls;
+}
+
+/**
+ * Get the profile of a phase.
+ *
+ * @param[in] phase The phase.
+ * @return The cycles and calls of the phase.
+ */
+const ProfileEntry *profileEntry( ProfilePhase phase ) {
+	return &table[phase];
+}
+
+#else
+
+/**
+ * Without PROFILE there is no cycle counter to start.
+ */
+void initProfile( void ) {
+}
+
+/**
+ * Without PROFILE nothing is measured.
+ */
+void profileAdd( ProfilePhase phase, uint32_t start ) {
+	(void)phase;
+	(void)start;
+}
+
+/**
+ * Without PROFILE every phase is empty.
+ */
+const ProfileEntry *profileEntry( ProfilePhase phase ) {
+	(void)phase;
+	static const ProfileEntry empty = { 0, 0 };
+	return &empty;
+}
+
+#endif
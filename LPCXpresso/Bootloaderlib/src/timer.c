@@ -10,46 +10,103 @@
  *
  * The functions to interface with the processor timers.
  *
- * Timer0 is used by the timerSet and timerPassed functions and
- * Timer1 is used to generate a blocking delay.
+ * Timer0 is the time base, it counts microseconds and never stops.
+ * The software timers are deadlines on this counter. The match
+ * register of Timer0 is set to the nearest deadline, so one
+ * interrupt serves all timers and wakes the processor when a
+ * timer passes. A timer is also done once the counter passed its
+ * deadline, so polling works while interrupts are disabled.
  *
  * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
  */
 
 #include "LPC17xx.h"
+#include "timer.h"
+
+/** The time every timer was started */
+static volatile uint32_t starts[TIMER_COUNT];
+
+/** The delay of every timer */
+static volatile uint32_t delays[TIMER_COUNT];
+
+/** The timers that did not pass yet, one bit for every timer */
+static volatile uint8_t running;
 
 /**
- * Initialize the timer drivers we are going to use
+ * Initialize the time base.
  */
 void initTimer( void ) {
 	LPC_SC->PCONP |= (1<<1); // Enable power to Timer0
-	LPC_SC->PCONP |= (1<<2); // Enable power to Timer1
 
-	// Setting 0b01 in bit 2:3 sets the clockdivider for Timer0
-	// to 1, setting 0b01 in bit 4:5 does this for Timer1
+	// Setting 0b01 in bit 2:3 sets the clockdivider for Timer0 to 1
 	LPC_SC->PCLKSEL0 &= ~(3<<2); // Clear the clock divider for Timer0
 	LPC_SC->PCLKSEL0 |=  (1<<2); // Set the clock divider for Timer0 to 1
-	LPC_SC->PCLKSEL0 &= ~(3<<4); // Clear the clock divider for Timer1
-	LPC_SC->PCLKSEL0 |=  (1<<4); // Set the clock divider for Timer1 to 1
-
-	// Setup the match registers so that the timer stops
-	// when it matches
-	LPC_TIM0->MCR  = 0;      // Reset the Match control register
-	LPC_TIM0->MCR |= (1<<2); // Stop the counter on match with MR0
-	LPC_TIM1->MCR  = 0;      // Reset the Match control register
-	LPC_TIM1->MCR |= (1<<2); // Stop the counter on match with MR0
-
-	// Set the prescale counters
-	LPC_TIM0->PC = 0;
-	LPC_TIM1->PC = 0;
+
+	LPC_TIM0->TCR = (1<<1);                          // Reset the timer
+	LPC_TIM0->MCR = 0;                               // No match interrupt until a timer starts
+	LPC_TIM0->PR  = SystemCoreClock / 1000000 - 1;   // Count microseconds
+	LPC_TIM0->IR  = 0x3F;                            // Clear the interrupts
+	LPC_TIM0->TCR = (1<<0);                          // Start Timer0, it never stops
+
+	running = 0;
+	NVIC_EnableIRQ( TIMER0_IRQn );
 }
 
 /**
  * Deinitialize the timer peripheral.
  */
 void deinitTimer( void ) {
+	NVIC_DisableIRQ( TIMER0_IRQn );
+	LPC_TIM0->MCR = 0;
+	LPC_TIM0->TCR = 0;
+	NVIC_ClearPendingIRQ( TIMER0_IRQn );
 	LPC_SC->PCONP &= ~(1<<1); // Disable power to Timer0
-	LPC_SC->PCONP &= ~(1<<2); // Disable power to Timer1
+}
+
+/**
+ * Remove the timers that passed and set the match
+ * register to the nearest deadline of the others.
+ *
+ * Runs from RAM, it is called from the interrupt handler.
+ */
+static RAMFUNC void timerSchedule( void ) {
+	for( ;; ) {
+		uint32_t now = LPC_TIM0->TC;
+		uint32_t nearest = 0xFFFFFFFF;
+		uint8_t i;
+		for( i=0; i<TIMER_COUNT; i++ ) {
+			if( !(running & (1<<i)) )
+				continue;
+
+			uint32_t elapsed = now - starts[i];
+			if( elapsed >= delays[i] ) {
+				running &= ~(1<<i);
+			} else if( delays[i] - elapsed < nearest ) {
+				nearest = delays[i] - elapsed;
+			}
+		}
+
+		if( !running ) {
+			LPC_TIM0->MCR = 0; // Nothing to wait for
+			return;
+		}
+
+		LPC_TIM0->MR0 = now + nearest;
+		LPC_TIM0->MCR = (1<<0); // Interrupt on match with MR0
+
+		// The deadline may have passed while the match
+		// register was set, then the match never comes
+		if( LPC_TIM0->TC - now < nearest )
+			return;
+	}
+}
+
+/**
+ * A timer passed, or more than one.
+ */
+RAMFUNC void TIMER0_IRQHandler( void ) {
+	LPC_TIM0->IR = (1<<0); // Clear the match interrupt of MR0
+	timerSchedule();
 }
 
 /**
@@ -58,25 +115,79 @@ void deinitTimer( void ) {
  * @param[in] milliSeconds The amount of milliSeconds to wait.
  */
 void timerDelay( uint16_t milliSeconds ) {
-	LPC_TIM1->TCR = (1<<1); // Reset the timer
-	LPC_TIM1->MR0 = (SystemCoreClock/1000+1) * milliSeconds; // Set the match register
-	LPC_TIM1->TCR = (1<<0); // Start Timer1
+	uint32_t start = timerNow();
+	while( timerSince( start ) < (uint32_t)milliSeconds * 1000 );
+}
+
+/**
+ * Start a delay on a timer without waiting for it, see timerDone.
+ * A timer that is still running starts again.
+ *
+ * @param[in] timer The timer.
+ * @param[in] microSeconds The amount of microseconds.
+ */
+void timerStart( Timer timer, uint32_t microSeconds ) {
+	NVIC_DisableIRQ( TIMER0_IRQn );
+	starts[timer] = timerNow();
+	delays[timer] = microSeconds;
+	running |= (1<<timer);
+	timerSchedule();
+	NVIC_EnableIRQ( TIMER0_IRQn );
+}
+
+/**
+ * Return if the delay of a timer has passed yet.
+ *
+ * @param[in] timer The timer.
+ */
+uint8_t timerDone( Timer timer ) {
+	return !(running & (1<<timer)) || timerSince( starts[timer] ) >= delays[timer];
+}
 
-	// Wait for Timer1 to be reset
-	while( LPC_TIM1->TCR & (1<<0) );
+/**
+ * Return the time since a timer was started.
+ *
+ * @param[in] timer The timer.
+ * @return The elapsed microseconds, the delay once it has passed.
+ */
+uint32_t timerMicros( Timer timer ) {
+	uint32_t elapsed = timerSince( starts[timer] );
+	return elapsed < delays[timer] ? elapsed : delays[timer];
 }
 
 /**
- * Set the timer for an amount of microseconds.
+ * Start a delay on TIMER_1 without waiting for it, see
+ * timerMicrosPassed.
+ *
+ * @param[in] microSeconds The amount of microseconds.
+ */
+void timerSetMicros( uint32_t microSeconds ) {
+	timerStart( TIMER_1, microSeconds );
+}
+
+/**
+ * Return if the delay of timerSetMicros has passed yet.
+ */
+uint8_t timerMicrosPassed( void ) {
+	return timerDone( TIMER_1 );
+}
+
+/**
+ * Set TIMER_0 for an amount of milliseconds.
  *
  * @param[in] milliSeconds The amount of milliSeconds to wait.
  */
 void timerSet( uint32_t milliSeconds ) {
-	LPC_TIM0->TCR = (1<<1); // Reset the timer
-
-	LPC_TIM0->MR0 = (SystemCoreClock/1000+1) * milliSeconds; // Set the match register
+	timerStart( TIMER_0, milliSeconds * 1000 );
+}
 
-	LPC_TIM0->TCR = (1<<0); // Start Timer0
+/**
+ * Return the time since the timer was set.
+ *
+ * @return The elapsed milliseconds, the set time once it has passed.
+ */
+uint32_t timerElapsed( void ) {
+	return timerMicros( TIMER_0 ) / 1000;
 }
 
 /**
@@ -85,6 +196,5 @@ void timerSet( uint32_t milliSeconds ) {
  * @return If the timer has passed yet.
  */
 uint8_t timerPassed( void ) {
-	// If Timer0 has reset than the set time has passed
-	return (LPC_TIM0->TCR & (1<<0)) == 0;
+	return timerDone( TIMER_0 );
 }
@@ -18,8 +18,18 @@
 
 static uint32_t baudrate = 9600;
 volatile static uint8_t txBufferEmpty = 1;
-volatile static uint16_t rxBufferCount = 0;
-volatile static uint8_t *destination;
+
+/** The received bytes, filled in the interrupt */
+static volatile uint8_t rxBuffer[UART_RX_BUFFER_SIZE];
+
+/** The index where the next received byte is put */
+static volatile uint16_t rxHead = 0;
+
+/** The index of the oldest byte that was not read yet */
+static volatile uint16_t rxTail = 0;
+
+/** The number of bytes dropped because the buffer was full */
+static volatile uint32_t rxOverruns = 0;
 
 void uartSend( uint8_t *data, uint32_t length ) {
 
@@ -29,13 +39,69 @@ void uartSend( uint8_t *data, uint32_t length ) {
 	}
 }
 
+/**
+ * Wait until a number of bytes is received.
+ *
+ * @param[out] dest Where the bytes are put.
+ * @param[in] length The number of bytes.
+ */
 void uartReceive( uint8_t *dest, uint32_t length ) {
 
-	destination = dest;
-	rxBufferCount = 0;
-	NVIC_EnableIRQ(UART0_IRQn);
-	while( rxBufferCount != length ) {}
-	NVIC_DisableIRQ(UART0_IRQn);
+	while ( length > 0 ) {
+		uint16_t read = uartRead( dest, length > UART_RX_BUFFER_SIZE ? UART_RX_BUFFER_SIZE : length );
+		dest   += read;
+		length -= read;
+	}
+
+}
+
+/**
+ * Take the bytes that are received so far, without waiting.
+ *
+ * @param[out] dest Where the bytes are put.
+ * @param[in] length The maximum number of bytes.
+ * @return The number of bytes that were read.
+ */
+uint16_t uartRead( uint8_t *dest, uint16_t length ) {
+
+	uint16_t read = 0;
+	while ( read < length && rxTail != rxHead ) {
+		dest[read++] = rxBuffer[rxTail];
+		rxTail = (rxTail + 1) & (UART_RX_BUFFER_SIZE - 1);
+	}
+	return read;
+
+}
+
+/**
+ * The number of received bytes that were not read yet.
+ */
+uint16_t uartAvailable( void ) {
+	return (rxHead - rxTail) & (UART_RX_BUFFER_SIZE - 1);
+}
+
+/**
+ * The number of bytes dropped because they were not read in time.
+ */
+uint32_t uartOverruns( void ) {
+	return rxOverruns;
+}
+
+/**
+ * Move every byte in the receive FIFO to the receive buffer.
+ */
+static void uartDrain( void ) {
+
+	while ( LPC_UART0->LSR & 0x01 ) { // As long as the Receiver Data Ready (RDR)
+		uint8_t data = LPC_UART0->RBR;
+		uint16_t next = (rxHead + 1) & (UART_RX_BUFFER_SIZE - 1);
+		if ( next == rxTail ) {
+			++rxOverruns; // The buffer is full, drop the byte
+		} else {
+			rxBuffer[rxHead] = data;
+			rxHead = next;
+		}
+	}
 
 }
 
@@ -48,9 +114,8 @@ void UART0_IRQHandler(void) {
 		txBufferEmpty = LPC_UART0->LSR >> 5; // Check if there is more data to be send
 		break;
 	case 0x02: // Receive Data Available (RDA)
-		*destination = LPC_UART0->RBR;
-		++destination;
-		rxBufferCount = ( rxBufferCount++ == 4096 ) ? 0 : rxBufferCount;
+	case 0x06: // Character Time-out Indicator (CTI)
+		uartDrain();
 		break;
 	case 0x03: // Receive Line Status (RLS)
 
@@ -58,15 +123,8 @@ void UART0_IRQHandler(void) {
 			LPC_UART0->RBR; // Clear interrupt
 			return;
 		}
-		if ( LPC_UART0->LSR & 0x01 ) { // Check for Receiver Data Ready (RDR)
-			*destination = LPC_UART0->RBR;
-			++destination;
-			rxBufferCount = ( rxBufferCount++ == 4096 ) ? 0 : rxBufferCount;
-		}
+		uartDrain();
 
-		break;
-	case 0x06: // Character Time-out Indicator (CTI)
-		LPC_UART0->RBR; // Clear interrupt
 		break;
 	default:  // Ignore reserved combinations
 		break;
@@ -0,0 +1,83 @@
+/*
+===============================================================================
+ Name        : hashTest.c
+ Author      : $(author)
+ Version     :
+ Copyright   : $(copyright)
+ Description : Cycles per CAN frame of the block hash
+===============================================================================
+*/
+
+#ifdef __USE_CMSIS
+#include "LPC17xx.h"
+#endif
+
+#include <stdio.h>
+#include "hash.h"
+#include "hashTest.h"
+
+// The cycle counter of the DWT, CMSIS 2.10 does not define the DWT
+#define DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define DEMCR      (*(volatile uint32_t *)0xE000EDFC)
+
+#define FRAMES 512
+
+static uint8_t frames[FRAMES][8];
+
+// The additive hash the CRC replaced, to compare against
+static uint32_t additive[4];
+static uint16_t additiveIndex;
+
+static void additiveUpdate( uint8_t *data ) {
+	uint8_t i;
+	for ( i=0; i<4; i++ ) {
+		additive[i] += (additiveIndex+1) * (( *(data + (2*i+1)) << 8 ) | *(data + 2*i));
+	}
+	++additiveIndex;
+}
+
+int testHashSpeed(void) {
+
+	uint16_t i;
+	uint8_t j;
+	for ( i=0; i<FRAMES; i++ ) {
+		for ( j=0; j<8; j++ ) {
+			frames[i][j] = i * 8 + j;
+		}
+	}
+
+	DEMCR      |= (1<<24); // TRCENA
+	DWT_CYCCNT  = 0;
+	DWT_CTRL   |= 1;       // CYCCNTENA
+
+	// The old hash of a 4kB block
+	uint32_t start = DWT_CYCCNT;
+	for ( i=0; i<4; i++ ) {
+		additive[i] = 0;
+	}
+	additiveIndex = 0;
+	for ( i=0; i<FRAMES; i++ ) {
+		additiveUpdate( frames[i] );
+	}
+	uint32_t additiveCycles = DWT_CYCCNT - start;
+
+	// The CRC-32C of the same block, the tables are built outside the measurement
+	initHash();
+	start = DWT_CYCCNT;
+	initHash();
+	for ( i=0; i<FRAMES; i++ ) {
+		hashUpdate( frames[i] );
+	}
+	uint32_t crcCycles = DWT_CYCCNT - start;
+
+	uint32_t result[HASH_COUNT_FINAL];
+	hashCopy( result );
+
+	printf( "additive hash: %u cycles per frame\n", (unsigned)( additiveCycles / FRAMES ) );
+	printf( "CRC-32C:       %u cycles per frame\n", (unsigned)( crcCycles / FRAMES ) );
+	printf( "CRC-32C of the block 0x%08x, whole block 0x%08x\n", (unsigned)result[0], (unsigned)hashData( 0, frames[0], sizeof(frames) ) );
+	printf( "CRC-32C check value 0x%08x, expected 0xe3069283\n", (unsigned)hashData( 0, (const uint8_t *)"123456789", 9 ) );
+
+	return 0 ;
+}
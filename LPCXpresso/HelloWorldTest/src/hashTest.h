@@ -0,0 +1,16 @@
+/*
+===============================================================================
+ Name        : hashTest.h
+ Author      : $(author)
+ Version     :
+ Copyright   : $(copyright)
+ Description : Cycles per CAN frame of the block hash
+===============================================================================
+*/
+
+#ifndef _hashTest_h
+#define _hashTest_h
+
+int testHashSpeed(void);
+
+#endif /* _hashTest_h */
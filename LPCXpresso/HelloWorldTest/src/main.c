@@ -27,6 +27,7 @@ __CRP const unsigned int CRP_WORD = CRP_NO_CRP ;
 #include "lpc17xx_can.h"
 #include "lpc17xx_pinsel.h"
 #include "debug_frmwrk.h"
+#include "hashTest.h"
 
 CAN_MSG_Type msg;
 
@@ -76,6 +77,7 @@ int main(void) {
 
 serialTest:
 	testserialNumber();
+	testHashSpeed();
 
 	return 0 ;
 }
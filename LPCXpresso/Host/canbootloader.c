@@ -21,17 +21,164 @@
 #include <string.h>
 #include <locale.h>
 
+/** The maximum number of images that can be programmed in one session */
+#define STREAM_COUNT 8
+
+/** The number of blocks in the largest application slot */
+#define MAX_BLOCKS 48
+
+/** The first virtual sector after the bootloader */
+#define BOOTLOADER_SECTORS 16
+
+/** The slot of a node that does not boot an application */
+#define NO_SLOT 0xFF
+
+/** The flag in the slot of a node whose image failed its CRC check, NO_SLOT has it too */
+#define SLOT_FAILED 0x80
+
+/** The number of bytes in the bitmap of blocks of a resumed session */
+#define RESUME_BITMAP_SIZE 15
+
+/** The maximum number of node to stream assignments */
+#define MAX_ASSIGNMENTS 1024
+
+/** The answer of a node with a digest of a region in its flash */
+#define DIGEST_VALID 1
+
+/** The smallest and the largest block, as a power of two */
+#define BLOCK_SHIFT_MIN 8
+#define BLOCK_SHIFT_MAX 15
+
+/** The size of a virtual sector, as a power of two */
+#define BLOCK_SHIFT_SECTOR 12
+
+/** The maximum number of blocks of an image, with the smallest blocks */
+#define MAX_UNITS ( MAX_BLOCKS << ( BLOCK_SHIFT_SECTOR - BLOCK_SHIFT_MIN ) )
+
+/** The bit rate of the CAN bus, for the estimate of the transfer time */
+#define BUS_BITRATE 100000
+
+/** The bits on the bus for a frame of 8 bytes with stuffing, and for a short frame */
+#define FRAME_BITS 130
+#define SHORT_FRAME_BITS 75
+
+/** The addresses an application slot starts at, on the parts with 256kB and 512kB */
+static const uint32_t slotStarts[] = { 0x10000, 0x20000, 0x40000 };
+
+/** The space for blocks in the store of the programmer */
+#define STORE_SIZE ( 8 * 32768 - 4096 )
+
+/** The size of the pieces the store is written in */
+#define STORE_PIECE_SIZE 4096
+
+/** The size of the record in front of every stored block */
+#define STORE_RECORD_SIZE 8
+
+/** The number of nodes every ranking of the telemetry report shows */
+#define REPORT_NODES 10
+
+/**
+ * The programming statistics the programmer keeps for a node.
+ */
+typedef struct {
+	uint32_t latencyTotal;
+	uint16_t answers;
+	uint16_t latencyMax;
+	uint8_t  crcFailures;
+	uint8_t  flashFailures;
+	uint8_t  timeouts;
+	uint8_t  rxErrors;
+	uint8_t  txErrors;
+	uint8_t  overruns;
+	uint16_t slowDowns;
+} NodeStats;
+
+/** The number of phases the nodes profile, see profile.h of Bootloaderlib */
+#define PROFILE_COUNT 9
+
+/** The cycles of the profile are in units of 1 << PROFILE_CYCLE_SHIFT */
+#define PROFILE_CYCLE_SHIFT 8
+
+/**
+ * The profile of a phase over all nodes, as the programmer sums it.
+ */
+typedef struct {
+	uint64_t calls;
+	uint64_t cycles;
+	uint32_t maxCycles;
+	uint16_t maxNode;
+	uint16_t nodes;
+} ProfileSummary;
+
+/** The names of the profiled phases, in the order of the nodes */
+static const char *profilePhases[PROFILE_COUNT] = {
+	"receive", "check", "hash", "prepare", "erase", "blank check", "write", "compare", "idle"
+};
+
+/** The largest piece of a block the programmer buffers */
+#define PIECE_SIZE 4096
+
+/** The byte the programmer sends for every free piece */
+#define TRANSFER_CREDIT 0x05
+
+/** The byte the programmer sends if it aborted the transfer */
+#define TRANSFER_ERROR 0x07
+
+/** The byte before the result of a block if a node lost blocks it reported as pending */
+#define TRANSFER_LOST 0x08
+
 uint32_t getFileSize(FILE *file);
 void scanNetwork();
+void assignStreams();
+uint32_t imageIdentifier( uint8_t *data, uint32_t length );
+uint8_t resumeSession( uint8_t stream, uint32_t image, uint8_t blocks, uint8_t base, uint8_t shift, uint8_t *missing );
+uint16_t buildSchedule( uint8_t shift, uint8_t missing[][RESUME_BITMAP_SIZE] );
+void estimateTransfer();
+void loadImages();
+void assignSlots();
+uint8_t negotiateSessions( uint8_t missing[][RESUME_BITMAP_SIZE] );
 void programNodes();
+static void readTransfer( uint16_t *credits, uint16_t *sentUnits, uint8_t *sentImages, uint16_t *resultCount, uint32_t *unchangedTotal );
+void uploadStore();
+void replayStore();
+void commitNodes();
+void rollbackNodes();
+void resetNodes();
+void verifyNodes();
+void reportTelemetry();
+void reportProfile();
 void error( uint8_t *error );
 
 static FILE *uart;
-static FILE *application;
-static uint8_t *userApplication;
+static FILE *application[STREAM_COUNT];
+static uint8_t *userApplication[STREAM_COUNT];
+static uint8_t numApplications = 0;
+static uint8_t images[STREAM_COUNT][MAX_BLOCKS][4096];
+static uint32_t fileSize[STREAM_COUNT];
+static uint8_t blocksNeeded[STREAM_COUNT];
+static uint8_t imageBases[STREAM_COUNT];
+static uint32_t imageAddresses[STREAM_COUNT]; /** The address of the vector table of every image, 0 if it is not given */
+static uint16_t assignedAddresses[MAX_ASSIGNMENTS];
+static uint8_t assignedStreams[MAX_ASSIGNMENTS];
+static uint16_t numAssignments = 0;
 static uint8_t verbose = 0;
 static uint8_t scan = 0;
 static uint8_t program = 0;
+static uint8_t commit = 0;
+static uint16_t version = 0;
+static uint8_t rollback = 0;
+static uint8_t reset = 0;
+static uint8_t estimate = 0;
+static uint8_t verify = 0;
+static uint8_t store = 0;
+static uint8_t replay = 0;
+static uint8_t telemetry = 0;
+static uint8_t profile = 0;
+static NodeStats nodeStats[MAX_ASSIGNMENTS];
+static double frameLoss = 0;
+static uint8_t blockShift = BLOCK_SHIFT_SECTOR;
+static uint8_t streams[STREAM_COUNT][MAX_UNITS];
+static uint8_t storeData[STORE_SIZE];
 
 void scanNetwork() {
 	
@@ -52,27 +199,315 @@ void scanNetwork() {
 	fread( &numNodes, sizeof(uint16_t), 1, uart);
 	printf( "Found %d nodes active.\n", numNodes );
 
-	uint32_t nodeList[numNodes];
+	// The nodes are sent in order of their short address
+	uint8_t serial[16];
 	uint16_t i;
 	for( i=0; i<numNodes; i++ ){
-		fread( nodeList+i, sizeof(uint32_t), 1, uart );
-		printf( "#%d: 0x%08x\n", i, nodeList[i] );
+		fread( serial, sizeof(uint8_t), 16, uart );
+		printf( "#%d: 0x", i );
+		uint8_t j;
+		for( j=0; j<16; j++ ) {
+			printf( "%02x", serial[j] );
+		}
+		printf( "\n" );
 	}
 
+	fread( &data, sizeof(uint8_t), 1, uart );
+	uint8_t complete = data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "scan not synchronized" );
+
 	if (verbose) printf("Send success message to the programmer.\n");
 	fwrite( &command, sizeof(uint8_t), 1, uart );
 
+	if ( !complete ) error( "more nodes than the programmer can list, the others got no address" );
+
 	return;
 }
 
+void assignStreams() {
+
+	uint8_t command = 0x05;
+	if (verbose) printf("Send %d stream assignments to programmer.\n", numAssignments);
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+
+	fwrite( &numAssignments, sizeof(uint16_t), 1, uart );
+	uint16_t i;
+	for( i=0; i<numAssignments; i++ ) {
+		fwrite( assignedAddresses+i, sizeof(uint16_t), 1, uart );
+		fwrite( assignedStreams+i, sizeof(uint8_t), 1, uart );
+		if (verbose) printf("Node #%d gets image #%d.\n", assignedAddresses[i], assignedStreams[i]);
+	}
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "stream assignment not synchronized" );
+
+}
+
+/**
+ * Identify an image by the CRC-32C of its blocks, the
+ * nodes check this digest before they commit the image.
+ */
+uint32_t imageIdentifier( uint8_t *data, uint32_t length ) {
+	static uint32_t table[256];
+	uint32_t i;
+	if ( !table[1] ) {
+		for ( i=0; i<256; i++ ) {
+			uint32_t crc = i;
+			uint8_t bit;
+			for ( bit=0; bit<8; bit++ ) {
+				crc = ( crc >> 1 ) ^ ( ( crc & 1 ) ? 0x82F63B78 : 0 );
+			}
+			table[i] = crc;
+		}
+	}
+
+	uint32_t crc = 0xFFFFFFFF;
+	for ( i=0; i<length; i++ ) {
+		crc = ( crc >> 8 ) ^ table[( crc ^ data[i] ) & 0xFF];
+	}
+	return ~crc;
+}
+
+/**
+ * Start a session for an image and ask the programmer which
+ * blocks the nodes still need from an interrupted session.
+ * @return The block size the nodes agreed to, as a power of two.
+ */
+uint8_t resumeSession( uint8_t stream, uint32_t image, uint8_t blocks, uint8_t base, uint8_t shift, uint8_t *missing ) {
+
+	uint8_t command = 0x06;
+	if (verbose) printf("Send session request for image #%d (0x%08x) to programmer.\n", stream, image);
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+
+	fwrite( &stream, sizeof(uint8_t), 1, uart );
+	fwrite( &image, sizeof(uint32_t), 1, uart );
+	fwrite( &blocks, sizeof(uint8_t), 1, uart );
+	fwrite( &base, sizeof(uint8_t), 1, uart );
+	fwrite( &shift, sizeof(uint8_t), 1, uart );
+
+	fread( missing, sizeof(uint8_t), RESUME_BITMAP_SIZE, uart );
+	fread( &shift, sizeof(uint8_t), 1, uart );
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "session request not synchronized" );
+
+	return shift;
+
+}
+
+/**
+ * Load all images, every image is a stream that the programmer
+ * interleaves on the bus. An image is linked for the slot its vector
+ * table is at, the address is given with -p <file>@<address>. Without
+ * it the slot is the one start of a slot with the reset handler in
+ * the image, where the second slot starts depends on the flash.
+ */
+void loadImages() {
+
+	uint8_t s;
+	for ( s=0; s<numApplications; s++ ) {
+		fileSize[s] = getFileSize( application[s] );
+		if ( fileSize[s] >= MAX_BLOCKS*4096 ) error( "application file too large for a slot" );
+		blocksNeeded[s] = (fileSize[s] / 4096) + 1;
+
+		memset( images[s], 0x00, sizeof(images[s]) );
+		fread( images[s], sizeof(uint8_t), fileSize[s], application[s] ); // read data from application file
+		if ( ferror( application[s] ) ) error("loading of application file failed");
+
+		uint32_t resetVector = images[s][0][4] | (images[s][0][5]<<8) | (images[s][0][6]<<16) | ((uint32_t)images[s][0][7]<<24);
+		uint32_t base = imageAddresses[s];
+		if ( !base ) {
+			uint8_t i;
+			uint8_t found = 0;
+			for ( i=0; i<sizeof(slotStarts)/sizeof(slotStarts[0]); i++ ) {
+				if ( resetVector >= slotStarts[i] && resetVector < slotStarts[i] + fileSize[s] ) {
+					base = slotStarts[i];
+					++found;
+				}
+			}
+			if ( found > 1 ) error( "slot of the application is ambiguous, give it with -p <file>@<address>" );
+		}
+		if ( base % 4096 || base < BOOTLOADER_SECTORS*4096 || base >= 0x80000 ||
+		     resetVector < base || resetVector >= base + fileSize[s] ) error( "application is not linked for an application slot" );
+		imageBases[s] = base / 4096;
+	}
+
+}
+
+/**
+ * A node writes an image into the slot it does not boot. Nodes
+ * that are not assigned an image get the first image that is
+ * linked for their other slot.
+ */
+void assignSlots() {
+
+	uint8_t command = 0x07;
+	if (verbose) printf("Send slot request to programmer.\n");
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+
+	uint16_t numNodes;
+	fread( &numNodes, sizeof(uint16_t), 1, uart );
+	static uint8_t slots[MAX_ASSIGNMENTS];
+	if ( numNodes > MAX_ASSIGNMENTS ) error( "too many nodes" );
+	fread( slots, sizeof(uint8_t), numNodes, uart );
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "slot request not synchronized" );
+
+	uint16_t i;
+	for ( i=0; i<numNodes; i++ ) {
+		uint16_t j;
+		for ( j=0; j<numAssignments; j++ ) {
+			if ( assignedAddresses[j] == i ) break;
+		}
+		if ( j < numAssignments ) {
+			if ( imageBases[assignedStreams[j]] == slots[i] ) printf("Node #%d boots the slot image #%d is linked for.\n", i, assignedStreams[j]);
+			continue;
+		}
+
+		// A node whose image is broken takes an image for any slot
+		uint8_t s;
+		if ( slots[i] != NO_SLOT && ( slots[i] & SLOT_FAILED ) ) {
+			printf("Node #%d did not start, its image at 0x%05x failed the CRC check.\n", i, ( slots[i] & ~SLOT_FAILED ) * 4096);
+			slots[i] = NO_SLOT;
+		}
+		for ( s=0; s<numApplications; s++ ) {
+			if ( imageBases[s] != slots[i] ) break;
+		}
+		if ( s == numApplications ) {
+			printf("Node #%d boots the slot at 0x%05x, there is no image for its other slot.\n", i, slots[i] * 4096);
+			error( "no image for the free slot of a node" );
+		}
+		if ( numAssignments >= MAX_ASSIGNMENTS ) error( "too many assignments" );
+		assignedAddresses[numAssignments] = i;
+		assignedStreams[numAssignments]   = s;
+		numAssignments++;
+	}
+
+}
+
+/**
+ * The number of blocks of an image with a block size.
+ */
+static uint16_t unitCount( uint8_t s, uint8_t shift ) {
+	if ( shift < BLOCK_SHIFT_SECTOR ) return blocksNeeded[s] << ( BLOCK_SHIFT_SECTOR - shift );
+	uint8_t sectors = 1 << ( shift - BLOCK_SHIFT_SECTOR );
+	return ( blocksNeeded[s] + sectors - 1 ) / sectors;
+}
+
+/**
+ * The virtual sector of the first byte of a block.
+ */
+static uint8_t unitSector( uint16_t unit, uint8_t shift ) {
+	if ( shift < BLOCK_SHIFT_SECTOR ) return unit >> ( BLOCK_SHIFT_SECTOR - shift );
+	return unit << ( shift - BLOCK_SHIFT_SECTOR );
+}
+
+/**
+ * The part of its virtual sector a block is, blocks that
+ * are not smaller than a sector are always part 0.
+ */
+static uint8_t unitPart( uint16_t unit, uint8_t shift ) {
+	if ( shift < BLOCK_SHIFT_SECTOR ) return unit & ( ( 1 << ( BLOCK_SHIFT_SECTOR - shift ) ) - 1 );
+	return 0;
+}
+
+/**
+ * Build the schedule for a block size, a block that is
+ * identical in several images is only sent once for all
+ * of them. A block is sent if one of its sectors is missing.
+ * @return The number of blocks in the schedule.
+ */
+uint16_t buildSchedule( uint8_t shift, uint8_t missing[][RESUME_BITMAP_SIZE] ) {
+
+	uint32_t blockSize = 1 << shift;
+	uint8_t sectors = shift > BLOCK_SHIFT_SECTOR ? 1 << ( shift - BLOCK_SHIFT_SECTOR ) : 1;
+	uint16_t blockCount = 0;
+	uint16_t i;
+	uint8_t s;
+	for ( i=0; i<MAX_UNITS; i++ ) {
+		for ( s=0; s<numApplications; s++ ) {
+			streams[s][i] = 0;
+			if ( i >= unitCount( s, shift ) ) continue;
+
+			uint8_t first = unitSector( i, shift );
+			uint8_t j;
+			for ( j=first; j<first+sectors && j<blocksNeeded[s]; j++ ) {
+				if ( missing[s][j/8] & (1<<(j%8)) ) break;
+			}
+			if ( j == first+sectors || j == blocksNeeded[s] ) continue;
+
+			uint8_t *block = images[s][0] + i*blockSize;
+			uint8_t t;
+			for ( t=0; t<s; t++ ) {
+				if ( streams[t][i] && memcmp( images[t][0] + i*blockSize, block, blockSize ) == 0 ) {
+					streams[t][i] |= (1<<s);
+					break;
+				}
+			}
+			if ( t == s ) {
+				streams[s][i] = (1<<s);
+				blockCount++;
+			}
+		}
+	}
+	return blockCount;
+
+}
+
+/**
+ * Start the sessions of all images. All images use the same block
+ * size, if a node refuses it the sessions start again with the
+ * largest block all nodes take.
+ * @param[out] missing The sectors that are missing on a node of every image.
+ * @return The block size as a power of two.
+ */
+uint8_t negotiateSessions( uint8_t missing[][RESUME_BITMAP_SIZE] ) {
+
+	uint8_t shift = blockShift;
+	uint8_t agreed;
+	uint8_t s;
+	for ( ;; ) {
+		agreed = shift;
+		for ( s=0; s<numApplications; s++ ) {
+			uint8_t accepted = resumeSession( s, imageIdentifier( images[s][0], blocksNeeded[s]*4096 ), blocksNeeded[s], imageBases[s], shift, missing[s] );
+			if ( accepted < agreed ) agreed = accepted;
+		}
+		if ( agreed == shift ) break;
+		if ( agreed < BLOCK_SHIFT_MIN ) error( "nodes refused every block size" );
+		printf("Nodes refused blocks of %d bytes, using %d bytes.\n", 1 << shift, 1 << agreed);
+		shift = agreed;
+	}
+	return shift;
+
+}
+
 void programNodes() {
 
-	// TODO: supply list with IDs of nodes and whether they should be programmed or not
-	
-	uint32_t fileSize = getFileSize( application );
 	setlocale(LC_NUMERIC, "en_US.utf-8"); // to format large numbers
 
-	printf("Programming all nodes with file \"%s\" (%'d bytes)...\n", userApplication, fileSize);
+	uint8_t s;
+	for ( s=0; s<numApplications; s++ ) {
+		printf("Programming image #%d for 0x%05x with file \"%s\" (%'d bytes)...\n", s, imageBases[s] * 4096, userApplication[s], fileSize[s]);
+	}
+
+	// Only send the blocks that are missing after an interrupted
+	// session with the same image.
+	uint8_t missing[STREAM_COUNT][RESUME_BITMAP_SIZE];
+	uint8_t shift = negotiateSessions( missing );
+
+	uint16_t blockSize = 1 << shift;
+	uint16_t blockCount = buildSchedule( shift, missing );
 
 	uint8_t command = 0x02;
 	if (verbose) printf("Send programming request to programmer.\n");
@@ -82,43 +517,504 @@ void programNodes() {
 	fread( &data, sizeof(uint8_t), 1, uart );
 	if (verbose) printf("Programmer succesfully received programming request.\n");
 
-	fwrite( &fileSize, sizeof(uint32_t), 1, uart );
-	
-	uint32_t blockNumber;
-	uint8_t blocksNeeded = (fileSize / 4096) + 1;
-	uint8_t block[4096];
-
-	if (verbose) printf("Sending data in %d blocks of 4kB.\n", blocksNeeded);
-	command = 0x03;
-	int i;
-	for ( i=0; i<blocksNeeded; i++ ) {
-		uint16_t blockSize = ( (i+1) == blocksNeeded ) ? fileSize % 4096 : 4096;
-		fread(  block, sizeof(uint8_t), blockSize, application ); // read data from application file
-		if ( ferror( application ) ) error("loading of application file failed");
-		if (verbose) printf("Loading block of %'d bytes from application file succesfull.\n", blockSize);
-
-		printf("Sending block #%d (%'d bytes)\n", i, blockSize);
-		fwrite( block, sizeof(uint8_t), blockSize, uart ); // send data to programmer
-		if (verbose) printf("Sending block to programmer succesfull.\n", blockSize);		
-
-		if (verbose) printf("Sending mark for end of block to programmer.\n");
+	fwrite( &blockCount, sizeof(uint16_t), 1, uart );
+
+	// The programmer relays a block while the next one is received.
+	// It buffers a few pieces, a piece is only sent with a credit and
+	// the results of the blocks arrive in between the credits.
+	if (verbose) printf("Sending data in %d blocks of %d bytes.\n", blockCount, blockSize);
+	static uint16_t sentUnits[MAX_UNITS*STREAM_COUNT];
+	static uint8_t sentImages[MAX_UNITS*STREAM_COUNT];
+	uint16_t sentCount = 0;
+	uint16_t resultCount = 0;
+	uint16_t credits = 0;
+	uint32_t unchangedTotal = 0;
+	uint16_t i;
+	for ( i=0; i<MAX_UNITS; i++ ) {
+		for ( s=0; s<numApplications; s++ ) {
+			if ( !streams[s][i] ) continue;
+
+			// Blocks are padded, the nodes only take complete blocks
+			uint8_t sector = unitSector( i, shift );
+			uint8_t part   = unitPart( i, shift );
+			printf("Sending block #%d of image #%d to streams 0x%02x (%'d bytes)\n", i, s, streams[s][i], blockSize);
+			fwrite( &sector, sizeof(uint8_t), 1, uart );
+			fwrite( &part, sizeof(uint8_t), 1, uart );
+			fwrite( &streams[s][i], sizeof(uint8_t), 1, uart );
+			fwrite( &blockSize, sizeof(uint16_t), 1, uart );
+
+			uint32_t offset;
+			for ( offset=0; offset<blockSize; offset+=PIECE_SIZE ) {
+				while ( !credits ) {
+					readTransfer( &credits, sentUnits, sentImages, &resultCount, &unchangedTotal );
+				}
+				--credits;
+				uint32_t piece = blockSize - offset < PIECE_SIZE ? blockSize - offset : PIECE_SIZE;
+				fwrite( images[s][0] + i*blockSize + offset, sizeof(uint8_t), piece, uart ); // send data to programmer
+			}
+			if (verbose) printf("Sending block to programmer succesfull.\n");
+
+			if (verbose) printf("Sending mark for end of block to programmer.\n");
+			command = 0x03;
+			fwrite( &command, sizeof(uint8_t), 1, uart );
+			sentUnits[sentCount]  = i;
+			sentImages[sentCount] = s;
+			++sentCount;
+		}
+	}
+
+	if (verbose) printf("Sending end of file mark to programmer.\n");
+	command = 0x04;
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	while ( resultCount < sentCount ) {
+		readTransfer( &credits, sentUnits, sentImages, &resultCount, &unchangedTotal );
+	}
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "end of transmission not synchronized" );
+	printf("Programmer succesfully received %'d blocks, %'d node blocks were unchanged.\n", blockCount, unchangedTotal);
+
+}
+
+/**
+ * Read the next message of the programmer during programming,
+ * a credit for a piece or the result of the oldest block.
+ */
+static void readTransfer( uint16_t *credits, uint16_t *sentUnits, uint8_t *sentImages, uint16_t *resultCount, uint32_t *unchangedTotal ) {
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data == TRANSFER_CREDIT ) {
+		++(*credits);
+		return;
+	}
+	if ( data == TRANSFER_ERROR ) error( "programmer aborted the transfer, the blocks were not synchronized" );
+	if ( data == TRANSFER_LOST ) {
+		uint8_t lost[3];
+		fread( lost, sizeof(uint8_t), 3, uart );
+		printf("A node of image #%d could not write the sector of the blocks at 0x%05x (bitmap 0x%02x), it had them pending.\n", lost[0], lost[1] * 4096, lost[2]);
+		error( "node lost blocks it confirmed as pending" );
+	}
+
+	uint16_t i = sentUnits[*resultCount];
+	uint8_t s  = sentImages[*resultCount];
+	if ( !data ) error( "error in programmer while programming nodes");
+	if (verbose) printf("Programming nodes with block #%d succesfull.\n", i);
+
+	uint16_t unchanged;
+	fread( &unchanged, sizeof(uint16_t), 1, uart );
+	if ( unchanged ) printf("Block #%d of image #%d was already on %d nodes.\n", i, s, unchanged);
+	*unchangedTotal += unchanged;
+
+	uint16_t staged;
+	fread( &staged, sizeof(uint16_t), 1, uart );
+	if ( staged && verbose ) printf("Block #%d of image #%d is pending on %d nodes until its sector is complete.\n", i, s, staged);
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != 0x03 ) error( "block transmission not synchronized" );
+	if (verbose) printf("Programmer has succesfully received the block.\n");
+	++(*resultCount);
+
+}
+
+/**
+ * Upload every block of the images to the store of the programmer,
+ * at the block size the nodes on the bus agree on. The programmer
+ * only completes the store if its digest matches, so an interrupted
+ * upload never leaves a partial store behind.
+ */
+void uploadStore() {
+
+	setlocale(LC_NUMERIC, "en_US.utf-8"); // to format large numbers
+
+	uint8_t missing[STREAM_COUNT][RESUME_BITMAP_SIZE];
+	uint8_t shift = negotiateSessions( missing );
+	memset( missing, 0xFF, sizeof(missing) ); // The store holds all blocks, for later segments too
+	uint16_t blockCount = buildSchedule( shift, missing );
+
+	uint16_t blockSize = 1 << shift;
+	uint32_t length = 0;
+	uint16_t i;
+	uint8_t s;
+	for ( i=0; i<MAX_UNITS; i++ ) {
+		for ( s=0; s<numApplications; s++ ) {
+			if ( !streams[s][i] ) continue;
+			if ( length + STORE_RECORD_SIZE + blockSize > STORE_SIZE ) error( "images do not fit in the store of the programmer" );
+
+			uint8_t *record = storeData + length;
+			memset( record, 0xFF, STORE_RECORD_SIZE );
+			record[0] = unitSector( i, shift );
+			record[1] = unitPart( i, shift );
+			record[2] = streams[s][i];
+			record[4] = blockSize & 0xFF;
+			record[5] = blockSize >> 8;
+			memcpy( record + STORE_RECORD_SIZE, images[s][0] + i*blockSize, blockSize );
+			length += STORE_RECORD_SIZE + blockSize;
+		}
+	}
+	uint32_t digest = imageIdentifier( storeData, length );
+
+	uint8_t command = 0x0C;
+	if (verbose) printf("Send store request to programmer.\n");
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "programmer did not accept the store request" );
+
+	fwrite( &numApplications, sizeof(uint8_t), 1, uart );
+	for ( s=0; s<numApplications; s++ ) {
+		uint32_t image = imageIdentifier( images[s][0], blocksNeeded[s]*4096 );
+		fwrite( &image, sizeof(uint32_t), 1, uart );
+		fwrite( &blocksNeeded[s], sizeof(uint8_t), 1, uart );
+		fwrite( &imageBases[s], sizeof(uint8_t), 1, uart );
+	}
+	fwrite( &shift, sizeof(uint8_t), 1, uart );
+	fwrite( &blockCount, sizeof(uint16_t), 1, uart );
+	fwrite( &length, sizeof(uint32_t), 1, uart );
+	fwrite( &digest, sizeof(uint32_t), 1, uart );
+
+	// The programmer erases the store first and acknowledges
+	// every piece once it is written, it can not buffer more
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( !data ) error( "images do not fit in the store of the programmer" );
+
+	uint32_t offset;
+	for ( offset=0; offset<length; offset+=STORE_PIECE_SIZE ) {
+		uint32_t piece = length - offset < STORE_PIECE_SIZE ? length - offset : STORE_PIECE_SIZE;
+		fwrite( storeData + offset, sizeof(uint8_t), piece, uart );
+		fread( &data, sizeof(uint8_t), 1, uart );
+		if ( !data ) error( "programmer failed to write the store" );
+		if (verbose) printf("Stored %'d of %'d bytes.\n", offset + piece, length);
+	}
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( !data ) error( "digest of the store does not match" );
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "store transmission not synchronized" );
+	printf("Stored %'d blocks of %'d bytes (%'d bytes) in the programmer.\n", blockCount, blockSize, length);
+
+}
+
+/**
+ * Let the programmer send its store to the nodes, the host
+ * only waits for the result.
+ */
+void replayStore() {
+
+	setlocale(LC_NUMERIC, "en_US.utf-8"); // to format large numbers
+
+	uint8_t command = 0x0D;
+	if (verbose) printf("Send replay request to programmer.\n");
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "programmer did not accept the replay request" );
+
+	uint8_t success;
+	uint16_t sent, failed;
+	uint32_t unchanged;
+	fread( &success, sizeof(uint8_t), 1, uart );
+	fread( &sent, sizeof(uint16_t), 1, uart );
+	fread( &failed, sizeof(uint16_t), 1, uart );
+	fread( &unchanged, sizeof(uint32_t), 1, uart );
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "replay not synchronized" );
+
+	if ( !success ) error( "programmer has no store, or the nodes refused its block size" );
+	printf("Programmer sent %'d blocks from its store, %'d node blocks were unchanged.\n", sent, unchanged);
+	if ( failed ) error( "not all nodes confirmed every block" );
+
+}
+
+/**
+ * Estimate the time on the bus to send the images with every block
+ * size, without a programmer. A block costs its frames, the header,
+ * the hash and the answer of one node. A lost frame costs the
+ * complete block again, so large blocks suit a clean bus and small
+ * blocks a lossy one.
+ */
+void estimateTransfer() {
+
+	uint8_t missing[STREAM_COUNT][RESUME_BITMAP_SIZE];
+	memset( missing, 0xFF, sizeof(missing) );
+
+	printf("Block size   Blocks   Frames   Expected time at %.2f%% frame loss\n", frameLoss * 100);
+	uint8_t shift;
+	for ( shift=BLOCK_SHIFT_MIN; shift<=BLOCK_SHIFT_MAX; shift++ ) {
+		uint16_t blockCount = buildSchedule( shift, missing );
+		uint32_t frames = ( 1 << shift ) / 8;
+		double blockTime = (double)( frames * FRAME_BITS + FRAME_BITS + 2 * SHORT_FRAME_BITS ) / BUS_BITRATE;
+		double attempts = 1;
+		uint32_t i;
+		for ( i=0; i<frames+2; i++ ) {
+			attempts /= 1 - frameLoss;
+		}
+		printf("%10d %8d %8d %10.1f s\n", 1 << shift, blockCount, blockCount * ( frames + 3 ), blockCount * blockTime * attempts);
+	}
+
+}
+
+/**
+ * Let the nodes boot the images they just received. A node
+ * only commits an image when all of its blocks are correct.
+ */
+void commitNodes() {
+
+	uint8_t s;
+	for ( s=0; s<numApplications; s++ ) {
+		uint8_t command = 0x08;
+		if (verbose) printf("Send commit request for image #%d to programmer.\n", s);
 		fwrite( &command, sizeof(uint8_t), 1, uart );
 
+		uint8_t data;
 		fread( &data, sizeof(uint8_t), 1, uart );
-		if ( !data ) error( "error in programmer while programming nodes");
-		if (verbose) printf("Programming nodes with block #%d succesfull.\n", i);
+
+		fwrite( &s, sizeof(uint8_t), 1, uart );
+		fwrite( &version, sizeof(uint16_t), 1, uart );
+
+		uint16_t nodes;
+		fread( &nodes, sizeof(uint16_t), 1, uart );
+		printf("Image #%d is committed as version %d on %d nodes.\n", s, version, nodes);
 
 		fread( &data, sizeof(uint8_t), 1, uart );
-		if ( data != command ) error( "block transmission not synchronized" );
-		if (verbose) printf("Programmer has succesfully received the block.\n");
+		if ( data != command ) error( "commit not synchronized" );
 	}
 
-	if (verbose) printf("Sending end of file mark to programmer.\n");
-	command = 0x04;
+}
+
+/**
+ * Let the nodes boot their previous image again, the
+ * nodes of every assigned stream are rolled back.
+ */
+void rollbackNodes() {
+
+	uint8_t s;
+	for ( s=0; s<STREAM_COUNT; s++ ) {
+		uint16_t i;
+		for ( i=0; i<numAssignments; i++ ) {
+			if ( assignedStreams[i] == s ) break;
+		}
+		if ( s > 0 && i == numAssignments ) continue;
+
+		uint8_t command = 0x09;
+		if (verbose) printf("Send rollback request for stream #%d to programmer.\n", s);
+		fwrite( &command, sizeof(uint8_t), 1, uart );
+
+		uint8_t data;
+		fread( &data, sizeof(uint8_t), 1, uart );
+
+		fwrite( &s, sizeof(uint8_t), 1, uart );
+
+		uint16_t nodes;
+		fread( &nodes, sizeof(uint16_t), 1, uart );
+		printf("%d nodes of stream #%d rolled back to their previous image.\n", nodes, s);
+
+		fread( &data, sizeof(uint8_t), 1, uart );
+		if ( data != command ) error( "rollback not synchronized" );
+	}
+
+}
+
+/**
+ * Reset the network, the nodes start the image of their active slot.
+ */
+void resetNodes() {
+
+	uint8_t command = 0x0A;
+	if (verbose) printf("Send reset request to programmer.\n");
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+	printf("Network is reset.\n");
+
+}
+
+/**
+ * Check which image every node holds without sending the images
+ * again, every node hashes the region of every image in its own
+ * flash and the programmer collects the digests.
+ */
+void verifyNodes() {
+
+	static uint8_t holds[MAX_ASSIGNMENTS];
+	static uint8_t answered[MAX_ASSIGNMENTS];
+	memset( holds, 0, sizeof(holds) );
+	memset( answered, 0, sizeof(answered) );
+
+	uint16_t numNodes = 0;
+	uint8_t s;
+	for ( s=0; s<numApplications; s++ ) {
+		uint32_t address = imageBases[s] * 4096;
+		uint32_t length  = fileSize[s];
+		uint32_t expected = imageIdentifier( images[s][0], length );
+
+		uint8_t command = 0x0B;
+		if (verbose) printf("Send digest request for image #%d (0x%08x) to programmer.\n", s, expected);
+		fwrite( &command, sizeof(uint8_t), 1, uart );
+
+		uint8_t data;
+		fread( &data, sizeof(uint8_t), 1, uart );
+
+		fwrite( &address, sizeof(uint32_t), 1, uart );
+		fwrite( &length, sizeof(uint32_t), 1, uart );
+
+		fread( &numNodes, sizeof(uint16_t), 1, uart );
+		if ( numNodes > MAX_ASSIGNMENTS ) error( "too many nodes" );
+		static uint32_t digests[MAX_ASSIGNMENTS];
+		static uint8_t states[MAX_ASSIGNMENTS];
+		fread( digests, sizeof(uint32_t), numNodes, uart );
+		fread( states, sizeof(uint8_t), numNodes, uart );
+
+		fread( &data, sizeof(uint8_t), 1, uart );
+		if ( data != command ) error( "digest request not synchronized" );
+
+		uint16_t i;
+		for ( i=0; i<numNodes; i++ ) {
+			if ( states[i] ) answered[i] = 1;
+			if ( states[i] == DIGEST_VALID && digests[i] == expected ) holds[i] |= (1<<s);
+		}
+	}
+
+	uint16_t i;
+	for ( i=0; i<numNodes; i++ ) {
+		if ( !answered[i] ) {
+			printf("Node #%d did not answer.\n", i);
+			continue;
+		}
+		if ( !holds[i] ) {
+			printf("Node #%d holds none of the images.\n", i);
+			continue;
+		}
+		printf("Node #%d holds image", i);
+		for ( s=0; s<numApplications; s++ ) {
+			if ( holds[i] & (1<<s) ) printf(" #%d", s);
+		}
+		printf(".\n");
+	}
+
+}
+
+/**
+ * The average time a node took to answer a block, in ms.
+ */
+static double averageLatency( uint16_t node ) {
+	if ( !nodeStats[node].answers ) return 0;
+	return (double)nodeStats[node].latencyTotal / nodeStats[node].answers;
+}
+
+/**
+ * The number of blocks a node failed, a block it did not
+ * answer weighs most because it is sent again to all nodes.
+ */
+static uint32_t failureScore( uint16_t node ) {
+	NodeStats *stats = &nodeStats[node];
+	return stats->timeouts * 4 + stats->crcFailures * 2 + stats->flashFailures * 2 +
+	       ( stats->rxErrors + stats->txErrors ) / 8 + stats->overruns + stats->slowDowns;
+}
+
+static int compareLatency( const void *a, const void *b ) {
+	double difference = averageLatency( *(uint16_t *)b ) - averageLatency( *(uint16_t *)a );
+	return ( difference > 0 ) - ( difference < 0 );
+}
+
+static int compareFailures( const void *a, const void *b ) {
+	uint32_t x = failureScore( *(uint16_t *)a );
+	uint32_t y = failureScore( *(uint16_t *)b );
+	return ( y > x ) - ( y < x );
+}
+
+/**
+ * Ask the programmer for the statistics of every node and
+ * show the slowest and the least reliable nodes.
+ */
+void reportTelemetry() {
+
+	uint8_t command = 0x0E;
+	if (verbose) printf("Send telemetry request to programmer.\n");
 	fwrite( &command, sizeof(uint8_t), 1, uart );
 
+	uint8_t data;
 	fread( &data, sizeof(uint8_t), 1, uart );
-	printf("Programmer succesfully received %'d bytes.\n", fileSize);
+
+	uint16_t numNodes;
+	fread( &numNodes, sizeof(uint16_t), 1, uart );
+	if ( numNodes > MAX_ASSIGNMENTS ) error( "too many nodes" );
+	fread( nodeStats, sizeof(NodeStats), numNodes, uart );
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "telemetry not synchronized" );
+
+	static uint16_t order[MAX_ASSIGNMENTS];
+	uint16_t i;
+	for ( i=0; i<numNodes; i++ ) {
+		order[i] = i;
+	}
+
+	printf("Slowest nodes:\n");
+	printf("  Node   Blocks   Average ms   Max ms\n");
+	qsort( order, numNodes, sizeof(uint16_t), compareLatency );
+	for ( i=0; i<numNodes && i<REPORT_NODES; i++ ) {
+		NodeStats *stats = &nodeStats[order[i]];
+		if ( !stats->answers ) break;
+		printf("  #%-4d  %6d   %10.1f   %6d\n", order[i], stats->answers, averageLatency( order[i] ), stats->latencyMax);
+	}
+
+	printf("Least reliable nodes:\n");
+	printf("  Node   Timeouts   CRC   Flash   RX errors   TX errors   Overruns   Slow-downs\n");
+	qsort( order, numNodes, sizeof(uint16_t), compareFailures );
+	for ( i=0; i<numNodes && i<REPORT_NODES; i++ ) {
+		NodeStats *stats = &nodeStats[order[i]];
+		if ( !failureScore( order[i] ) ) break;
+		printf("  #%-4d  %8d   %3d   %5d   %9d   %9d   %8d   %10d\n", order[i], stats->timeouts, stats->crcFailures,
+		       stats->flashFailures, stats->rxErrors, stats->txErrors, stats->overruns, stats->slowDowns);
+	}
+	if ( i == 0 ) printf("  None, every node answered every block.\n");
+
+}
+
+/**
+ * Ask the programmer for the profile of the nodes, summed over all
+ * nodes, and show where the time of the nodes went. Only nodes that
+ * are built with PROFILE report it.
+ */
+void reportProfile() {
+
+	uint8_t command = 0x0F;
+	if (verbose) printf("Send profile request to programmer.\n");
+	fwrite( &command, sizeof(uint8_t), 1, uart );
+
+	uint8_t data;
+	fread( &data, sizeof(uint8_t), 1, uart );
+
+	ProfileSummary summary[PROFILE_COUNT];
+	fread( summary, sizeof(ProfileSummary), PROFILE_COUNT, uart );
+
+	fread( &data, sizeof(uint8_t), 1, uart );
+	if ( data != command ) error( "profile not synchronized" );
+
+	uint8_t i;
+	if ( !summary[0].nodes ) {
+		printf("No node reported a profile, build the bootloader with PROFILE.\n");
+		return;
+	}
+
+	// The check of a message includes its receive and hash
+	printf("Profile of %d nodes:\n", summary[0].nodes);
+	printf("  Phase           Calls      Mcycles   Cycles/call   Slowest node   Its Mcycles\n");
+	for ( i=0; i<PROFILE_COUNT; i++ ) {
+		ProfileSummary *phase = &summary[i];
+		double cycles = (double)( phase->cycles << PROFILE_CYCLE_SHIFT );
+		printf("  %-12s %10llu %12.1f %13.0f", profilePhases[i], (unsigned long long)phase->calls,
+		       cycles / 1e6, phase->calls ? cycles / phase->calls : 0);
+		if ( phase->maxCycles ) {
+			printf("   #%-12d %11.1f", phase->maxNode, (double)( (uint64_t)phase->maxCycles << PROFILE_CYCLE_SHIFT ) / 1e6);
+		}
+		printf("\n");
+	}
 
 }
 
@@ -133,20 +1029,80 @@ int main( int argc, char **argv ) {
 	// long arguments e.g. --scan
 	// list of nodes to flash [Y/N]
 	int opt;
-	while (( opt = getopt(argc, argv, "svp:")) > 0 )
+	while (( opt = getopt(argc, argv, "svbrdtfSRp:a:c:k:e:")) > 0 )
 	switch (opt) {
 	case '?': 
 		puts("Bad argument");
 		exit(1);
 		break;
-	case 'p':
+	case 'p': // Every image is a stream, numbered in order of appearance, <file>[@<address of the vector table>]
+		if ( numApplications >= STREAM_COUNT ) error( "too many images" );
 		program=1;
-		userApplication = malloc( strlen( optarg ) );
-		strcpy( userApplication, optarg );
+		{
+			char *at = strrchr( optarg, '@' );
+			imageAddresses[numApplications] = 0;
+			if ( at ) {
+				*at = 0;
+				imageAddresses[numApplications] = strtoul( at+1, 0, 0 );
+				if ( !imageAddresses[numApplications] ) error( "bad image, use <file>@<address>" );
+			}
+		}
+		userApplication[numApplications] = malloc( strlen( optarg ) + 1 );
+		strcpy( userApplication[numApplications], optarg );
+		numApplications++;
+		break;
+	case 'a': // Assign a node to an image, <node number>:<image number>
+		if ( numAssignments >= MAX_ASSIGNMENTS ) error( "too many assignments" );
+		{
+			unsigned int address, stream;
+			if ( sscanf( optarg, "%u:%u", &address, &stream ) != 2 || stream >= STREAM_COUNT ) error( "bad assignment, use <node>:<image>" );
+			assignedAddresses[numAssignments] = address;
+			assignedStreams[numAssignments]   = stream;
+			numAssignments++;
+		}
 		break;
 	case 's':
 		scan=1;
 		break;
+	case 'c': // Commit the images with a version after programming
+		commit=1;
+		version=atoi( optarg );
+		break;
+	case 'b': // Roll the nodes back to their previous image
+		rollback=1;
+		break;
+	case 'd': // Verify which image the nodes hold instead of programming them
+		verify=1;
+		break;
+	case 't': // Show the programming statistics of the nodes
+		telemetry=1;
+		break;
+	case 'f': // Show where the time of the nodes went
+		profile=1;
+		break;
+	case 'S': // Upload the images to the store of the programmer and send them from there
+		store=1;
+		break;
+	case 'R': // Send the images from the store of the programmer, without an upload
+		replay=1;
+		break;
+	case 'r': // Reset the network at the end
+		reset=1;
+		break;
+	case 'k': // Propose blocks of this many bytes, the nodes may ask for smaller ones
+		{
+			unsigned int size = atoi( optarg );
+			for ( blockShift=BLOCK_SHIFT_MIN; blockShift<=BLOCK_SHIFT_MAX; blockShift++ ) {
+				if ( size == 1u << blockShift ) break;
+			}
+			if ( blockShift > BLOCK_SHIFT_MAX ) error( "block size is not a power of two from 256 to 32768" );
+		}
+		break;
+	case 'e': // Estimate the transfer time of the images for every block size at a frame loss rate
+		estimate=1;
+		frameLoss=atof( optarg );
+		if ( frameLoss < 0 || frameLoss >= 1 ) error( "frame loss rate is not in [0, 1)" );
+		break;
 	case 'v':
 		verbose=1;
 		break;
@@ -157,26 +1113,63 @@ int main( int argc, char **argv ) {
 		scanNetwork();
 		fclose( uart );
 	}
-	else if( program ) {
-		//uart = fopen( "/dev/ttyUSB0", "a+b" );
+	else if( estimate && numApplications ) {
+		uint8_t s;
+		for ( s=0; s<numApplications; s++ ) {
+			if ( !( application[s]=fopen( userApplication[s], "rb" ) ) ) error( "failed to open binary file" );
+		}
+		loadImages();
+		estimateTransfer();
+		for ( s=0; s<numApplications; s++ ) {
+			fclose( application[s] );
+		}
+	}
+	else if( program || rollback || reset || telemetry || profile ) {
 		if ( !( uart=fopen( "/dev/ttyUSB0", "a+b" ) ) ) error( "failed to open /dev/ttyUSB0" );
-		if ( !( application=fopen( userApplication, "rb" ) ) ) error( "failed to open binary file" );
-		programNodes();
-		fclose( application );
+		uint8_t s;
+		for ( s=0; s<numApplications; s++ ) {
+			if ( !( application[s]=fopen( userApplication[s], "rb" ) ) ) error( "failed to open binary file" );
+		}
+		if ( verify ) {
+			loadImages();
+			verifyNodes();
+		}
+		else if ( program ) {
+			loadImages();
+			assignSlots();
+			assignStreams();
+			if ( store ) uploadStore();
+			if ( store || replay ) replayStore();
+			else programNodes();
+			if ( commit ) commitNodes();
+		}
+		else if ( rollback ) {
+			assignStreams();
+			rollbackNodes();
+		}
+		if ( telemetry ) reportTelemetry();
+		if ( profile ) reportProfile();
+		if ( reset ) resetNodes();
+		for ( s=0; s<numApplications; s++ ) {
+			fclose( application[s] );
+		}
 		fclose( uart );
 	}
 	else {
 		printf("Bad input.\n");
 	}
 
-	free( userApplication );
+	uint8_t s;
+	for ( s=0; s<numApplications; s++ ) {
+		free( userApplication[s] );
+	}
 
 	return 0;
 }
 
 uint32_t getFileSize(FILE *file) {
 	fseek( file, 0L, SEEK_END);
-	uint32_t size = ftell( application );
+	uint32_t size = ftell( file );
 	fseek( file, 0L, SEEK_SET);
 	return size;
 }
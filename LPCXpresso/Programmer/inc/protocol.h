@@ -15,22 +15,155 @@
 
 #include <stdint.h>
 
+#include "can.h"
+#include "timer.h"
+#include "profile.h"
+
 #ifndef PROTOCOL_PROGRAMMER_H__
 #define PROTOCOL_PROGRAMMER_H__
 
+/** The maximum number of images that can be programmed in one session */
+#define STREAM_COUNT 8
+
+/** The number of CAN segments the programmer serves, one on every controller */
+#define SEGMENT_COUNT 2
+
+/** The maximum number of nodes on one segment */
+#define MAX_NODES 512
+
+/** The number of short addresses covered by one select message */
+#define SELECT_BITMAP_SIZE 48
+
+/** The number of bytes in the bitmap of blocks of a resumed session */
+#define RESUME_BITMAP_SIZE 15
+
+/** The slot of a node that does not boot an application */
+#define NO_SLOT 0xFF
+
+/** The flag in the slot of a node whose image failed its CRC check, NO_SLOT has it too */
+#define SLOT_FAILED 0x80
+
+/** The time between the digest replies of two consecutive short addresses */
+#define DIGEST_SLOT_MS 2
+
+/** The time between the profile replies of two consecutive short addresses */
+#define PROFILE_SLOT_MS 25
+
+/** The time between the session replies of two consecutive short addresses */
+#define SESSION_SLOT_MS 3
+
+/** The step the gap between data frames grows with when a node falls behind, in us */
+#define PACE_STEP_US 100
+
+/** The largest gap between data frames, in us */
+#define PACE_MAX_US 5000
+
+/** The number of frame gaps before the next block after a node fell behind */
+#define PACE_DRAIN_FRAMES 16
+
+/**
+ * The answer of a node to a digest request.
+ */
+typedef enum {
+	DIGEST_NONE    = 0, /** The node did not answer */
+	DIGEST_VALID   = 1, /** The digest of the region is valid */
+	DIGEST_REFUSED = 2  /** The region is not in the flash of the node */
+} DigestState;
+
+/**
+ * The programming statistics of a node, the counters saturate.
+ */
+typedef struct {
+	uint32_t latencyTotal;  /** The sum of the time between the hash of a block and the answer, in ms */
+	uint16_t answers;       /** The number of blocks the node answered */
+	uint16_t latencyMax;    /** The longest time between the hash of a block and the answer, in ms */
+	uint8_t  crcFailures;   /** The number of blocks that failed the CRC on the node */
+	uint8_t  flashFailures; /** The number of blocks the node failed to flash */
+	uint8_t  timeouts;      /** The number of blocks the node did not answer in time, they have to be sent again */
+	uint8_t  rxErrors;      /** The last receive error counter the node reported */
+	uint8_t  txErrors;      /** The last transmit error counter the node reported */
+	uint8_t  overruns;      /** The number of messages the node lost */
+	uint16_t slowDowns;     /** The number of times the node asked the programmer to slow down */
+} NodeStats;
+
+/**
+ * The profile of a phase over all nodes that reported it.
+ */
 typedef struct {
-	uint32_t ids[512];
+	uint64_t calls;     /** The number of calls of all nodes */
+	uint64_t cycles;    /** The cycles of all nodes, in units of 1 << PROFILE_CYCLE_SHIFT */
+	uint32_t maxCycles; /** The most cycles one node spent in the phase */
+	uint16_t maxNode;   /** The node that spent the most cycles, in the list of the host */
+	uint16_t nodes;     /** The number of nodes that reported the phase */
+} ProfileSummary;
+
+/**
+ * The nodes in the network, the index in the
+ * list is the short address of the node.
+ */
+typedef struct {
+	uint8_t serials[MAX_NODES][16]; /** The full device serial of every node */
+	uint8_t streams[MAX_NODES];     /** The image stream every node is assigned to */
+	uint8_t slots[MAX_NODES];       /** The first virtual sector of the slot every node boots, with SLOT_FAILED */
+	uint32_t digests[MAX_NODES];    /** The digest every node reported, see protocolDigest */
+	uint8_t digestStates[MAX_NODES]; /** The DigestState of every node */
 	uint16_t numNodes;
 } nodelist;
 
+/**
+ * A CAN segment, the bus of one controller and the nodes on it.
+ *
+ * Every segment runs its own session, so the blocks are
+ * sent on all segments at the same time and a slow node
+ * only slows down its own segment.
+ */
 typedef struct {
-	uint8_t data[4096];
-	uint8_t sector;
-} DataBlock;
+	uint8_t index;         /** The index of the segment */
+	CanBus *bus;           /** The controller of the segment */
+	uint8_t enabled;       /** If the bus acknowledged the last scan, a segment without nodes is skipped */
+	Timer windowTimer;     /** The timer of the time the nodes get to answer */
+	Timer paceTimer;       /** The timer of the gap between data frames */
+	nodelist *list;        /** The nodes on the segment */
+	CanMessage msg;        /** The temporary message object */
+	uint8_t sending;       /** If the block that is being sent goes to any node */
+	uint8_t selected;      /** Are the nodes to be reprogrammed already selected */
+	uint32_t blockHash;    /** The CRC of the frames of the block that were sent */
+	uint16_t blockFrames;  /** The number of frames of the block that were sent */
+	uint8_t sealedStreams; /** The streams the block was written to */
+	uint32_t sealedAt;     /** The time the hash of the block was sent, see timerNow */
+	uint8_t answered[MAX_NODES/8]; /** The nodes that answered the block */
+	uint16_t expected;     /** The number of nodes that have to confirm the block */
+	uint16_t answers;      /** The number of nodes that answered the block */
+	uint16_t correct;      /** The number of nodes that confirmed the block */
+	uint16_t alreadyWritten; /** The number of nodes that already had the block */
+	uint16_t staged;       /** The number of nodes that keep the block in RAM until its sector is complete */
+	uint8_t lostStream;    /** The stream of the first node that lost pending blocks */
+	uint8_t lostSector;    /** The virtual sector in the image of the first block it lost */
+	uint8_t lostBlocks;    /** The bitmap of the blocks from lostSector on it lost, 0 if no node lost any */
+	uint16_t frameGap;     /** The gap between two data frames, in us */
+	uint8_t gapPending;    /** If the gap has to start once the transmit buffer is free */
+	uint8_t slowedDown;    /** If a node fell behind during the current block */
+	NodeStats stats[MAX_NODES]; /** The programming statistics of every node, by short address */
+} Segment;
 
 void initProtocol( void );
-void protocolDiscover( nodelist *list );
-uint8_t protocolProgram( nodelist *list, uint8_t *start, uint8_t *end, uint8_t sector );
-void protocolReset( void );
+void initSegment( Segment *segment, uint8_t index, CanController controller, Timer windowTimer, Timer paceTimer, nodelist *list );
+uint8_t protocolDiscover( Segment *segment );
+void protocolBlockBegin( Segment *segment, uint8_t sector, uint8_t part, uint8_t streams );
+uint8_t protocolFrameDue( Segment *segment );
+void protocolPace( Segment *segment );
+void protocolBlockFrame( Segment *segment, const uint32_t *data, uint8_t length );
+void protocolBlockSeal( Segment *segment, uint8_t streams );
+uint8_t protocolBlockCollect( Segment *segment );
+uint8_t protocolWindowPassed( Segment *segment );
+uint8_t protocolBlockResult( Segment *segment, uint16_t *unchanged, uint16_t *staged );
+uint8_t protocolBlockLost( Segment *segment, uint8_t *stream, uint8_t *sector );
+void protocolReset( Segment *segment );
+uint8_t protocolResume( Segment *segment, uint8_t stream, uint32_t image, uint8_t blocks, uint8_t base, uint8_t shift, uint8_t *missing );
+void protocolSlots( Segment *segment );
+uint16_t protocolCommit( Segment *segment, uint8_t stream, uint16_t version );
+uint16_t protocolRollback( Segment *segment, uint8_t stream );
+void protocolDigest( Segment *segment, uint32_t address, uint32_t length );
+void protocolProfile( Segment *segment, uint16_t first, ProfileSummary *summary );
 
 #endif
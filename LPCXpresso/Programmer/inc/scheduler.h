@@ -0,0 +1,41 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * A run to completion scheduler for the events of the programmer.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#ifndef SCHEDULER_H__
+#define SCHEDULER_H__
+
+/**
+ * The events a task can subscribe to.
+ */
+typedef enum {
+	EVENT_UART_RX  = 0, /** Bytes from the host are waiting */
+	EVENT_CAN_RX   = 1, /** Messages from the bus of the segment are waiting */
+	EVENT_CAN_TX   = 2, /** The transmit buffer of the segment is free */
+	EVENT_TIMER    = 3, /** The time the nodes of the segment get to answer has passed */
+	EVENT_COUNT
+} SchedulerEvent;
+
+/** The handler of an event of a segment, it runs to completion */
+typedef void (*EventHandler)( Segment *segment );
+
+void initScheduler( void );
+void schedulerSubscribe( SchedulerEvent event, Segment *segment, EventHandler handler );
+void schedulerRun( void );
+
+#endif
@@ -0,0 +1,80 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The store of blocks in the flash of the programmer.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#ifndef STORE_H__
+#define STORE_H__
+
+/** The first physical sector of the store, the programmer itself has to stay below it */
+#define STORE_FIRST_SECTOR 22
+
+/** The number of physical sectors of 32kB in the store */
+#define STORE_SECTORS      8
+
+/** The size of the page in front of the blocks that holds the header */
+#define STORE_HEADER_SIZE  4096
+
+/** The size of the pieces the store is written in */
+#define STORE_PIECE_SIZE   4096
+
+/** The space for block records in the store */
+#define STORE_SIZE         ( STORE_SECTORS * 32768 - STORE_HEADER_SIZE )
+
+/**
+ * The session of an image in the store.
+ */
+typedef struct {
+	uint32_t image;    /** The identifier of the image */
+	uint8_t  blocks;   /** The number of 4kB blocks in the image */
+	uint8_t  base;     /** The virtual sector the image is linked for */
+	uint16_t reserved;
+} StoreSession;
+
+/**
+ * The header of the store, it is written after all blocks are
+ * stored and checked so a store is either complete or absent.
+ */
+typedef struct {
+	uint32_t magic;
+	uint32_t length;   /** The size of all block records */
+	uint32_t digest;   /** The CRC-32C of all block records */
+	uint16_t blocks;   /** The number of block records */
+	uint8_t  shift;    /** The size of the blocks as a power of two */
+	uint8_t  streams;  /** The number of images */
+	StoreSession sessions[STREAM_COUNT];
+} StoreHeader;
+
+/**
+ * The record in front of the data of every block.
+ */
+typedef struct {
+	uint8_t  sector;   /** The sector of the first byte of the block */
+	uint8_t  part;     /** The part of the sector, for blocks smaller than a sector */
+	uint8_t  streams;  /** The bitmask of the image streams that contain the block */
+	uint8_t  reserved;
+	uint16_t size;     /** The size of the data that follows */
+	uint16_t reserved2;
+} StoreRecord;
+
+uint8_t storeBegin( StoreHeader *header );
+uint8_t storeWrite( uint32_t offset, uint8_t *data );
+uint8_t storeCommit( StoreHeader *header );
+const StoreHeader *storeHeader( void );
+uint8_t storeReplay( Segment *segments, uint16_t *sent, uint16_t *failed, uint32_t *unchanged );
+
+#endif
@@ -0,0 +1,46 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The transfer of blocks from the host to the nodes.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#ifndef TRANSFER_H__
+#define TRANSFER_H__
+
+/** The largest piece of a block that is received from the host at once */
+#define PIECE_SIZE 4096
+
+/** The number of pieces that can be buffered */
+#define PIECE_COUNT 2
+
+/** The number of blocks that can be queued, received but not confirmed */
+#define BLOCK_QUEUE_SIZE 4
+
+/** The byte the host gets for every free piece, it may send one more piece */
+#define TRANSFER_CREDIT 0x05
+
+/** The byte the host gets instead of the results if the transfer is aborted */
+#define TRANSFER_ERROR 0x07
+
+/** The byte the host gets before the result of a block if a node lost blocks it reported as pending */
+#define TRANSFER_LOST 0x08
+
+void transferStart( Segment *segmentList, uint16_t blocks );
+uint8_t transferActive( void );
+void transferHost( void );
+uint32_t *transferPiece( void );
+
+#endif
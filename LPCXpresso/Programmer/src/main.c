@@ -12,6 +12,10 @@
  * 1 node in the network should run this software to update
  * all other nodes in the network.
  *
+ * The programmer serves a segment on both CAN controllers, the
+ * bus of CAN2 and the bus of CAN1. The host sees one list of nodes,
+ * the nodes of the first segment followed by the nodes of the second.
+ *
  * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
  */
 
@@ -19,13 +23,26 @@
 #include "protocol.h"
 #include "timer.h"
 #include "host.h"
+#include "store.h"
+#include "scheduler.h"
+#include "transfer.h"
+
+#include <cr_section_macros.h>
 
 static void error( uint8_t errorCode );
+static void hostCommand( Segment *segment );
+static uint16_t totalNodes( void );
+static Segment *findNode( uint16_t *address );
+
+/**
+ * The segments, the first is on the bus of the bootloader
+ */
+static Segment segments[SEGMENT_COUNT];
 
 /**
- * The list of nodes
+ * The lists of nodes of the segments, they are too large for the main RAM bank
  */
-nodelist list;
+__BSS(RAM2) nodelist lists[SEGMENT_COUNT];
 
 extern uint8_t _binary_userapplication_bin_start;
 extern uint8_t _binary_userapplication_bin_end;
@@ -33,59 +50,18 @@ extern uint8_t _binary_userapplication_bin_size;
 
 int main( void ) {
 
+	// The time base counts microseconds of the core clock
+	SystemCoreClockUpdate();
 	initHost();
 	initProtocol();
-	SystemCoreClockUpdate();
+	initSegment( &segments[0], 0, CAN_BUS_2, TIMER_0, TIMER_1, &lists[0] );
+	initSegment( &segments[1], 1, CAN_BUS_1, TIMER_2, TIMER_3, &lists[1] );
 
-	for( ;; ) {
-		uint8_t command = hostListen();
-		switch ( command ) {
-		case 0x01: // Scan network
-			hostSendResponse( command ); // Send response back to host
-			protocolDiscover( &list );   // Scan network
-			hostSendData( (uint8_t *)(&(list.numNodes)), sizeof(list.numNodes) ); // Send number of responding nodes
-			hostSendData( (uint8_t *)(&(list.ids)), sizeof(list.ids[0]) * list.numNodes ); // Send IDs of all responding nodes
-			hostSendResponse( command ); // Send response back to host to mark end of data
-			if ( hostListen() != command ) { // Host returns response to confirm success on data transaction
-				// TODO: Go to error state
-				error( command );
-			}
-			break;
-		case 0x02: // Program network
-			hostSendResponse( command ); // Send response back to host
-			uint32_t applicationSize = hostListen32();
-			uint8_t blocksNeeded = ( applicationSize / 4096 ) + 1;
-			uint8_t blockReceived[4096];
-			uint8_t writingSuccess;
-
-			// TODO: supply list of nodes to be flashed
-
-			int i;
-			for ( i=0; i<blocksNeeded; i++ ) {
-				uint16_t blockSize = ( (i+1) == blocksNeeded ) ? applicationSize % 4096 : 4096;
-				hostReceiveData( blockReceived, blockSize );
-
-				if ( hostListen() != 0x03 ) {
-					// TODO: Go to error state
-					error( 0x03 );
-					//return 1;
-				}
-
-				writingSuccess = protocolProgram( &list, blockReceived, blockReceived+blockSize, i ); // Program nodes through CAN
-				hostSendResponse( writingSuccess );  // Send result of programming of block
-				hostSendResponse( 0x03 );
-
-			}
-			if ( hostListen() != 0x04 ) {
-				// TODO: Go to error state
-				error( 0x04 );
-				//return 1;
-			}
-			hostSendResponse( 0x04 );
-
-			break;
-		}
-	}
+	// The commands of the host run to completion, except for
+	// programming, which runs on the events of the UART and the bus
+	initScheduler();
+	schedulerSubscribe( EVENT_UART_RX, 0, hostCommand );
+	schedulerRun();
 
 	/*SystemCoreClockUpdate();
 
@@ -101,6 +77,294 @@ int main( void ) {
 	return 0;
 }
 
+/**
+ * The number of nodes on all segments.
+ */
+static uint16_t totalNodes( void ) {
+	uint16_t total = 0;
+	uint8_t s;
+	for ( s=0; s<SEGMENT_COUNT; s++ ) {
+		total += segments[s].list->numNodes;
+	}
+	return total;
+}
+
+/**
+ * Find the segment of a node in the list of the host.
+ *
+ * @param[in,out] address The index of the node in the list of the
+ *                        host, it becomes the short address on the segment.
+ * @return The segment of the node, 0 if there is no such node.
+ */
+static Segment *findNode( uint16_t *address ) {
+	uint8_t s;
+	for ( s=0; s<SEGMENT_COUNT; s++ ) {
+		if ( *address < segments[s].list->numNodes ) {
+			return &segments[s];
+		}
+		*address -= segments[s].list->numNodes;
+	}
+	return 0;
+}
+
+/**
+ * Handle the next command of the host.
+ *
+ * @param[in] segment Always 0, the host is not on a segment.
+ */
+static void hostCommand( Segment *segment ) {
+	(void)segment;
+
+	if ( transferActive() ) {
+		transferHost();
+		return;
+	}
+
+	uint32_t *piece = transferPiece();
+	uint16_t total;
+	uint8_t s;
+	uint8_t command = hostListen();
+	switch ( command ) {
+	case 0x01: // Scan network
+		hostSendResponse( command ); // Send response back to host
+		{
+			uint8_t complete = 1;
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				if ( !protocolDiscover( &segments[s] ) ) { // Scan the network of every segment
+					complete = 0;
+				}
+			}
+			total = totalNodes();
+			hostSendData( (uint8_t *)&total, sizeof(total) ); // Send number of responding nodes
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				nodelist *list = segments[s].list;
+				hostSendData( (uint8_t *)(&(list->serials)), sizeof(list->serials[0]) * list->numNodes ); // Send serials of all responding nodes, in order of short address
+			}
+			hostSendResponse( complete ); // Send if every node fit in the list of its segment
+		}
+		hostSendResponse( command ); // Send response back to host to mark end of data
+		if ( hostListen() != command ) { // Host returns response to confirm success on data transaction
+			// TODO: Go to error state
+			error( command );
+		}
+		break;
+	case 0x02: // Program network
+		hostSendResponse( command ); // Send response back to host
+		// The host interleaves the blocks of all images, they
+		// are relayed to all segments while the host sends the next ones
+		transferStart( segments, hostListen16() );
+		break;
+	case 0x05: // Assign image streams to nodes
+		hostSendResponse( command ); // Send response back to host
+		{
+			uint16_t assignments = hostListen16();
+
+			// Nodes that are not mentioned get the first image
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				nodelist *list = segments[s].list;
+				uint16_t j;
+				for( j=0; j<list->numNodes; j++ ) {
+					list->streams[j] = 0;
+				}
+			}
+
+			for( ; assignments>0; assignments-- ) {
+				uint16_t address = hostListen16();
+				uint8_t stream   = hostListen();
+				Segment *owner   = findNode( &address );
+				if( owner && stream < STREAM_COUNT )
+					owner->list->streams[address] = stream;
+			}
+		}
+		hostSendResponse( command ); // Mark the end of the assignments
+		break;
+	case 0x06: // Start a session and query what can be resumed
+		hostSendResponse( command ); // Send response back to host
+		{
+			uint8_t stream = hostListen();
+			uint32_t image = hostListen32();
+			uint8_t blocks = hostListen();
+			uint8_t base   = hostListen();
+			uint8_t shift  = hostListen();
+			uint8_t missing[RESUME_BITMAP_SIZE];
+			uint8_t agreed = shift;
+			uint8_t i;
+			for ( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+				missing[i] = 0;
+			}
+
+			// A block is missing if a node on any segment needs it
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				uint8_t segmentMissing[RESUME_BITMAP_SIZE];
+				uint8_t segmentShift = protocolResume( &segments[s], stream, image, blocks, base, shift, segmentMissing );
+				if ( segmentShift < agreed ) {
+					agreed = segmentShift;
+				}
+				for ( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+					missing[i] |= segmentMissing[i];
+				}
+			}
+			hostSendData( missing, RESUME_BITMAP_SIZE ); // Send the blocks the nodes still need
+			hostSendResponse( agreed ); // Send the block size the nodes agreed to
+		}
+		hostSendResponse( command ); // Mark the end of the bitmap
+		break;
+	case 0x07: // Query the application slot of every node
+		hostSendResponse( command ); // Send response back to host
+		for ( s=0; s<SEGMENT_COUNT; s++ ) {
+			protocolSlots( &segments[s] );
+		}
+		total = totalNodes();
+		hostSendData( (uint8_t *)&total, sizeof(total) ); // Send number of nodes
+		for ( s=0; s<SEGMENT_COUNT; s++ ) {
+			hostSendData( segments[s].list->slots, segments[s].list->numNodes ); // Send the slot of all nodes, in order of short address
+		}
+		hostSendResponse( command ); // Mark the end of the slots
+		break;
+	case 0x08: // Commit the image of a stream
+		hostSendResponse( command ); // Send response back to host
+		{
+			uint8_t stream   = hostListen();
+			uint16_t version = hostListen16();
+			uint16_t nodes   = 0;
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				nodes += protocolCommit( &segments[s], stream, version );
+			}
+			hostSendData( (uint8_t *)&nodes, sizeof(nodes) ); // Send the number of committed nodes
+		}
+		hostSendResponse( command ); // Mark the end of the commit
+		break;
+	case 0x09: // Roll the nodes of a stream back
+		hostSendResponse( command ); // Send response back to host
+		{
+			uint8_t stream = hostListen();
+			uint16_t nodes = 0;
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				nodes += protocolRollback( &segments[s], stream );
+			}
+			hostSendData( (uint8_t *)&nodes, sizeof(nodes) ); // Send the number of nodes that rolled back
+		}
+		hostSendResponse( command ); // Mark the end of the rollback
+		break;
+	case 0x0B: // Ask every node for the digest of a region of its flash
+		hostSendResponse( command ); // Send response back to host
+		{
+			uint32_t address = hostListen32();
+			uint32_t length  = hostListen32();
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				protocolDigest( &segments[s], address, length );
+			}
+		}
+		total = totalNodes();
+		hostSendData( (uint8_t *)&total, sizeof(total) ); // Send number of nodes
+		for ( s=0; s<SEGMENT_COUNT; s++ ) {
+			nodelist *list = segments[s].list;
+			hostSendData( (uint8_t *)list->digests, sizeof(list->digests[0]) * list->numNodes ); // Send the digest of all nodes, in order of short address
+		}
+		for ( s=0; s<SEGMENT_COUNT; s++ ) {
+			hostSendData( segments[s].list->digestStates, segments[s].list->numNodes ); // Send which nodes answered
+		}
+		hostSendResponse( command ); // Mark the end of the digests
+		break;
+	case 0x0C: // Store the blocks of all images in our own flash
+		hostSendResponse( command ); // Send response back to host
+		{
+			StoreHeader header;
+			header.streams = hostListen();
+			// Read every record so the UART stays in step, storeBegin
+			// refuses a header with more streams than we can keep
+			for ( s=0; s<header.streams; s++ ) {
+				uint32_t image  = hostListen32();
+				uint8_t  blocks = hostListen();
+				uint8_t  base   = hostListen();
+				if ( s < STREAM_COUNT ) {
+					header.sessions[s].image    = image;
+					header.sessions[s].blocks   = blocks;
+					header.sessions[s].base     = base;
+					header.sessions[s].reserved = 0xFFFF;
+				}
+			}
+			header.shift  = hostListen();
+			header.blocks = hostListen16();
+			header.length = hostListen32();
+			header.digest = hostListen32();
+
+			// The UART is not buffered, so the host waits for the erase
+			// and for every piece to be written before sending the next
+			uint8_t storeSuccess = storeBegin( &header );
+			hostSendResponse( storeSuccess );
+			uint32_t offset;
+			for ( offset=0; storeSuccess && offset<header.length; offset+=STORE_PIECE_SIZE ) {
+				uint32_t length = header.length - offset;
+				if ( length > STORE_PIECE_SIZE ) {
+					length = STORE_PIECE_SIZE;
+				}
+				hostReceiveData( (uint8_t *)piece, length );
+				while ( length < STORE_PIECE_SIZE ) {
+					((uint8_t *)piece)[length++] = 0xFF;
+				}
+				storeSuccess = storeWrite( offset, (uint8_t *)piece );
+				hostSendResponse( storeSuccess );
+			}
+
+			if ( storeSuccess ) {
+				storeSuccess = storeCommit( &header ); // Check the digest and complete the store
+			}
+			hostSendResponse( storeSuccess );
+		}
+		hostSendResponse( command ); // Mark the end of the upload
+		break;
+	case 0x0D: // Send the stored blocks to the nodes
+		hostSendResponse( command ); // Send response back to host
+		{
+			uint16_t sent, failed;
+			uint32_t nodesUnchanged;
+			uint8_t replaySuccess = storeReplay( segments, &sent, &failed, &nodesUnchanged );
+			hostSendResponse( replaySuccess );
+			hostSendData( (uint8_t *)&sent, sizeof(sent) ); // Send the number of blocks all nodes confirmed
+			hostSendData( (uint8_t *)&failed, sizeof(failed) ); // Send the number of blocks that failed
+			hostSendData( (uint8_t *)&nodesUnchanged, sizeof(nodesUnchanged) ); // Send the number of blocks nodes already had
+		}
+		hostSendResponse( command ); // Mark the end of the replay
+		break;
+	case 0x0E: // Send the programming statistics of every node
+		hostSendResponse( command ); // Send response back to host
+		total = totalNodes();
+		hostSendData( (uint8_t *)&total, sizeof(total) ); // Send number of nodes
+		for ( s=0; s<SEGMENT_COUNT; s++ ) {
+			hostSendData( (uint8_t *)segments[s].stats, sizeof(NodeStats) * segments[s].list->numNodes ); // Send the statistics, in order of short address
+		}
+		hostSendResponse( command ); // Mark the end of the statistics
+		break;
+	case 0x0F: // Send the profile of the nodes, summed over all nodes
+		hostSendResponse( command ); // Send response back to host
+		{
+			ProfileSummary summary[PROFILE_COUNT];
+			uint8_t *bytes = (uint8_t *)summary;
+			uint16_t i;
+			for ( i=0; i<sizeof(summary); i++ ) {
+				bytes[i] = 0;
+			}
+
+			uint16_t first = 0;
+			for ( s=0; s<SEGMENT_COUNT; s++ ) {
+				protocolProfile( &segments[s], first, summary );
+				first += segments[s].list->numNodes;
+			}
+			hostSendData( (uint8_t *)summary, sizeof(summary) ); // Send the profile of every phase
+		}
+		hostSendResponse( command ); // Mark the end of the profile
+		break;
+	case 0x0A: // Reset the network, the nodes start their application
+		hostSendResponse( command ); // Send response back to host
+		for ( s=0; s<SEGMENT_COUNT; s++ ) {
+			protocolReset( &segments[s] );
+		}
+		break;
+	}
+
+}
+
 static void error( uint8_t errorCode ) {
 	hostSendResponse( ++errorCode ); // TODO: specify specific error codes
 }
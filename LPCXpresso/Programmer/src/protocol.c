@@ -16,200 +16,979 @@
 #include <stdint.h>
 
 #include "protocol.h"
-#include "can.h"
-#include "timer.h"
 #include "hash.h"
 
-/** The temporary message object */
-static CanMessage msg;
+static void selectNodes( Segment *segment );
+static uint8_t memoryEqual( uint8_t *a, uint8_t *b, uint8_t length );
+static void memoryCopy( uint8_t *destination, uint8_t *source, uint8_t length );
+static void assignAddress( Segment *segment, uint16_t address );
+static void handOutAddress( Segment *segment, uint16_t address );
+static uint16_t collectResults( Segment *segment, uint8_t stream );
 
-/** The temporary block object */
-static DataBlock block;
+/**
+ * Compare two small pieces of memory.
+ * @return 1 if the memory is equal, 0 otherwise.
+ */
+static uint8_t memoryEqual( uint8_t *a, uint8_t *b, uint8_t length ) {
+	uint8_t i;
+	for( i=0; i<length; i++ ) {
+		if( a[i] != b[i] )
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Copy a small piece of memory.
+ */
+static void memoryCopy( uint8_t *destination, uint8_t *source, uint8_t length ) {
+	uint8_t i;
+	for( i=0; i<length; i++ ) {
+		destination[i] = source[i];
+	}
+}
 
-/** Are the nodes to be reprogrammed already selected */
-static uint8_t selected = 0;
+/**
+ * Count the nodes that are assigned to one of the given streams.
+ * @param list The list of nodes.
+ * @param streams The bitmask of streams.
+ * @return The number of nodes in the streams.
+ */
+static uint16_t countNodes( nodelist *list, uint8_t streams ) {
+	uint16_t count = 0;
+	uint16_t i;
+	for( i=0; i<list->numNodes; ++i ) {
+		if( streams & (1<<list->streams[i]) )
+			++count;
+	}
+	return count;
+}
 
-static void selectNodes( nodelist *list );
+/**
+ * Make the gap between data frames larger, a node that
+ * lost messages makes it grow faster than one that only
+ * has a full buffer.
+ *
+ * @param[in] segment The segment of the node.
+ * @param[in] lost If the node lost messages.
+ */
+static void slowDown( Segment *segment, uint8_t lost ) {
+	uint32_t gap = lost ? segment->frameGap * 2 + PACE_STEP_US : segment->frameGap + PACE_STEP_US;
+	segment->frameGap   = gap > PACE_MAX_US ? PACE_MAX_US : gap;
+	segment->slowedDown = 1;
+}
 
 /**
- * Write 4kB of data to the nodes.
- * @param list The list of nodes that the
- *             block should be written to
- * @param block The block of data to write.
- * @return If the writing was succesfull
+ * Handle the request of a node to slow down, it sends its
+ * short address, its number of buffered messages and the
+ * number of messages it lost.
+ *
+ * @param[in] segment The segment of the node.
+ * @param[in] report The message of the node.
  */
-static uint8_t writeBlock( nodelist *list, DataBlock *block ) {
+static void handlePace( Segment *segment, CanMessage *report ) {
+	uint16_t address = report->data[0] | (report->data[1]<<8);
+	if( address >= MAX_NODES )
+		return;
 
-	// Send the sector where the following 4kB of data
-	// should be put
-	msg.id      = 0x104;
-	msg.length  = 1;
-	msg.data[0] = block->sector;
-	canSend( &msg );
+	NodeStats *node = &segment->stats[address];
+	slowDown( segment, report->data[3] > node->overruns );
+	node->overruns = report->data[3];
+	if( node->slowDowns < 0xFFFF )
+		++node->slowDowns;
+}
 
-	// Send the 4kB of data
-	uint8_t *index = block->data;
-	msg.id         = 0x105;
-	msg.length     = 8;
-	initHash();
-	{
-		uint16_t i;
-		for( i=0; i<512; i++ ) {
-			uint8_t j;
-			for( j=0; j<8; j++ ) {
-				msg.data[j] = *(index);
-				++index;
-			}
-			canSend( &msg );
-			hashUpdate(msg.data);
+/**
+ * Start the time the nodes get to answer.
+ *
+ * @param[in] segment The segment of the nodes.
+ * @param[in] milliSeconds The time in milliseconds.
+ */
+static void windowStart( Segment *segment, uint32_t milliSeconds ) {
+	timerStart( segment->windowTimer, milliSeconds * 1000 );
+}
+
+/**
+ * Return if the time the nodes of a segment get to answer has passed.
+ *
+ * @param[in] segment The segment of the nodes.
+ */
+uint8_t protocolWindowPassed( Segment *segment ) {
+	return timerDone( segment->windowTimer );
+}
+
+/**
+ * Return if the next frame of a block may be sent, the transmit
+ * buffer is free and the gap after the last frame has passed.
+ *
+ * @param[in] segment The segment the block is sent on.
+ */
+uint8_t protocolFrameDue( Segment *segment ) {
+	if( !canBusTransmitReady( segment->bus ) )
+		return 0;
+
+	// The gap starts when the last frame is on the bus
+	if( segment->gapPending ) {
+		segment->gapPending = 0;
+		timerStart( segment->paceTimer, segment->frameGap );
+		return 0;
+	}
+	return timerDone( segment->paceTimer );
+}
+
+/**
+ * Take the requests of the nodes to slow down that were
+ * received while a block is sent, without waiting.
+ *
+ * @param[in] segment The segment the block is sent on.
+ */
+void protocolPace( Segment *segment ) {
+	CanMessage *msg = &segment->msg;
+	while( canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED ) {
+		if( msg->id == 0x0F0 )
+			handlePace( segment, msg );
+	}
+}
+
+/**
+ * Announce a block to the nodes and start its hash.
+ *
+ * @param[in] segment The segment of the nodes to program.
+ * @param[in] sector The sector of the first byte of the block.
+ * @param[in] part The part of the sector, for blocks smaller than a sector.
+ * @param[in] streams The bitmask of image streams that share this block.
+ */
+void protocolBlockBegin( Segment *segment, uint8_t sector, uint8_t part, uint8_t streams ) {
+
+	// Programming 0 nodes is really fast!
+	segment->sending = segment->list->numNodes > 0;
+	if( !segment->sending )
+		return;
+
+	// Select nodes to be programmed if not yet selected
+	if ( !segment->selected )
+		selectNodes( segment );
+
+	// Give the nodes that fell behind time to catch up
+	while( !protocolFrameDue( segment ) );
+
+	// Send the sector where the following data should be
+	// put and the streams that should accept it
+	CanMessage *msg = &segment->msg;
+	msg->id      = 0x104;
+	msg->length  = 3;
+	msg->data[0] = sector;
+	msg->data[1] = streams;
+	msg->data[2] = part;
+	canBusSend( segment->bus, msg );
+
+	// Every segment hashes its own frames, the
+	// segments are not at the same frame
+	segment->blockHash   = 0;
+	segment->blockFrames = 0;
+
+}
+
+/**
+ * Queue one frame of the data of the block and return without
+ * waiting, the transmit buffer has to be free. A frame shorter
+ * than 8 bytes is padded.
+ *
+ * The frame is loaded straight from the data, so it
+ * has to be word aligned.
+ *
+ * @param[in] segment The segment the block is sent on.
+ * @param[in] data The data of the frame.
+ * @param[in] length The size of the data, up to 8 bytes.
+ */
+void protocolBlockFrame( Segment *segment, const uint32_t *data, uint8_t length ) {
+
+	if( !segment->sending )
+		return;
+
+	if( length < 8 ) {
+		static uint32_t last[2];
+		last[0] = 0;
+		last[1] = 0;
+		uint8_t i;
+		for( i=0; i<length; i++ ) {
+			((uint8_t *)last)[i] = ((const uint8_t *)data)[i];
+		}
+		data = last;
+	}
+
+	canBusQueueFrame( segment->bus, 0x105, data );
+	segment->blockHash = hashData( segment->blockHash, (const uint8_t *)data, 8 );
+	++segment->blockFrames;
+	segment->gapPending = segment->frameGap > 0;
+
+}
+
+/**
+ * Add the answer of a node to a block to its statistics.
+ *
+ * @param[in] segment The segment of the node.
+ * @param[in,out] node The statistics of the node.
+ * @param[in] answer The answer of the node.
+ */
+static void recordAnswer( Segment *segment, NodeStats *node, CanMessage *answer ) {
+
+	// The time the answer was received, not the time it is handled
+	uint32_t latency = ( answer->timestamp - segment->sealedAt ) / 1000;
+	node->latencyTotal += latency;
+	if( latency > node->latencyMax )
+		node->latencyMax = latency;
+	if( node->answers < 0xFFFF )
+		++node->answers;
+
+	if( !(answer->data[2] & (1<<0)) && node->crcFailures < 0xFF )
+		++node->crcFailures;
+	else if( !(answer->data[2] & (1<<1)) && node->flashFailures < 0xFF )
+		++node->flashFailures;
+
+	// Older nodes only send the result
+	if( answer->length >= 6 ) {
+		node->rxErrors = answer->data[3];
+		node->txErrors = answer->data[4];
+		if( answer->data[5] > node->overruns )
+			slowDown( segment, 1 );
+		node->overruns = answer->data[5];
+	}
+
+}
+
+/**
+ * Send the hash of the block and start to collect the
+ * results of the nodes, the nodes get 1 second.
+ *
+ * @param[in] segment The segment the block was written to.
+ * @param[in] streams The bitmask of the image streams
+ *                    this block belongs to.
+ */
+void protocolBlockSeal( Segment *segment, uint8_t streams ) {
+
+	segment->expected       = 0;
+	segment->answers        = 0;
+	segment->correct        = 0;
+	segment->alreadyWritten = 0;
+	segment->staged         = 0;
+	segment->lostBlocks     = 0;
+	segment->sealedStreams  = streams;
+	segment->gapPending     = 0;
+	if( !segment->sending )
+		return;
+
+	// Send the hash of the data, the CRC of
+	// the block followed by the number of frames
+	CanMessage *msg = &segment->msg;
+	uint32_t *hash  = (uint32_t *)msg->data;
+	msg->id     = 0x106;
+	msg->length = 8;
+	hash[0] = segment->blockHash;
+	hash[1] = segment->blockFrames;
+	canBusSend( segment->bus, msg );
+	segment->sealedAt = timerNow();
+
+	uint16_t i;
+	for( i=0; i<MAX_NODES/8; i++ ) {
+		segment->answered[i] = 0;
+	}
+	segment->expected = countNodes( segment->list, streams );
+	windowStart( segment, 1000 );
+
+}
+
+/**
+ * Take the results of the nodes that were received, without waiting.
+ *
+ * @param[in] segment The segment the block was written to.
+ * @return 1 if every node has answered, 0 otherwise.
+ */
+uint8_t protocolBlockCollect( Segment *segment ) {
+
+	// Check if we have received a message and if that
+	// message is the answer of a node. Every node is only
+	// counted once, the block is confirmed if the CRC is
+	// correct and the block is written or pending.
+	CanMessage *msg = &segment->msg;
+	while( segment->answers < segment->expected && canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED ) {
+		if( msg->id == 0x0F0 )
+			handlePace( segment, msg );
+		if( msg->id != 0x107 )
+			continue;
+
+		uint16_t address = msg->data[0] | (msg->data[1]<<8);
+		if( address >= segment->list->numNodes || (segment->answered[address/8] & (1<<(address%8))) )
+			continue;
+
+		segment->answered[address/8] |= (1<<(address%8));
+		++segment->answers;
+		recordAnswer( segment, &segment->stats[address], msg );
+
+		if( (msg->data[2] & 0x3) == 0x3 ) {
+			++segment->correct;
+
+			// The node did not have to write the block
+			if( msg->data[2] & (1<<2) )
+				++segment->alreadyWritten;
+		}
+		else if( (msg->data[2] & 0x9) == 0x9 ) {
+			// The node writes the block with the rest of its sector
+			++segment->correct;
+			++segment->staged;
+		}
+
+		// Blocks the node reported as pending before are lost
+		if( msg->length >= 8 && msg->data[7] && !segment->lostBlocks ) {
+			segment->lostStream = segment->list->streams[address];
+			segment->lostSector = msg->data[6];
+			segment->lostBlocks = msg->data[7];
 		}
 	}
 
-	// Send the hash of the data
-	msg.id      = 0x106;
-	msg.length  = 8;
-	hashCopy( (uint32_t *)msg.data );
-	canSend( &msg );
+	return segment->answers == segment->expected;
+}
+
+/**
+ * The result of the block after collecting.
+ *
+ * @param[in] segment The segment the block was written to.
+ * @param[out] unchanged The number of nodes that already had the block.
+ * @param[out] staged The number of nodes that did not write the block yet.
+ * @return If every node confirmed the block.
+ */
+uint8_t protocolBlockResult( Segment *segment, uint16_t *unchanged, uint16_t *staged ) {
 
-	// TODO Check that all nodes confirmed their CRC and not just the number of nodes
-	// TODO Retry upto 3 times if CRC has failed
-	// Give all the nodes 1 second to respond
-	timerSet( 1000 );
-	uint8_t correct = 0;
-	while( !timerPassed() ) {
-		// Check if we have received a message, and
-		// if that message is a CRC confirm message
-		// and if that confirm is a confirm correct
-		// message.
-		if( canReceive(&msg) == MESSAGE_RECEIVED &&
-				msg.id       == 0x107 &&
-				msg.data[4]  == 0x3 ) {
-			++correct;
+	// The nodes that did not answer in time
+	if( segment->answers < segment->expected ) {
+		nodelist *list = segment->list;
+		uint16_t i;
+		for( i=0; i<list->numNodes; i++ ) {
+			if( (segment->sealedStreams & (1<<list->streams[i])) &&
+					!(segment->answered[i/8] & (1<<(i%8))) &&
+					segment->stats[i].timeouts < 0xFF )
+				++segment->stats[i].timeouts;
 		}
 	}
 
-	return correct == list->numNodes;
+	// Speed up again after a block no node fell behind on,
+	// otherwise give the nodes time to empty their buffers
+	if( segment->slowedDown ) {
+		segment->slowedDown = 0;
+		timerStart( segment->paceTimer, (uint32_t)segment->frameGap * PACE_DRAIN_FRAMES );
+	} else if( segment->correct == segment->expected ) {
+		segment->frameGap = segment->frameGap * 7 / 8;
+	}
+
+	*unchanged = segment->alreadyWritten;
+	*staged    = segment->staged;
+	return segment->correct == segment->expected;
+}
+
+/**
+ * The blocks a node lost while the block was collected. The node
+ * reported them as pending earlier, but could not write their sector.
+ *
+ * @param[in] segment The segment the block was written to.
+ * @param[out] stream The stream of the node.
+ * @param[out] sector The virtual sector in the image of the first lost block.
+ * @return The bitmap of the lost blocks from sector on, 0 if no node lost any.
+ */
+uint8_t protocolBlockLost( Segment *segment, uint8_t *stream, uint8_t *sector ) {
+	*stream = segment->lostStream;
+	*sector = segment->lostSector;
+	return segment->lostBlocks;
 }
 
 /**
  * Initialize the protocol for the programmer.
  */
 void initProtocol( void ) {
-	initCan();
 	initTimer();
 }
 
+/**
+ * Initialize a segment and its controller.
+ *
+ * @param[out] segment The segment.
+ * @param[in] index The index of the segment.
+ * @param[in] controller The CAN controller of the segment.
+ * @param[in] windowTimer The timer for the time the nodes get to answer.
+ * @param[in] paceTimer The timer for the gap between data frames.
+ * @param[in] list The list for the nodes on the segment.
+ */
+void initSegment( Segment *segment, uint8_t index, CanController controller, Timer windowTimer, Timer paceTimer, nodelist *list ) {
+	segment->index       = index;
+	segment->bus         = canBus( controller );
+	segment->windowTimer = windowTimer;
+	segment->paceTimer   = paceTimer;
+	segment->list        = list;
+	segment->enabled     = 0;
+	segment->sending     = 0;
+	segment->selected    = 0;
+	segment->frameGap    = 0;
+	segment->gapPending  = 0;
+	segment->slowedDown  = 0;
+	list->numNodes       = 0;
+	initCanBus( segment->bus );
+}
+
 /**
  * Discover what nodes are available in the network.
  *
- * @param[out] The list of discovered nodes.
+ * @param[in,out] segment The segment, its list is filled with the discovered nodes.
+ * @return 1 if every node fit in the list, 0 if nodes were left out
+ *         because the list holds MAX_NODES.
  */
-void protocolDiscover( nodelist *list ) {
+uint8_t protocolDiscover( Segment *segment ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
+	uint8_t complete = 1;
+
 	// Try to get the other nodes in the network in
 	// bootloader mode by spamming 0x100 messages for
 	// 2 seconds.
-	timerSet( 2000 );
-	msg.id     = 0x100;
-	msg.length = 0;
-	while( !timerPassed() ) {
-		canSend( &msg );
+	windowStart( segment, 2000 );
+	msg->id     = 0x100;
+	msg->length = 0;
+	segment->enabled = 0;
+	while( !protocolWindowPassed( segment ) ) {
+		if( canBusSend( segment->bus, msg ) )
+			segment->enabled = 1;
 	}
 
+	// No controller acknowledged a single frame, the
+	// segment is not connected or has no nodes
+	list->numNodes = 0;
+	if( !segment->enabled )
+		return 1;
+
 	// Clear all recieved message untill now
-	while( canReceive(&msg) == MESSAGE_RECEIVED );
+	while( canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED );
 
 	// Ask all the nodes in the network kindly
-	// to identify themselves
-	msg.id     = 0x101;
-	msg.length = 0;
-	canSend( &msg );
+	// to identify themselves, they answer with
+	// the first half of their serial
+	msg->id     = 0x101;
+	msg->length = 0;
+	canBusSend( segment->bus, msg );
 
-	// Wait 1 second to give every node the
+	// Wait 200 milliseconds to give every node the
 	// change to register at the programmer
-	timerSet( 200 );
-	while( !timerPassed() ) {
-		if( canReceive( &msg ) == MESSAGE_RECEIVED && msg.id == 0x102 ) {
-			// Get the ID of the node that is registering
-			uint32_t id = (msg.data[0]<<24) |
-			              (msg.data[1]<<16) |
-			              (msg.data[2]<<8 ) |
-			              (msg.data[3]<<0 );
-
-			// And save the ID
-			list->ids[list->numNodes] = id;
+	{
+		uint8_t *bytes = (uint8_t *)segment->stats;
+		uint32_t i;
+		for( i=0; i<sizeof(segment->stats); i++ ) {
+			bytes[i] = 0;
+		}
+	}
+	windowStart( segment, 200 );
+	while( !protocolWindowPassed( segment ) ) {
+		if( canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED && msg->id == 0x102 ) {
+			// Nodes with the same first half send the same
+			// message, only save it once
+			uint16_t i;
+			for( i=0; i<list->numNodes; i++ ) {
+				if( memoryEqual( list->serials[i], msg->data, 8 ) )
+					break;
+			}
+			if( i < list->numNodes )
+				continue;
+
+			// The nodes that do not fit get no address
+			if( list->numNodes >= MAX_NODES ) {
+				complete = 0;
+				continue;
+			}
+
+			// And save the first half of the serial
+			memoryCopy( list->serials[list->numNodes], msg->data, 8 );
+			list->streams[list->numNodes] = 0;
+			list->slots[list->numNodes]   = NO_SLOT;
 			++list->numNodes;
+		}
+	}
+
+	// Ask for the second half of the serial of
+	// every node, a first half can be shared by
+	// several nodes in which case we add them
+	uint16_t candidates = list->numNodes;
+	uint16_t i;
+	for( i=0; i<candidates; i++ ) {
+		msg->id     = 0x109;
+		msg->length = 8;
+		memoryCopy( msg->data, list->serials[i], 8 );
+		canBusSend( segment->bus, msg );
+
+		uint16_t first = list->numNodes;
+		uint16_t answers = 0;
+		windowStart( segment, 5 );
+		while( !protocolWindowPassed( segment ) ) {
+			if( canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED && msg->id == 0x10A ) {
+				uint16_t node = i;
+				if( answers++ ) {
+					if( list->numNodes >= MAX_NODES ) {
+						complete = 0;
+						continue;
+					}
+					node = list->numNodes++;
+					memoryCopy( list->serials[node], list->serials[i], 8 );
+					list->streams[node] = 0;
+					list->slots[node]   = NO_SLOT;
+				}
+				memoryCopy( list->serials[node]+8, msg->data, 8 );
+			}
+		}
 
-			// Detect an overflow
-			if( list->numNodes >= 512 )
-				while(1);
+		// Give every node its index in the list as short address,
+		// a node that answered alone is still armed
+		if( answers == 1 ) {
+			handOutAddress( segment, i );
+		} else if( answers > 1 ) {
+			assignAddress( segment, i );
+			uint16_t node;
+			for( node=first; node<list->numNodes; node++ ) {
+				assignAddress( segment, node );
+			}
 		}
 	}
+
+	return complete;
 }
 
 /**
- * Programs the nodes in the network with a block.
+ * Start a session for the image of a stream and find out
+ * which blocks the nodes still need.
  *
- * @param[in] list The list of nodes to program.
- * @param[in] start The start of the block to be flashed
- * @param[in] end The end of the block to be flashed
- * @param[in] sector The sector for the block to be placed in
- * @return If the writing was succesfull
+ * Nodes keep a record of the blocks they flashed for an image,
+ * so an interrupted session only needs the missing blocks. A node
+ * that can not take the block size answers with the largest block
+ * it takes, the session has to be started again with that size.
+ * @param[in] segment The segment of the nodes to program.
+ * @param[in] stream The stream of the image.
+ * @param[in] image The identifier of the image.
+ * @param[in] blocks The number of blocks in the image.
+ * @param[in] base The virtual sector the image is linked for.
+ * @param[in] shift The size of the blocks as a power of two.
+ * @param[out] missing The bitmap of blocks that at least one node
+ *                     still needs, RESUME_BITMAP_SIZE bytes.
+ * @return The block size the nodes agreed to, smaller than shift
+ *         if a node refused the session.
  */
-uint8_t protocolProgram( nodelist *list, uint8_t *start, uint8_t *end, uint8_t sector ) {
+uint8_t protocolResume( Segment *segment, uint8_t stream, uint32_t image, uint8_t blocks, uint8_t base, uint8_t shift, uint8_t *missing ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
 
-	// Programming 0 nodes is really fast!
-	if( list->numNodes == 0 )
+	uint16_t i;
+	if( !segment->enabled ) {
+		for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+			missing[i] = 0;
+		}
+		return shift;
+	}
+
+	// The nodes only answer when they are selected
+	selectNodes( segment );
+
+	// The bitmap of blocks that all nodes have, and
+	// the parts of the bitmap every node has sent
+	uint8_t done[RESUME_BITMAP_SIZE];
+	static uint8_t parts[MAX_NODES];
+	for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+		done[i] = 0xFF;
+	}
+	for( i=0; i<list->numNodes; i++ ) {
+		parts[i] = 0;
+	}
+
+	msg->id      = 0x10F;
+	msg->length  = 8;
+	msg->data[0] = stream;
+	msg->data[1] = (image>>0 ) & 0xFF;
+	msg->data[2] = (image>>8 ) & 0xFF;
+	msg->data[3] = (image>>16) & 0xFF;
+	msg->data[4] = (image>>24) & 0xFF;
+	msg->data[5] = blocks;
+	msg->data[6] = base;
+	msg->data[7] = shift;
+	canBusSend( segment->bus, msg );
+
+	// Nodes that start a new record erase a sector first, give
+	// them 1 second and then answer in the slot of their address
+	windowStart( segment, 1000 + list->numNodes * SESSION_SLOT_MS );
+	while( !protocolWindowPassed( segment ) ) {
+		if( canBusReceive( segment->bus, msg ) != MESSAGE_RECEIVED )
+			continue;
+
+		if( msg->id == 0x116 && msg->data[2] < shift ) {
+			shift = msg->data[2];
+		}
+		else if( msg->id == 0x110 && msg->data[2] < 3 ) {
+			uint16_t address = msg->data[0] | (msg->data[1]<<8);
+			if( address >= list->numNodes )
+				continue;
+
+			parts[address] |= (1<<msg->data[2]);
+			uint8_t j;
+			for( j=0; j<5; j++ ) {
+				done[msg->data[2]*5+j] &= msg->data[3+j];
+			}
+		}
+	}
+
+	// A node that did not answer completely needs everything
+	for( i=0; i<list->numNodes; i++ ) {
+		if( list->streams[i] == stream && parts[i] != 0x7 ) {
+			uint8_t j;
+			for( j=0; j<RESUME_BITMAP_SIZE; j++ ) {
+				done[j] = 0;
+			}
+		}
+	}
+
+	for( i=0; i<RESUME_BITMAP_SIZE; i++ ) {
+		missing[i] = ~done[i];
+	}
+	return shift;
+}
+
+/**
+ * Ask every node which application slot it boots.
+ *
+ * A node that does not answer is assumed to boot no slot. A node
+ * that stayed in the bootloader because its image failed the CRC
+ * check is marked, it can be programmed in any slot.
+ * @param[in,out] segment The segment, the slots of its nodes are filled in.
+ */
+void protocolSlots( Segment *segment ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
+
+	uint16_t i;
+	for( i=0; i<list->numNodes; i++ ) {
+		list->slots[i] = NO_SLOT;
+	}
+	if( !segment->enabled )
 		return;
 
-	// Select nodes to be programmed if not yet selected
-	if ( !selected )
-		selectNodes( list );
+	msg->id     = 0x114;
+	msg->length = 0;
+	canBusSend( segment->bus, msg );
+
+	windowStart( segment, 200 );
+	while( !protocolWindowPassed( segment ) ) {
+		if( canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED && msg->id == 0x115 ) {
+			uint16_t address = msg->data[0] | (msg->data[1]<<8);
+			if( address >= list->numNodes )
+				continue;
+
+			// A node that boots no slot has nothing to flag
+			list->slots[address] = msg->data[2];
+			if( msg->data[2] != NO_SLOT && msg->data[7] )
+				list->slots[address] |= SLOT_FAILED;
+		}
+	}
+}
 
-	// Make a datablock
-	block.sector = sector;
+/**
+ * Ask every node for the CRC-32C of a region of its flash.
+ *
+ * The nodes hash the region at the same time and answer one after
+ * the other in the order of their short address, so verifying the
+ * network takes a few seconds instead of sending the image again.
+ * @param[in,out] segment The segment, the digests of its nodes are filled in.
+ * @param[in] address The address of the first byte of the region.
+ * @param[in] length The size of the region.
+ */
+void protocolDigest( Segment *segment, uint32_t address, uint32_t length ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
 
 	uint16_t i;
-	uint8_t *index = start;
-	for( i=0; i<4096; i++ ) {
-		if( index < end ) {
-			block.data[i] = *index;
-			index++;
+	for( i=0; i<list->numNodes; i++ ) {
+		list->digestStates[i] = DIGEST_NONE;
+	}
+	if( !segment->enabled )
+		return;
+
+	// Give the nodes time to hash at 8kB per millisecond
+	uint16_t window = length / 8192 + 5;
+
+	msg->id      = 0x117;
+	msg->length  = 8;
+	msg->data[0] = (address>>0 ) & 0xFF;
+	msg->data[1] = (address>>8 ) & 0xFF;
+	msg->data[2] = (address>>16) & 0xFF;
+	msg->data[3] = (length>>0 ) & 0xFF;
+	msg->data[4] = (length>>8 ) & 0xFF;
+	msg->data[5] = (length>>16) & 0xFF;
+	msg->data[6] = window & 0xFF;
+	msg->data[7] = window >> 8;
+	canBusSend( segment->bus, msg );
+
+	// Stop waiting as soon as every node has answered
+	uint16_t answered = 0;
+	windowStart( segment, window + list->numNodes * DIGEST_SLOT_MS + 100 );
+	while( !protocolWindowPassed( segment ) && answered < list->numNodes ) {
+		if( canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED && msg->id == 0x118 ) {
+			uint16_t node = msg->data[0] | (msg->data[1]<<8);
+			if( node >= list->numNodes || list->digestStates[node] != DIGEST_NONE )
+				continue;
+
+			list->digests[node] = (msg->data[2]<<0 ) |
+			                      (msg->data[3]<<8 ) |
+			                      (msg->data[4]<<16) |
+			                      ((uint32_t)msg->data[5]<<24);
+			list->digestStates[node] = msg->data[6] ? DIGEST_VALID : DIGEST_REFUSED;
+			++answered;
+		}
+	}
+}
+
+/**
+ * Ask every node where its time went and add it to the profile of the fleet.
+ *
+ * The nodes answer one after the other in the order of their short
+ * address, every node sends the calls and the cycles of every phase.
+ * Nodes that are built without PROFILE do not answer.
+ * @param[in] segment The segment of the nodes.
+ * @param[in] first The index of the first node of the segment in the list of the host.
+ * @param[in,out] summary The profile of every phase, PROFILE_COUNT of them.
+ */
+void protocolProfile( Segment *segment, uint16_t first, ProfileSummary *summary ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
+
+	if( !segment->enabled )
+		return;
+
+	msg->id     = 0x119;
+	msg->length = 0;
+	canBusSend( segment->bus, msg );
+
+	// Stop waiting as soon as every node has answered
+	uint32_t expected = (uint32_t)list->numNodes * PROFILE_COUNT * 2;
+	uint32_t received = 0;
+	windowStart( segment, list->numNodes * PROFILE_SLOT_MS + 100 );
+	while( !protocolWindowPassed( segment ) && received < expected ) {
+		if( canBusReceive( segment->bus, msg ) != MESSAGE_RECEIVED || msg->id != 0x11A )
+			continue;
+
+		uint16_t node = msg->data[0] | (msg->data[1]<<8);
+		uint8_t phase = msg->data[2];
+		if( node >= list->numNodes || phase >= PROFILE_COUNT )
+			continue;
+
+		uint32_t value = (msg->data[4]<<0 ) |
+		                 (msg->data[5]<<8 ) |
+		                 (msg->data[6]<<16) |
+		                 ((uint32_t)msg->data[7]<<24);
+		ProfileSummary *entry = &summary[phase];
+		if( msg->data[3] == 0 ) {
+			entry->calls += value;
+			++entry->nodes;
 		} else {
-			block.data[i] = 0x00;
+			entry->cycles += value;
+			if( value > entry->maxCycles ) {
+				entry->maxCycles = value;
+				entry->maxNode   = first + node;
+			}
 		}
+		++received;
 	}
+}
+
+/**
+ * Let the nodes of a stream boot the image they just received.
+ *
+ * Every node checks the digest of the image before it
+ * switches to the slot, its old image stays in place.
+ * @param[in] segment The segment of the nodes.
+ * @param[in] stream The stream of the image.
+ * @param[in] version The version of the image.
+ * @return The number of nodes that committed the image.
+ */
+uint16_t protocolCommit( Segment *segment, uint8_t stream, uint16_t version ) {
+	CanMessage *msg = &segment->msg;
+
+	if( !segment->enabled )
+		return 0;
+
+	// The nodes only answer when they are selected
+	selectNodes( segment );
+
+	msg->id      = 0x111;
+	msg->length  = 3;
+	msg->data[0] = stream;
+	msg->data[1] = version & 0xFF;
+	msg->data[2] = version >> 8;
+	canBusSend( segment->bus, msg );
+
+	return collectResults( segment, stream );
+}
+
+/**
+ * Let the nodes of a stream boot their previous image again.
+ * @param[in] segment The segment of the nodes.
+ * @param[in] stream The stream of the nodes.
+ * @return The number of nodes that rolled back.
+ */
+uint16_t protocolRollback( Segment *segment, uint8_t stream ) {
+	CanMessage *msg = &segment->msg;
+
+	if( !segment->enabled )
+		return 0;
+
+	// The nodes only answer when they are selected
+	selectNodes( segment );
 
-	// Write a dataBlock to the selected nodes
-	return writeBlock( list, &block );
+	msg->id      = 0x113;
+	msg->length  = 1;
+	msg->data[0] = stream;
+	canBusSend( segment->bus, msg );
 
+	return collectResults( segment, stream );
+}
+
+/**
+ * Count the nodes of a stream that report success for a commit or rollback.
+ *
+ * A commit reads the complete image, give the
+ * nodes 1 second to answer.
+ * @param[in] segment The segment of the nodes.
+ * @param[in] stream The stream of the nodes.
+ * @return The number of nodes that reported success.
+ */
+static uint16_t collectResults( Segment *segment, uint8_t stream ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
+
+	static uint8_t answered[MAX_NODES/8];
+	uint16_t i;
+	for( i=0; i<MAX_NODES/8; i++ ) {
+		answered[i] = 0;
+	}
+
+	uint16_t expected = countNodes( list, 1<<stream );
+	uint16_t replies = 0;
+	uint16_t success = 0;
+	windowStart( segment, 1000 );
+	while( !protocolWindowPassed( segment ) && replies < expected ) {
+		if( canBusReceive( segment->bus, msg ) == MESSAGE_RECEIVED && msg->id == 0x112 ) {
+			uint16_t address = msg->data[0] | (msg->data[1]<<8);
+			if( address < list->numNodes && !(answered[address/8] & (1<<(address%8))) ) {
+				answered[address/8] |= (1<<(address%8));
+				++replies;
+				if( msg->data[2] )
+					++success;
+			}
+		}
+	}
+
+	return success;
 }
 
 /**
  * Reboot the network.
+ *
+ * @param[in] segment The segment of the nodes.
  */
-void protocolReset( void ) {
-	msg.id     = 0x108;
-	msg.length = 0;
-	canSend( &msg );
+void protocolReset( Segment *segment ) {
+	CanMessage *msg = &segment->msg;
+
+	if( !segment->enabled )
+		return;
+
+	msg->id     = 0x108;
+	msg->length = 0;
+	canBusSend( segment->bus, msg );
 }
 
 /**
  * Select all nodes that are going to be reprogrammed.
- * @param[in] list The list of nodes to program.
+ *
+ * Every select message contains a bitmap of the short
+ * addresses of the nodes that should listen to a stream.
+ * @param[in] segment The segment of the nodes to program.
  */
-static void selectNodes( nodelist *list ) {
+static void selectNodes( Segment *segment ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
 
-	msg.id     = 0x103;
-	msg.length = 4;
+	msg->id     = 0x103;
+	msg->length = 8;
 	{
-		uint16_t i;
-		for( i=0; i<list->numNodes; ++i ) {
-			msg.data[0] = ( (list->ids[i]&(0xFF<<24))>>24 );
-			msg.data[1] = ( (list->ids[i]&(0xFF<<16))>>16 );
-			msg.data[2] = ( (list->ids[i]&(0xFF<<8 ))>>8  );
-			msg.data[3] = ( (list->ids[i]&(0xFF<<0 ))>>0  );
+		uint8_t stream;
+		for( stream=0; stream<STREAM_COUNT; stream++ ) {
+			uint16_t base;
+			for( base=0; base<list->numNodes; base+=SELECT_BITMAP_SIZE ) {
+				uint8_t any = 0;
+				uint8_t bit;
+				msg->data[0] = stream;
+				msg->data[1] = base / SELECT_BITMAP_SIZE;
+				for( bit=2; bit<8; bit++ ) {
+					msg->data[bit] = 0;
+				}
+				for( bit=0; bit<SELECT_BITMAP_SIZE && base+bit<list->numNodes; bit++ ) {
+					if( list->streams[base+bit] == stream ) {
+						msg->data[2 + bit/8] |= (1<<(bit%8));
+						any = 1;
+					}
+				}
 
-			canSend( &msg );
+				// Do not send empty bitmaps
+				if( any )
+					canBusSend( segment->bus, msg );
+			}
 		}
 	}
 }
+
+/**
+ * Assign a short address to a node.
+ *
+ * The node is addressed with its full serial in two
+ * messages, the node that matches both halves takes
+ * the address from the third message.
+ * @param[in] segment The segment of the nodes.
+ * @param[in] address The index of the node in the list.
+ */
+static void assignAddress( Segment *segment, uint16_t address ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
+
+	msg->id     = 0x109; // Arm the nodes with the first half
+	msg->length = 8;
+	memoryCopy( msg->data, list->serials[address], 8 );
+	canBusSend( segment->bus, msg );
+
+	// Ignore the answer to the arm message
+	windowStart( segment, 5 );
+	while( !protocolWindowPassed( segment ) ) {
+		canBusReceive( segment->bus, msg );
+	}
+
+	handOutAddress( segment, address );
+}
+
+/**
+ * Give the armed node with the serial of a node in the list its
+ * short address, the other armed nodes are disarmed first.
+ * @param[in] segment The segment of the nodes.
+ * @param[in] address The index of the node in the list.
+ */
+static void handOutAddress( Segment *segment, uint16_t address ) {
+	nodelist *list = segment->list;
+	CanMessage *msg = &segment->msg;
+
+	msg->id     = 0x10C; // Disarm the nodes with another second half
+	msg->length = 8;
+	memoryCopy( msg->data, list->serials[address]+8, 8 );
+	canBusSend( segment->bus, msg );
+
+	msg->id      = 0x10B; // Hand out the address
+	msg->length  = 2;
+	msg->data[0] = address & 0xFF;
+	msg->data[1] = address >> 8;
+	canBusSend( segment->bus, msg );
+}
@@ -0,0 +1,145 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * A run to completion scheduler for the events of the programmer.
+ *
+ * The events of the UART have one source, its ring buffer. The other
+ * events have a source on every segment, the ring buffer and transmit
+ * buffer of its CAN controller and its answer timer. A task subscribes
+ * a handler to an event of a segment while it is interested in it, the
+ * handler runs every round the event is pending and never blocks. So
+ * the host link and the frames and answers on every bus are serviced
+ * at the same time without an RTOS.
+ *
+ * The UART and CAN receive interrupts and the match interrupt of the
+ * time base wake the processor, the transmit buffer does not. The
+ * scheduler only sleeps while no handler is subscribed to it.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "LPC17xx.h"
+
+#include "scheduler.h"
+#include "uart.h"
+
+/**
+ * A handler and the segment it is subscribed for.
+ */
+typedef struct {
+	EventHandler handler; /** The handler, 0 if none */
+	Segment *segment;     /** The source of the event */
+} Subscription;
+
+/** The subscription to every event of every segment, the UART only uses the first */
+static Subscription subscriptions[EVENT_COUNT][SEGMENT_COUNT];
+
+/**
+ * Return if an event of a segment is pending.
+ */
+static uint8_t eventPending( SchedulerEvent event, Segment *segment ) {
+	switch( event ) {
+	case EVENT_UART_RX:
+		return uartAvailable() > 0;
+	case EVENT_CAN_RX:
+		return canBusPending( segment->bus );
+	case EVENT_CAN_TX:
+		return canBusTransmitReady( segment->bus );
+	case EVENT_TIMER:
+		return protocolWindowPassed( segment );
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Return if a handler is subscribed to an event of any segment.
+ */
+static uint8_t subscribed( SchedulerEvent event ) {
+	uint8_t i;
+	for( i=0; i<SEGMENT_COUNT; i++ ) {
+		if( subscriptions[event][i].handler )
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Return if an event a handler is subscribed to is pending.
+ */
+static uint8_t anyPending( void ) {
+	uint8_t i, j;
+	for( i=0; i<EVENT_COUNT; i++ ) {
+		for( j=0; j<SEGMENT_COUNT; j++ ) {
+			Subscription *subscription = &subscriptions[i][j];
+			if( subscription->handler && eventPending( i, subscription->segment ) )
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Remove all subscriptions.
+ */
+void initScheduler( void ) {
+	uint8_t i, j;
+	for( i=0; i<EVENT_COUNT; i++ ) {
+		for( j=0; j<SEGMENT_COUNT; j++ ) {
+			subscriptions[i][j].handler = 0;
+		}
+	}
+}
+
+/**
+ * Subscribe a handler to an event of a segment, it replaces
+ * the handler that was subscribed before.
+ *
+ * @param[in] event The event.
+ * @param[in] segment The segment, 0 for the events of the UART.
+ * @param[in] handler The handler, 0 to unsubscribe.
+ */
+void schedulerSubscribe( SchedulerEvent event, Segment *segment, EventHandler handler ) {
+	Subscription *subscription = &subscriptions[event][segment ? segment->index : 0];
+	subscription->handler = handler;
+	subscription->segment = segment;
+}
+
+/**
+ * Dispatch the pending events, forever.
+ */
+void schedulerRun( void ) {
+	for( ;; ) {
+		uint8_t handled = 0;
+		uint8_t i, j;
+		for( i=0; i<EVENT_COUNT; i++ ) {
+			for( j=0; j<SEGMENT_COUNT; j++ ) {
+				// The subscription is read again, a
+				// handler can change the subscriptions
+				Subscription *subscription = &subscriptions[i][j];
+				if( subscription->handler && eventPending( i, subscription->segment ) ) {
+					subscription->handler( subscription->segment );
+					handled = 1;
+				}
+			}
+		}
+
+		// Wait for an interrupt if nothing polled is subscribed. The
+		// events are checked again with the interrupts masked, an
+		// interrupt after the check still wakes up WFI.
+		if( !handled && !subscribed( EVENT_CAN_TX ) ) {
+			__disable_irq();
+			if( !anyPending() ) {
+				__WFI();
+			}
+			__enable_irq();
+		}
+	}
+}
@@ -0,0 +1,307 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The store of blocks in the flash of the programmer.
+ *
+ * The host uploads the blocks of all images at the speed of the UART,
+ * after that the programmer sends them on the bus without the host.
+ * The store stays valid, so later bus segments get the same images
+ * without another upload.
+ *
+ * The store is the upper half of the flash. The first page holds the
+ * header, the block records follow from the next 4kB. Every record is
+ * followed by the data of its block.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "LPC17xx.h"
+
+#include "store.h"
+#include "iap.h"
+#include "hash.h"
+
+/** The magic word of a complete store, "STOR" */
+#define STORE_MAGIC       0x53544F52
+
+/** The address of the first sector of the store */
+#define STORE_ADDRESS     0x40000
+
+/** The size of the physical sectors of the store */
+#define STORE_SECTOR_SIZE 32768
+
+/** The size of the page the header is written in */
+#define STORE_PAGE_SIZE   256
+
+/**
+ * Write a piece of the store and compare it.
+ *
+ * The flash can not be read while IAP writes, so
+ * interrupts are disabled for the duration.
+ * @param[in] offset The offset in the store, the piece stays in one sector.
+ * @param[in] data The word aligned data in RAM.
+ * @param[in] length The size of the piece, a size IAP can write.
+ * @return 1 if the piece is in flash, 0 otherwise.
+ */
+static uint8_t program( uint32_t offset, uint8_t *data, uint16_t length ) {
+	uint8_t sector = STORE_FIRST_SECTOR + offset / STORE_SECTOR_SIZE;
+	uint16_t sectorOffset = offset % STORE_SECTOR_SIZE;
+
+	__disable_irq();
+	uint8_t result = prepareFlash( sector ) == CMD_SUCCESS &&
+	                 writeFlash( data, sector, sectorOffset, length ) == CMD_SUCCESS &&
+	                 compareFlash( data, sector, sectorOffset, length ) == CMD_SUCCESS;
+	__enable_irq();
+
+	return result;
+}
+
+/**
+ * Start a new store, the sectors it needs are erased.
+ * @param[in] header The header of the new store.
+ * @return 1 if the blocks can be written, 0 if they do not fit.
+ */
+uint8_t storeBegin( StoreHeader *header ) {
+	if ( header->length > STORE_SIZE || header->streams > STREAM_COUNT ) {
+		return 0;
+	}
+
+	uint8_t last = STORE_FIRST_SECTOR + ( STORE_HEADER_SIZE + header->length ) / STORE_SECTOR_SIZE;
+	if ( last >= STORE_FIRST_SECTOR + STORE_SECTORS ) {
+		last = STORE_FIRST_SECTOR + STORE_SECTORS - 1;
+	}
+
+	uint8_t sector;
+	for ( sector = STORE_FIRST_SECTOR; sector <= last; sector++ ) {
+		__disable_irq();
+		uint8_t result = prepareFlash( sector ) == CMD_SUCCESS &&
+		                 blankFlash( sector ) == CMD_SUCCESS;
+		__enable_irq();
+		if ( !result ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Write the next piece of block records.
+ * @param[in] offset The offset of the piece in the block records.
+ * @param[in] data The word aligned piece, STORE_PIECE_SIZE bytes.
+ * @return 1 if the piece is in flash, 0 otherwise.
+ */
+uint8_t storeWrite( uint32_t offset, uint8_t *data ) {
+	if ( offset + STORE_PIECE_SIZE > STORE_SIZE ) {
+		return 0;
+	}
+	return program( STORE_HEADER_SIZE + offset, data, STORE_PIECE_SIZE );
+}
+
+/**
+ * Complete the store if the block records match their digest.
+ * @param[in] header The header of the store.
+ * @return 1 if the store is complete, 0 otherwise.
+ */
+uint8_t storeCommit( StoreHeader *header ) {
+	if ( hashData( 0, (const uint8_t *)( STORE_ADDRESS + STORE_HEADER_SIZE ), header->length ) != header->digest ) {
+		return 0;
+	}
+
+	static uint32_t page[STORE_PAGE_SIZE/4];
+	uint16_t i;
+	for ( i = 0; i < STORE_PAGE_SIZE/4; i++ ) {
+		page[i] = 0xFFFFFFFF;
+	}
+	header->magic = STORE_MAGIC;
+	uint32_t *source = (uint32_t *)header;
+	for ( i = 0; i < sizeof(StoreHeader)/4; i++ ) {
+		page[i] = source[i];
+	}
+
+	return program( 0, (uint8_t *)page, STORE_PAGE_SIZE );
+}
+
+/**
+ * Retrieve the header of the store.
+ * @return The header, or 0 if there is no complete store.
+ */
+const StoreHeader *storeHeader( void ) {
+	const StoreHeader *header = (const StoreHeader *)STORE_ADDRESS;
+	return header->magic == STORE_MAGIC ? header : 0;
+}
+
+/**
+ * Find the streams that still need a stored block, a block is
+ * needed if one of its sectors is missing on a node of the stream.
+ * @param[in] header The header of the store.
+ * @param[in] record The record of the block.
+ * @param[in] missing The bitmaps of missing sectors of every stream.
+ * @return The bitmask of streams that need the block.
+ */
+static uint8_t neededStreams( const StoreHeader *header, const StoreRecord *record, uint8_t missing[][RESUME_BITMAP_SIZE] ) {
+	uint8_t sectors = 1;
+	if ( header->shift > 12 ) {
+		sectors = 1 << ( header->shift - 12 );
+	}
+
+	uint8_t streams = 0;
+	uint8_t s;
+	for ( s = 0; s < header->streams; s++ ) {
+		if ( !( record->streams & (1<<s) ) ) {
+			continue;
+		}
+
+		uint8_t sector;
+		for ( sector = record->sector; sector < record->sector + sectors && sector < header->sessions[s].blocks; sector++ ) {
+			if ( missing[s][sector/8] & (1<<(sector%8)) ) {
+				streams |= (1<<s);
+				break;
+			}
+		}
+	}
+	return streams;
+}
+
+/**
+ * Send a stored block on the segments that need it at the same time.
+ *
+ * Every segment sends its next frame as soon as its own pace allows
+ * it, after that the answers of all segments are collected.
+ * @param[in] segments The segments, SEGMENT_COUNT of them.
+ * @param[in] streams The bitmask of streams that need the block, on every segment.
+ * @param[in] record The record of the block.
+ * @param[in] data The word aligned data of the block.
+ * @param[out] unchanged The number of nodes that already had the block.
+ * @return 1 if every segment confirmed the block, 0 otherwise.
+ */
+static uint8_t replayBlock( Segment *segments, uint8_t *streams, const StoreRecord *record, const uint32_t *data, uint32_t *unchanged ) {
+	uint16_t sent[SEGMENT_COUNT];
+	uint8_t s;
+	for ( s = 0; s < SEGMENT_COUNT; s++ ) {
+		sent[s] = record->size;
+		if ( streams[s] ) {
+			protocolBlockBegin( &segments[s], record->sector, record->part, streams[s] );
+			sent[s] = 0;
+		}
+	}
+
+	uint8_t sending;
+	do {
+		sending = 0;
+		for ( s = 0; s < SEGMENT_COUNT; s++ ) {
+			if ( sent[s] == record->size ) {
+				continue;
+			}
+			sending = 1;
+			if ( protocolFrameDue( &segments[s] ) ) {
+				uint16_t left = record->size - sent[s];
+				uint8_t length = left < 8 ? left : 8;
+				protocolBlockFrame( &segments[s], data + sent[s]/4, length );
+				sent[s] += length;
+			} else {
+				protocolPace( &segments[s] );
+			}
+		}
+	} while ( sending );
+
+	// The nodes buffer the messages while they flash, so
+	// stop waiting as soon as every node has answered
+	uint8_t waiting = 0;
+	for ( s = 0; s < SEGMENT_COUNT; s++ ) {
+		if ( streams[s] ) {
+			protocolBlockSeal( &segments[s], streams[s] );
+			waiting |= (1<<s);
+		}
+	}
+	while ( waiting ) {
+		for ( s = 0; s < SEGMENT_COUNT; s++ ) {
+			if ( ( waiting & (1<<s) ) &&
+					( protocolBlockCollect( &segments[s] ) || protocolWindowPassed( &segments[s] ) ) ) {
+				waiting &= ~(1<<s);
+			}
+		}
+	}
+
+	uint8_t success = 1;
+	for ( s = 0; s < SEGMENT_COUNT; s++ ) {
+		if ( streams[s] ) {
+			uint16_t nodes;
+			uint16_t staged;
+			uint8_t stream;
+			uint8_t sector;
+			if ( !protocolBlockResult( &segments[s], &nodes, &staged ) ||
+					protocolBlockLost( &segments[s], &stream, &sector ) ) {
+				success = 0;
+			}
+			*unchanged += nodes;
+		}
+	}
+	return success;
+}
+
+/**
+ * Send the stored blocks to the nodes, without the host.
+ *
+ * The sessions of the stored images are started first and only
+ * the blocks the nodes still miss are sent, straight from flash.
+ * A block is sent on all segments that miss it at the same time.
+ * @param[in] segments The segments to program, SEGMENT_COUNT of them.
+ * @param[out] sent The number of blocks all nodes confirmed.
+ * @param[out] failed The number of blocks not all nodes confirmed.
+ * @param[out] unchanged The number of blocks nodes already had.
+ * @return 1 if the store was sent, 0 if there is no store or the
+ *         nodes refused its block size.
+ */
+uint8_t storeReplay( Segment *segments, uint16_t *sent, uint16_t *failed, uint32_t *unchanged ) {
+	*sent      = 0;
+	*failed    = 0;
+	*unchanged = 0;
+
+	const StoreHeader *header = storeHeader();
+	if ( !header ) {
+		return 0;
+	}
+
+	static uint8_t missing[SEGMENT_COUNT][STREAM_COUNT][RESUME_BITMAP_SIZE];
+	uint8_t g, s;
+	for ( g = 0; g < SEGMENT_COUNT; g++ ) {
+		for ( s = 0; s < header->streams; s++ ) {
+			const StoreSession *session = &header->sessions[s];
+			if ( protocolResume( &segments[g], s, session->image, session->blocks, session->base, header->shift, missing[g][s] ) != header->shift ) {
+				return 0;
+			}
+		}
+	}
+
+	const uint8_t *position = (const uint8_t *)( STORE_ADDRESS + STORE_HEADER_SIZE );
+	uint16_t i;
+	for ( i = 0; i < header->blocks; i++ ) {
+		const StoreRecord *record = (const StoreRecord *)position;
+		const uint32_t *data = (const uint32_t *)( position + sizeof(StoreRecord) );
+		position = (const uint8_t *)data + record->size;
+
+		uint8_t streams[SEGMENT_COUNT];
+		uint8_t needed = 0;
+		for ( g = 0; g < SEGMENT_COUNT; g++ ) {
+			streams[g] = neededStreams( header, record, missing[g] );
+			needed |= streams[g];
+		}
+		if ( !needed ) {
+			continue;
+		}
+
+		if ( replayBlock( segments, streams, record, data, unchanged ) ) {
+			++(*sent);
+		} else {
+			++(*failed);
+		}
+	}
+	return 1;
+}
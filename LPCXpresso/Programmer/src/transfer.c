@@ -0,0 +1,482 @@
+/**
+ *     ______       _       ____  _____   ______                    _   __                       __
+ *   .' ___  |     / \     |_   \|_   _| |_   _ \                  / |_[  |                     |  ]
+ *  / .'   \_|    / _ \      |   \ | |     | |_) |   .--.    .--. `| |-'| |  .--.   ,--.    .--.| | .---.  _ .--.
+ *  | |          / ___ \     | |\ \| |     |  __'. / .'`\ \/ .'`\ \| |  | |/ .'`\ \`'_\ : / /'`\' |/ /__\\[ `/'`\]
+ *  \ `.___.'\ _/ /   \ \_  _| |_\   |_   _| |__) || \__. || \__. || |, | || \__. |// | |,| \__/  || \__., | |
+ *   `.____ .'|____| |____||_____|\____| |_______/  '.__.'  '.__.' \__/[___]'.__.' \'-;__/ '.__.;__]'.__.'[___]
+ *
+ * ===============================================================================================================
+ *
+ * The transfer of blocks from the host to the nodes.
+ *
+ * The host sends a block as its sector, its part of the sector, the
+ * bitmask of the image streams that contain it, its size, the data
+ * and the mark 0x03. The data is sent in pieces of up to 4kB, one
+ * piece for every TRANSFER_CREDIT the host got. So the next piece
+ * is received while the buses send the last one and the nodes flash
+ * and confirm a block, and the UART never overruns.
+ *
+ * The host task puts the received blocks in a queue and their data in
+ * the pieces. Every segment has its own bus task, it sends the queued
+ * blocks a frame at a time and collects the answers of its nodes, so
+ * all segments are programmed at the same time. The frames are paced
+ * per segment, a node that falls behind asks the programmer to slow
+ * down its own bus. A piece is free once every segment has sent it.
+ *
+ * The result of a block is sent to the host once every segment is done
+ * with it, in the order of the blocks. As before it is the result, the
+ * number of nodes that already had the block and the mark 0x03, the
+ * block only succeeds if it succeeded on every segment.
+ *
+ * If the host breaks the format, a wrong mark after a block or at the
+ * end, the transfer is aborted and the host gets TRANSFER_ERROR instead
+ * of the results that are still to come.
+ *
+ * @author Chiel de Roest <M.A.deRoest@student.tudelft.nl> and Harmjan Treep <harmjan.treep@gmail.com>
+ */
+
+#include "transfer.h"
+#include "scheduler.h"
+#include "host.h"
+#include "uart.h"
+
+#include <cr_section_macros.h>
+
+/**
+ * The state of the host task.
+ */
+typedef enum {
+	HOST_HEADER = 0, /** Receiving the header of a block */
+	HOST_DATA   = 1, /** Receiving the data of a block */
+	HOST_MARK   = 2, /** Waiting for the end of a block */
+	HOST_END    = 3, /** Waiting for the end of the transfer */
+	HOST_DONE   = 4  /** All blocks are received */
+} HostState;
+
+/**
+ * The state of a bus task.
+ */
+typedef enum {
+	BUS_IDLE   = 0, /** Waiting for a block */
+	BUS_BEGIN  = 1, /** Waiting to announce a block */
+	BUS_STREAM = 2, /** Sending the data of a block */
+	BUS_ACK    = 3  /** Collecting the answers of the nodes */
+} BusState;
+
+/**
+ * A block that is announced by the host.
+ */
+typedef struct {
+	uint8_t  sector;
+	uint8_t  part;
+	uint8_t  streams;
+	uint16_t size;
+	uint8_t  pending;    /** The segments that did not finish the block */
+	uint8_t  success;    /** If every segment that finished confirmed the block */
+	uint16_t unchanged;  /** The number of nodes that already had the block */
+	uint16_t staged;     /** The number of nodes that write the block with the rest of its sector */
+	uint8_t  lostStream; /** The stream of a node that lost blocks it reported as pending */
+	uint8_t  lostSector; /** The virtual sector in the image of the first lost block */
+	uint8_t  lostBlocks; /** The bitmap of the lost blocks from lostSector on, 0 if none were lost */
+} QueuedBlock;
+
+/**
+ * The task that sends the blocks on the bus of a segment.
+ */
+typedef struct {
+	BusState state;
+	uint8_t  done;      /** The number of queued blocks this segment finished */
+	uint8_t  pieceOut;  /** The piece that is sent */
+	uint16_t pieceSent; /** The number of bytes of the piece that are sent */
+	uint16_t busLeft;   /** The number of bytes of the block that are still to send */
+} BusTask;
+
+/** The size of the header of a block */
+#define HEADER_SIZE 5
+
+/** If a transfer is running */
+static uint8_t active = 0;
+
+/** The bitmask of the segments the blocks are sent on, the disabled segments are skipped */
+static uint8_t segmentMask;
+
+static HostState hostState;
+static BusTask buses[SEGMENT_COUNT];
+
+/** The segments that are programmed */
+static Segment *segments;
+
+/** The number of blocks of which the header is still to come */
+static uint16_t blocksLeft;
+
+/** The header that is being received */
+static uint8_t header[HEADER_SIZE];
+static uint8_t headerLength;
+
+/** The number of bytes of the block that are still to come from the host */
+static uint16_t dataLeft;
+
+/** The blocks that are received but not reported, the head is the oldest */
+static QueuedBlock blocks[BLOCK_QUEUE_SIZE];
+static uint8_t blockHead;
+static uint8_t blockCount;
+
+/** The pieces of data, they are word aligned for the frames and too large for the main RAM bank */
+__BSS(RAM2) static uint32_t pieces[PIECE_COUNT][PIECE_SIZE/4];
+
+/** The size of every piece */
+static uint16_t pieceLength[PIECE_COUNT];
+
+/** The segments that still have to send every piece, 0 if the piece is free */
+static uint8_t pieceUsers[PIECE_COUNT];
+
+/** The piece the host task fills and the number of bytes in it */
+static uint8_t pieceIn;
+static uint16_t pieceFill;
+
+static void busStart( Segment *segment );
+static void busStream( Segment *segment );
+static void busAnswer( Segment *segment );
+static void busTimeout( Segment *segment );
+static void busResult( Segment *segment );
+static void reportBlocks( void );
+static void transferAbort( void );
+
+/**
+ * Start the transfer of a number of blocks, the host
+ * gets a credit for every piece.
+ *
+ * @param[in] segmentList The segments to program, SEGMENT_COUNT of them.
+ * @param[in] count The number of blocks the host sends.
+ */
+void transferStart( Segment *segmentList, uint16_t count ) {
+
+	segments     = segmentList;
+	active       = 1;
+	blocksLeft   = count;
+	hostState    = count > 0 ? HOST_HEADER : HOST_END;
+	headerLength = 0;
+	blockHead    = 0;
+	blockCount   = 0;
+	pieceIn      = 0;
+	pieceFill    = 0;
+	segmentMask  = 0;
+
+	uint8_t i;
+	for ( i=0; i<SEGMENT_COUNT; i++ ) {
+		if ( segments[i].enabled ) {
+			segmentMask |= (1<<i);
+		}
+		buses[i].state     = BUS_IDLE;
+		buses[i].done      = 0;
+		buses[i].pieceOut  = 0;
+		buses[i].pieceSent = 0;
+	}
+	for ( i=0; i<PIECE_COUNT; i++ ) {
+		pieceUsers[i] = 0;
+		hostSendResponse( TRANSFER_CREDIT );
+	}
+
+}
+
+/**
+ * Return if a transfer is running, the bytes from the
+ * host are for transferHost until it is done.
+ */
+uint8_t transferActive( void ) {
+	return active;
+}
+
+/**
+ * A piece buffer for the other commands, while no transfer runs.
+ */
+uint32_t *transferPiece( void ) {
+	return pieces[0];
+}
+
+/**
+ * Handle the bytes of the host that are received so far.
+ */
+void transferHost( void ) {
+
+	while ( uartAvailable() > 0 ) {
+		switch ( hostState ) {
+		case HOST_HEADER:
+			if ( blockCount == BLOCK_QUEUE_SIZE ) {
+				return; // Wait for the buses
+			}
+			headerLength += uartRead( header + headerLength, HEADER_SIZE - headerLength );
+			if ( headerLength == HEADER_SIZE ) {
+				QueuedBlock *block = &blocks[(blockHead + blockCount) % BLOCK_QUEUE_SIZE];
+				block->sector     = header[0];
+				block->part       = header[1];
+				block->streams    = header[2];
+				block->size       = header[3] | (header[4] << 8);
+				block->pending    = segmentMask;
+				block->success    = 1;
+				block->unchanged  = 0;
+				block->staged     = 0;
+				block->lostBlocks = 0;
+				++blockCount;
+
+				headerLength = 0;
+				dataLeft     = block->size;
+				hostState    = dataLeft > 0 ? HOST_DATA : HOST_MARK;
+
+				uint8_t i;
+				for ( i=0; i<SEGMENT_COUNT; i++ ) {
+					busStart( &segments[i] );
+				}
+			}
+			break;
+		case HOST_DATA:
+			if ( pieceUsers[pieceIn] ) {
+				return; // The host has no credit, wait for the buses
+			}
+			{
+				uint16_t size = dataLeft < PIECE_SIZE ? dataLeft : PIECE_SIZE;
+				pieceFill += uartRead( (uint8_t *)pieces[pieceIn] + pieceFill, size - pieceFill );
+				if ( pieceFill == size ) {
+					pieceLength[pieceIn] = size;
+					pieceUsers[pieceIn]  = segmentMask;
+					pieceIn   = (pieceIn + 1) % PIECE_COUNT;
+					pieceFill = 0;
+					dataLeft -= size;
+					if ( dataLeft == 0 ) {
+						hostState = HOST_MARK;
+					}
+				}
+			}
+			break;
+		case HOST_MARK:
+			{
+				uint8_t mark;
+				uartRead( &mark, 1 );
+				if ( mark != 0x03 ) {
+					transferAbort();
+					return;
+				}
+				hostState = --blocksLeft > 0 ? HOST_HEADER : HOST_END;
+				reportBlocks(); // Without a segment the block is done already
+			}
+			break;
+		case HOST_END:
+			{
+				uint8_t mark;
+				uartRead( &mark, 1 );
+				if ( mark != 0x04 ) {
+					transferAbort();
+					return;
+				}
+				hostState = HOST_DONE;
+				reportBlocks();
+			}
+			break;
+		case HOST_DONE:
+			return; // The rest is for the next command
+		}
+	}
+
+}
+
+/**
+ * Start the next block of a segment on its bus, if the
+ * segment is idle and the host announced the block.
+ *
+ * @param[in] segment The segment.
+ */
+static void busStart( Segment *segment ) {
+
+	BusTask *bus = &buses[segment->index];
+	if ( !segment->enabled || bus->state != BUS_IDLE || bus->done == blockCount ) {
+		return;
+	}
+
+	bus->state = BUS_BEGIN;
+	schedulerSubscribe( EVENT_CAN_TX, segment, busStream );
+	schedulerSubscribe( EVENT_CAN_RX, segment, protocolPace );
+
+}
+
+/**
+ * Announce the next block or send its next frame, the transmit
+ * buffer of the segment is free.
+ *
+ * @param[in] segment The segment.
+ */
+static void busStream( Segment *segment ) {
+
+	if ( !protocolFrameDue( segment ) ) {
+		return; // Keep the gap the nodes need
+	}
+
+	BusTask *bus = &buses[segment->index];
+	QueuedBlock *block = &blocks[(blockHead + bus->done) % BLOCK_QUEUE_SIZE];
+
+	if ( bus->state == BUS_BEGIN ) {
+		protocolBlockBegin( segment, block->sector, block->part, block->streams );
+		bus->busLeft = block->size;
+		bus->state   = BUS_STREAM;
+		return;
+	}
+
+	if ( bus->busLeft == 0 ) {
+		// All data is on the bus, send the hash
+		schedulerSubscribe( EVENT_CAN_TX, segment, 0 );
+		schedulerSubscribe( EVENT_CAN_RX, segment, 0 );
+		bus->state = BUS_ACK;
+		protocolBlockSeal( segment, block->streams );
+		if ( protocolBlockCollect( segment ) ) {
+			busResult( segment );
+		} else {
+			schedulerSubscribe( EVENT_CAN_RX, segment, busAnswer );
+			schedulerSubscribe( EVENT_TIMER, segment, busTimeout );
+		}
+		return;
+	}
+
+	uint8_t self = (1 << segment->index);
+	if ( !(pieceUsers[bus->pieceOut] & self) ) {
+		return; // Wait for the host
+	}
+
+	uint16_t left  = pieceLength[bus->pieceOut] - bus->pieceSent;
+	uint8_t length = left < 8 ? left : 8;
+	protocolBlockFrame( segment, pieces[bus->pieceOut] + bus->pieceSent/4, length );
+	bus->pieceSent += length;
+	bus->busLeft   -= length;
+
+	// The piece is sent, the host may send another
+	// once every segment has sent it
+	if ( bus->pieceSent == pieceLength[bus->pieceOut] ) {
+		pieceUsers[bus->pieceOut] &= ~self;
+		if ( !pieceUsers[bus->pieceOut] ) {
+			hostSendResponse( TRANSFER_CREDIT );
+		}
+		bus->pieceOut  = (bus->pieceOut + 1) % PIECE_COUNT;
+		bus->pieceSent = 0;
+	}
+
+}
+
+/**
+ * Take the answers of the nodes of a segment.
+ *
+ * @param[in] segment The segment.
+ */
+static void busAnswer( Segment *segment ) {
+	if ( protocolBlockCollect( segment ) ) {
+		busResult( segment );
+	}
+}
+
+/**
+ * Not every node of a segment answered in time.
+ *
+ * @param[in] segment The segment.
+ */
+static void busTimeout( Segment *segment ) {
+	protocolBlockCollect( segment );
+	busResult( segment );
+}
+
+/**
+ * Add the result of a segment to its block and start its next block.
+ *
+ * @param[in] segment The segment.
+ */
+static void busResult( Segment *segment ) {
+
+	schedulerSubscribe( EVENT_CAN_RX, segment, 0 );
+	schedulerSubscribe( EVENT_TIMER, segment, 0 );
+
+	BusTask *bus = &buses[segment->index];
+	QueuedBlock *block = &blocks[(blockHead + bus->done) % BLOCK_QUEUE_SIZE];
+
+	uint16_t unchanged;
+	uint16_t staged;
+	if ( !protocolBlockResult( segment, &unchanged, &staged ) ) {
+		block->success = 0;
+	}
+	block->unchanged += unchanged;
+	block->staged    += staged;
+	block->pending   &= ~(1 << segment->index);
+
+	// The lost blocks are reported before the result of this block
+	if ( !block->lostBlocks ) {
+		block->lostBlocks = protocolBlockLost( segment, &block->lostStream, &block->lostSector );
+	}
+
+	++bus->done;
+	bus->state = BUS_IDLE;
+	reportBlocks();
+	busStart( segment );
+
+}
+
+/**
+ * Send the results of the blocks every segment finished to the host,
+ * in order, and end the transfer once every block is reported.
+ */
+static void reportBlocks( void ) {
+
+	while ( blockCount > 0 && !blocks[blockHead].pending ) {
+		QueuedBlock *block = &blocks[blockHead];
+		if ( block->lostBlocks ) {
+			hostSendResponse( TRANSFER_LOST ); // Blocks that were confirmed as pending could not be written
+			hostSendResponse( block->lostStream );
+			hostSendResponse( block->lostSector );
+			hostSendResponse( block->lostBlocks );
+		}
+		hostSendResponse( block->success );  // Send result of programming of block
+		hostSendData( (uint8_t *)&block->unchanged, sizeof(block->unchanged) ); // Send the number of nodes that already had the block
+		hostSendData( (uint8_t *)&block->staged, sizeof(block->staged) ); // Send the number of nodes that did not write the block yet
+		hostSendResponse( 0x03 );
+
+		blockHead = (blockHead + 1) % BLOCK_QUEUE_SIZE;
+		--blockCount;
+
+		uint8_t i;
+		for ( i=0; i<SEGMENT_COUNT; i++ ) {
+			if ( segmentMask & (1<<i) ) {
+				--buses[i].done;
+			}
+		}
+	}
+
+	if ( blockCount == 0 && hostState == HOST_DONE ) {
+		active = 0;
+		hostSendResponse( 0x04 );
+	}
+
+}
+
+/**
+ * Abort the transfer, the host broke the format.
+ *
+ * The bus tasks stop, the nodes drop the block they did not
+ * get completely. What the host sent so far is discarded,
+ * after TRANSFER_ERROR it starts again with a new command.
+ */
+static void transferAbort( void ) {
+
+	uint8_t i;
+	for ( i=0; i<SEGMENT_COUNT; i++ ) {
+		schedulerSubscribe( EVENT_CAN_TX, &segments[i], 0 );
+		schedulerSubscribe( EVENT_CAN_RX, &segments[i], 0 );
+		schedulerSubscribe( EVENT_TIMER, &segments[i], 0 );
+		buses[i].state = BUS_IDLE;
+	}
+
+	uint8_t discard;
+	while ( uartAvailable() > 0 ) {
+		uartRead( &discard, 1 );
+	}
+
+	blockCount = 0;
+	hostState  = HOST_DONE;
+	active     = 0;
+	hostSendResponse( TRANSFER_ERROR );
+
+}